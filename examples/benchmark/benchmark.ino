@@ -0,0 +1,584 @@
+/**
+ * Benchmarks the FTPClient against the in process FTPLoopbackServer: no
+ * network or FTP server is needed. The results are printed as JSON.
+ * - control latency: NOOP round trip in us
+ * - small files: open/read/close operations per second
+ * - large files: download and upload in MB/s (download also with the
+ *   callback of FTPClient::read())
+ * - copy: FTPClient::download() and upload() compared with a loop over
+ *   small reads and writes, with a fast and with a slow local stream
+ * - small writes: println() of short lines in lines per second and the
+ *   number of writes of the client with and without the write buffer
+ * - line reads: readln() of the log file in lines per second with and
+ *   without the read-ahead buffer
+ * - listings: NLST and MLSD entries per second, peak heap and number of
+ *   allocations, compared with reading the lines into a String as the
+ *   FTPFileIterator did before
+ * - tree walk: entries per second with 1 and 4 sessions and latency
+ * - MODE Z: download and upload of a log file in MB/s with and without
+ *   compression over a slow data connection
+ * - peak heap in bytes including the loopback server (desktop only)
+ * The durations are measured with micros().
+ */
+#include "FTPClient.h"
+#include "FTPLoopback.h"
+
+#define SMALL_FILES 200
+#define LARGE_FILE_SIZE (8l * 1024 * 1024)
+#define LISTING_ENTRIES 2000
+#define TREE_DIRS 10
+#define TREE_SUBDIRS 10
+#define TREE_FILES 20
+#define LATENCY_SAMPLES 500
+#define INJECTED_LATENCY_MS 2
+#define LOG_FILE_SIZE (2l * 1024 * 1024)
+#define SLOW_BANDWIDTH (1024l * 1024)
+#define NAIVE_CHUNK_SIZE 100
+#define MEDIUM_FILE_SIZE (1024l * 1024)
+#define SMALL_WRITE_LINES 2000
+#define WRITE_BUFFER_SIZE 1460
+#define READ_BUFFER_SIZE 4096
+
+static size_t heap_used = 0;
+static size_t heap_peak = 0;
+static long heap_allocations = 0;
+static size_t heap_section_start = 0;
+static size_t heap_section_peak = 0;
+static long heap_section_allocations = 0;
+
+void addHeap(size_t size) {
+  heap_used += size;
+  heap_allocations++;
+  if (heap_used > heap_peak) heap_peak = heap_used;
+  if (heap_used > heap_section_peak) heap_section_peak = heap_used;
+}
+
+void removeHeap(size_t size) { heap_used -= size; }
+
+#if defined(IS_DESKTOP) && defined(__GLIBC__)
+// track the heap with malloc(), which is also used by new and by the Arduino
+// String: the loopback server runs in the same process, so its files and
+// session buffers are counted as well
+#include <malloc.h>
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void __libc_free(void *ptr);
+
+void *malloc(size_t size) {
+  void *ptr = __libc_malloc(size);
+  if (ptr != nullptr) addHeap(malloc_usable_size(ptr));
+  return ptr;
+}
+void *calloc(size_t count, size_t size) {
+  void *ptr = __libc_calloc(count, size);
+  if (ptr != nullptr) addHeap(malloc_usable_size(ptr));
+  return ptr;
+}
+void *realloc(void *ptr, size_t size) {
+  size_t old_size = ptr != nullptr ? malloc_usable_size(ptr) : 0;
+  void *result = __libc_realloc(ptr, size);
+  if (result == nullptr) return result;
+  removeHeap(old_size);
+  addHeap(malloc_usable_size(result));
+  return result;
+}
+void free(void *ptr) {
+  if (ptr != nullptr) removeHeap(malloc_usable_size(ptr));
+  __libc_free(ptr);
+}
+}
+#elif defined(IS_DESKTOP)
+// track the heap which is allocated with new: the loopback server runs in
+// the same process, so its files and session buffers are counted as well
+#include <new>
+struct HeapHeader {
+  size_t size;
+  size_t padding;
+};
+
+void *operator new(size_t size) {
+  HeapHeader *header = (HeapHeader *)malloc(sizeof(HeapHeader) + size);
+  if (header == nullptr) throw std::bad_alloc();
+  header->size = size;
+  addHeap(size);
+  return header + 1;
+}
+void *operator new[](size_t size) { return operator new(size); }
+void operator delete(void *ptr) noexcept {
+  if (ptr == nullptr) return;
+  HeapHeader *header = (HeapHeader *)ptr - 1;
+  removeHeap(header->size);
+  free(header);
+}
+void operator delete[](void *ptr) noexcept { operator delete(ptr); }
+void operator delete(void *ptr, size_t) noexcept { operator delete(ptr); }
+void operator delete[](void *ptr, size_t) noexcept { operator delete(ptr); }
+#endif
+
+/// Starts the measurement of the heap which is used by a single benchmark
+void startHeapSection() {
+  heap_section_start = heap_used;
+  heap_section_peak = heap_used;
+  heap_section_allocations = heap_allocations;
+}
+
+/// Provides the peak heap since startHeapSection() in bytes
+size_t heapSection() { return heap_section_peak - heap_section_start; }
+
+/// Provides the number of allocations since startHeapSection()
+long heapSectionAllocations() {
+  return heap_allocations - heap_section_allocations;
+}
+
+FTPLoopbackServer server;
+FTPClient<FTPLoopbackClient> client;
+uint8_t buffer[4096];
+char json[128];
+
+/// Converts the number of bytes which were transferred in the time in us
+double mbPerSec(double bytes, unsigned long us) {
+  return bytes / 1048576.0 * 1000000.0 / (us > 0 ? us : 1);
+}
+
+/// Converts the number of operations in the time in us into a rate
+double perSec(double count, unsigned long us) {
+  return count * 1000000.0 / (us > 0 ? us : 1);
+}
+
+void printResult(const char *name, double value, const char *unit,
+                 bool isLast = false) {
+  snprintf(json, sizeof(json), "  \"%s_%s\": %.3f%s", name, unit, value,
+           isLast ? "" : ",");
+  Serial.println(json);
+}
+
+/// NOOP round trips: mean, median and 99th percentile in us
+void benchmarkLatency(const char *name, unsigned long latencyMs) {
+  static unsigned long samples[LATENCY_SAMPLES];
+  server.setLatency(latencyMs);
+  auto lease = client.sessionMgr().acquire();
+  int count = latencyMs > 0 ? LATENCY_SAMPLES / 10 : LATENCY_SAMPLES;
+  double sum = 0;
+  for (int j = 0; j < count; j++) {
+    unsigned long start = micros();
+    lease.api().noop();
+    samples[j] = micros() - start;
+    sum += samples[j];
+  }
+  server.setLatency(0);
+  // sort the samples to determine the percentiles
+  for (int j = 1; j < count; j++) {
+    unsigned long value = samples[j];
+    int k = j - 1;
+    while (k >= 0 && samples[k] > value) {
+      samples[k + 1] = samples[k];
+      k--;
+    }
+    samples[k + 1] = value;
+  }
+  char key[40];
+  snprintf(key, sizeof(key), "%s_mean", name);
+  printResult(key, sum / count, "us");
+  snprintf(key, sizeof(key), "%s_p50", name);
+  printResult(key, samples[count / 2], "us");
+  snprintf(key, sizeof(key), "%s_p99", name);
+  printResult(key, samples[count * 99 / 100], "us");
+}
+
+/// open, read and close of small files
+void benchmarkSmallFiles() {
+  char path[40];
+  for (int j = 0; j < SMALL_FILES; j++) {
+    snprintf(path, sizeof(path), "/small/file%d.txt", j);
+    server.addFile(path, (uint64_t)100);
+  }
+  unsigned long start = micros();
+  for (int j = 0; j < SMALL_FILES; j++) {
+    snprintf(path, sizeof(path), "/small/file%d.txt", j);
+    FTPFile file = client.open(path);
+    while (file.readBytes(buffer, sizeof(buffer)) > 0);
+    file.close();
+  }
+  unsigned long us = micros() - start;
+  printResult("small_files", perSec(SMALL_FILES, us), "ops_per_sec");
+}
+
+void benchmarkDownload() {
+  server.addFile("/large.bin", (uint64_t)LARGE_FILE_SIZE);
+  unsigned long start = micros();
+  FTPFile file = client.open("/large.bin");
+  long total = 0;
+  int len;
+  while ((len = file.readBytes(buffer, sizeof(buffer))) > 0) total += len;
+  file.close();
+  unsigned long us = micros() - start;
+  printResult("download", mbPerSec(total, us), "mb_per_sec");
+}
+
+bool countData(const uint8_t *data, size_t len, void *ref) {
+  *(long *)ref += len;
+  return true;
+}
+
+/// Download with the callback which receives the data without copying it
+void benchmarkDownloadCallback() {
+  unsigned long start = micros();
+  long total = 0;
+  client.read("/large.bin", countData, &total);
+  unsigned long us = micros() - start;
+  printResult("download_callback", mbPerSec(total, us), "mb_per_sec");
+}
+
+void benchmarkUpload() {
+  memset(buffer, 'x', sizeof(buffer));
+  unsigned long start = micros();
+  FTPFile file = client.open("/upload.bin", WRITE_MODE);
+  long total = 0;
+  while (total < LARGE_FILE_SIZE) total += file.write(buffer, sizeof(buffer));
+  file.close();
+  unsigned long us = micros() - start;
+  printResult("upload", mbPerSec(total, us), "mb_per_sec");
+  server.remove("/upload.bin");
+}
+
+/**
+ * Local stream which discards the written data and provides zeros: with a
+ * rate it behaves like a slow storage which blocks writes until it can
+ * accept the data
+ */
+class LocalStream : public Stream {
+ public:
+  void begin(long size, long bytesPerSec = 0) {
+    remaining = size;
+    rate = bytesPerSec;
+    budget = 0;
+    last = millis();
+  }
+  int available() override { return remaining; }
+  int read() override { return remaining > 0 ? (remaining--, 0) : -1; }
+  int peek() override { return remaining > 0 ? 0 : -1; }
+  size_t readBytes(uint8_t *data, size_t len) {
+    if ((long)len > remaining) len = remaining;
+    memset(data, 0, len);
+    remaining -= len;
+    return len;
+  }
+  int availableForWrite() override {
+    if (rate == 0) return 0;
+    refill();
+    return budget;
+  }
+  size_t write(uint8_t value) override { return write(&value, 1); }
+  size_t write(const uint8_t *data, size_t len) override {
+    if (rate == 0) return len;
+    refill();
+    while (budget < (long)len) {
+      delay(1);
+      refill();
+    }
+    budget -= len;
+    return len;
+  }
+
+ protected:
+  long remaining = 0;
+  long rate = 0;
+  long budget = 0;
+  unsigned long last = 0;
+  void refill() {
+    unsigned long now = millis();
+    budget += (now - last) * rate / 1000;
+    if (budget > 4096) budget = 4096;
+    last = now;
+  }
+};
+LocalStream local;
+
+/// Download with a loop over small reads as in the download example
+void benchmarkCopyNaive(const char *name, const char *path, long localRate) {
+  local.begin(0, localRate);
+  uint8_t data[NAIVE_CHUNK_SIZE];
+  unsigned long start = micros();
+  FTPFile file = client.open(path);
+  long total = 0;
+  int len;
+  while ((len = file.readBytes(data, sizeof(data))) > 0) {
+    local.write(data, len);
+    total += len;
+  }
+  file.close();
+  unsigned long us = micros() - start;
+  printResult(name, mbPerSec(total, us), "mb_per_sec");
+}
+
+/// Download with the double buffered FTPClient::download()
+void benchmarkCopyDownload(const char *name, const char *path,
+                           long localRate) {
+  local.begin(0, localRate);
+  unsigned long start = micros();
+  client.download(path, local);
+  unsigned long us = micros() - start;
+  long total = server.find(path)->size;
+  printResult(name, mbPerSec(total, us), "mb_per_sec");
+}
+
+/// Upload with a loop over small writes and with FTPClient::upload()
+void benchmarkCopyUpload() {
+  uint8_t data[NAIVE_CHUNK_SIZE];
+  local.begin(LARGE_FILE_SIZE);
+  unsigned long start = micros();
+  FTPFile file = client.open("/upload.bin", WRITE_MODE);
+  int len;
+  while ((len = local.readBytes(data, sizeof(data))) > 0) {
+    file.write(data, len);
+  }
+  file.close();
+  unsigned long us = micros() - start;
+  printResult("copy_upload_naive", mbPerSec(LARGE_FILE_SIZE, us), "mb_per_sec");
+
+  local.begin(LARGE_FILE_SIZE);
+  start = micros();
+  client.upload(local, "/upload.bin");
+  us = micros() - start;
+  printResult("copy_upload", mbPerSec(LARGE_FILE_SIZE, us), "mb_per_sec");
+  server.remove("/upload.bin");
+}
+
+/// Copy between the remote file and a fast or slow local stream
+void benchmarkCopy() {
+  benchmarkCopyNaive("copy_download_naive", "/large.bin", 0);
+  benchmarkCopyDownload("copy_download", "/large.bin", 0);
+  benchmarkCopyUpload();
+  // slow network and slow storage
+  server.addFile("/medium.bin", (uint64_t)MEDIUM_FILE_SIZE);
+  server.setBandwidth(SLOW_BANDWIDTH);
+  benchmarkCopyNaive("copy_download_slow_naive", "/medium.bin",
+                     SLOW_BANDWIDTH);
+  benchmarkCopyDownload("copy_download_slow", "/medium.bin", SLOW_BANDWIDTH);
+  server.setBandwidth(0);
+  server.remove("/medium.bin");
+}
+
+/// Upload of short lines with println(): each line needs 2 writes without
+/// the write buffer. The writes include the commands to open the file.
+void benchmarkSmallWrites(const char *name, size_t bufferSize) {
+  char key[40];
+  client.setWriteBufferSize(bufferSize);
+  unsigned long writes = server.writeCount();
+  unsigned long start = micros();
+  FTPFile file = client.open("/lines.txt", WRITE_MODE);
+  for (int j = 0; j < SMALL_WRITE_LINES; j++) file.println("sensor 1: 21.5 C");
+  file.close();
+  unsigned long us = micros() - start;
+  printResult(name, perSec(SMALL_WRITE_LINES, us), "lines_per_sec");
+  snprintf(key, sizeof(key), "%s_writes", name);
+  printResult(key, server.writeCount() - writes, "count");
+  client.setWriteBufferSize(0);
+  server.remove("/lines.txt");
+}
+
+/// Download of the log file line by line with readln()
+void benchmarkReadLines(const char *name, size_t bufferSize) {
+  char line[120];
+  client.setReadBufferSize(bufferSize);
+  long count = 0;
+  unsigned long start = micros();
+  FTPFile file = client.open("/log.txt");
+  while (file.readln(line, sizeof(line)) > 0) count++;
+  file.close();
+  unsigned long us = micros() - start;
+  printResult(name, perSec(count, us), "lines_per_sec");
+  client.setReadBufferSize(0);
+}
+
+/// Prints the listing rate and the peak heap of the listing
+void printListing(const char *name, long count, unsigned long us) {
+  char key[40];
+  printResult(name, perSec(count, us), "entries_per_sec");
+  snprintf(key, sizeof(key), "%s_heap", name);
+  printResult(key, heapSection(), "bytes");
+  snprintf(key, sizeof(key), "%s_allocations", name);
+  printResult(key, heapSectionAllocations(), "count");
+}
+
+/// Directory listings with the names from the fixed line buffer
+void benchmarkListing(const char *name, ListMode mode) {
+  startHeapSection();
+  unsigned long start = micros();
+  long count = 0;
+  FTPFileIterator list = client.ls("/list", mode);
+  for (FTPFileIterator &it = list.begin(); it != list.end(); ++it) count++;
+  unsigned long us = micros() - start;
+  printListing(name, count, us);
+}
+
+/// Directory listing with readStringUntil() into a String for each line as
+/// in the FTPFileIterator before the fixed line buffer
+void benchmarkListingString(const char *name) {
+  startHeapSection();
+  unsigned long start = micros();
+  long count = 0;
+  {
+    auto lease = client.sessionMgr().acquire();
+    FTPBasicAPI &api = lease.api();
+    api.passv();
+    Stream *data = api.ls("/list", LIST_NLST);
+    while (data != nullptr) {
+      // do not wait for the stream timeout at the end of the listing
+      while (data->available() <= 0 && api.dataClient()->connected()) {
+        delay(FTP_POLL_DELAY_MS);
+      }
+      if (data->available() <= 0) break;
+      String line = data->readStringUntil('\n');
+      if (line.endsWith("\r")) line.remove(line.length() - 1);
+      if (line.length() > 0) count++;
+    }
+    api.closeData();
+    api.setCurrentOperation(NOP);
+    const char *ok[] = {"226", "250", nullptr};
+    api.checkResult(ok, "ls-end", true);
+  }
+  unsigned long us = micros() - start;
+  printListing(name, count, us);
+}
+
+void countEntry(const char *dir, const FTPFileInfo &info, void *ref) {
+  (*(long *)ref)++;
+}
+
+/// Walk of the directory tree with the injected latency: entries per second
+void benchmarkWalk(const char *name, int sessions) {
+  server.setLatency(INJECTED_LATENCY_MS);
+  long count = 0;
+  unsigned long start = micros();
+  client.walk("/tree", countEntry, &count, sessions);
+  unsigned long us = micros() - start;
+  printResult(name, perSec(count, us), "entries_per_sec");
+  server.setLatency(0);
+}
+
+/// Generates a tree with TREE_DIRS * TREE_SUBDIRS directories
+void addTree(const char *root) {
+  char path[60];
+  server.addDirectory(root);
+  for (int j = 0; j < TREE_DIRS; j++) {
+    snprintf(path, sizeof(path), "%s/dir-%d", root, j);
+    server.addDirectory(path);
+    for (int k = 0; k < TREE_SUBDIRS; k++) {
+      snprintf(path, sizeof(path), "%s/dir-%d/sub-%d", root, j, k);
+      server.addDirectory(path);
+      for (int f = 0; f < TREE_FILES; f++) {
+        snprintf(path, sizeof(path), "%s/dir-%d/sub-%d/file-%d.dat", root, j,
+                 k, f);
+        server.addFile(path, (uint64_t)f);
+      }
+    }
+  }
+}
+
+/// Generates a typical log file
+void addLogFile(const char *path) {
+  FTPLoopbackFile *file = server.addFile(path, (uint64_t)0);
+  char line[120];
+  for (long j = 0; file->size < LOG_FILE_SIZE; j++) {
+    snprintf(line, sizeof(line),
+             "2024-01-01 12:%02ld:%02ld INFO [worker-%ld] request %ld served "
+             "in %ld ms\n",
+             j / 60 % 60, j % 60, j % 8, j, j * 7 % 113);
+    file->append((const uint8_t *)line, strlen(line));
+  }
+}
+
+/// Transfer of the log file with and without MODE Z over a slow connection
+void benchmarkModeZ(const char *name, bool useModeZ) {
+  server.setBandwidth(SLOW_BANDWIDTH);
+  client.setUseModeZ(useModeZ);
+  char key[40];
+  unsigned long start = micros();
+  FTPFile file = client.open("/log.txt");
+  long total = 0;
+  int len;
+  while ((len = file.readBytes(buffer, sizeof(buffer))) > 0) total += len;
+  file.close();
+  unsigned long us = micros() - start;
+  snprintf(key, sizeof(key), "%s_download", name);
+  printResult(key, mbPerSec(total, us), "mb_per_sec");
+
+  FTPLoopbackFile *log = server.find("/log.txt");
+  start = micros();
+  FTPFile upload = client.open("/log-upload.txt", WRITE_MODE);
+  total = 0;
+  while (total < (long)log->size) {
+    long n = min((long)sizeof(buffer), (long)log->size - total);
+    total += upload.write(log->data + total, n);
+  }
+  upload.close();
+  us = micros() - start;
+  snprintf(key, sizeof(key), "%s_upload", name);
+  printResult(key, mbPerSec(total, us), "mb_per_sec");
+  server.remove("/log-upload.txt");
+  client.setUseModeZ(false);
+  server.setBandwidth(0);
+}
+
+/// Compression ratio of the log file
+void benchmarkCompression() {
+  FTPLoopbackFile *log = server.find("/log.txt");
+  FTPLoopbackPipe pipe;
+  FTPLoopbackPrint out;
+  out.p_pipe = &pipe;
+  FTPDeflate deflate;
+  deflate.begin(out);
+  deflate.write(log->data, log->size);
+  deflate.end();
+  printResult("modez_ratio", (double)log->size / deflate.totalOut(), "x");
+}
+
+void setup() {
+  // no FTPLogger output: it would be mixed into the JSON
+  Serial.begin(115200);
+
+  server.addDirectory("/small");
+  server.addDirectory("/list");
+  char path[40];
+  for (int j = 0; j < LISTING_ENTRIES; j++) {
+    snprintf(path, sizeof(path), "/list/entry-%d.dat", j);
+    server.addFile(path, (uint64_t)j);
+  }
+  addTree("/tree");
+  addLogFile("/log.txt");
+  server.begin();
+  client.begin(IPAddress(127, 0, 0, 1), "user", "password");
+
+  Serial.println("{");
+  benchmarkLatency("noop", 0);
+  benchmarkLatency("noop_latency", INJECTED_LATENCY_MS);
+  benchmarkSmallFiles();
+  benchmarkDownload();
+  benchmarkDownloadCallback();
+  benchmarkUpload();
+  benchmarkCopy();
+  benchmarkSmallWrites("small_writes", 0);
+  benchmarkSmallWrites("small_writes_buffered", WRITE_BUFFER_SIZE);
+  benchmarkReadLines("read_lines", 0);
+  benchmarkReadLines("read_lines_buffered", READ_BUFFER_SIZE);
+  // the first listing grows the buffers of the loopback data connection
+  for (auto file : client.ls("/list", LIST_NLST)) (void)file;
+  benchmarkListingString("nlst_string");
+  benchmarkListing("nlst", LIST_NLST);
+  benchmarkListing("mlsd", LIST_MLSD);
+  benchmarkWalk("walk_1", 1);
+  benchmarkWalk("walk_4", 4);
+  benchmarkModeZ("modes", false);
+  benchmarkModeZ("modez", true);
+  benchmarkCompression();
+  printResult("peak_heap", heap_peak, "bytes", true);
+  Serial.println("}");
+
+  client.end();
+  server.end();
+}
+
+void loop() {}
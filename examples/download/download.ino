@@ -32,16 +32,9 @@ void setup() {
     client.begin(IPAddress(192,168,1,10), "ftp-userid", "ftp-password");
 
     // copy data from file
-    FTPFile file = client.open("/home/ftp-userid/Dropbox/Manuals/Mavlink.pdf");
-    int len;
-    byte buffer[100];
-    while (file.available()>0){
-        len = file.readBytes(buffer,100);
-        Serial.write(buffer,len);
-    }
+    client.download("/home/ftp-userid/Dropbox/Manuals/Mavlink.pdf", Serial);
 
-    // clenaup
-    file.close();
+    // cleanup
     client.end();
 }
 
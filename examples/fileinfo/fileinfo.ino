@@ -32,7 +32,7 @@ void setup() {
     FTPFile file = client.open("/home/ftp-userid/docker-cleanup.sh");
     if (file){
       Serial.print("name:"); Serial.println(file.name());
-      Serial.print("size:");Serial.println(file.size());
+      Serial.print("size:");Serial.println((unsigned long)file.size());
       Serial.print("is directory:"); Serial.println(file.isDirectory()?"true":"false");
     }
     
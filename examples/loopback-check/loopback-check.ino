@@ -0,0 +1,151 @@
+/**
+ * Checks the behaviour of the FTPClient in error cases against the in
+ * process FTPLoopbackServer: no network or FTP server is needed. Each check
+ * prints PASS or FAIL and on the desktop the exit code is the number of
+ * failed checks.
+ */
+#include "FTPClient.h"
+#include "FTPLoopback.h"
+
+// address without a registered FTPLoopbackServer
+#define UNREACHABLE_ADDRESS IPAddress(127, 0, 0, 99)
+
+FTPLoopbackServer server;
+int failures = 0;
+
+void check(const char *name, bool ok) {
+  Serial.print(ok ? "PASS " : "FAIL ");
+  Serial.println(name);
+  if (!ok) failures++;
+}
+
+/// Stream which discards the written data and provides no data
+class NullStream : public Stream {
+ public:
+  int available() override { return 0; }
+  int read() override { return -1; }
+  int peek() override { return -1; }
+  size_t write(uint8_t value) override { return 1; }
+  size_t write(const uint8_t *data, size_t len) override { return len; }
+};
+NullStream null_stream;
+
+/// Connect policy which gives up after a single attempt
+FTPConnectPolicy singleAttempt() {
+  FTPConnectPolicy policy;
+  policy.max_attempts = 1;
+  policy.deadline_ms = 1000;
+  return policy;
+}
+
+/// The queued jobs fail if no session can be opened
+void checkTransferUnreachable() {
+  FTPClient<FTPLoopbackClient, 2> client;
+  client.setConnectPolicy(singleAttempt());
+  client.begin(UNREACHABLE_ADDRESS, "user", "password");
+  FTPTransferJob jobs[] = {FTPTransferJob("/file.bin", null_stream)};
+  bool ok = client.transfer(jobs, 1, 2);
+  check("transfer to unreachable server fails",
+        !ok && jobs[0].status == TRANSFER_ERROR);
+  client.end();
+}
+
+void countEntry(const char *dir, const FTPFileInfo &info, void *ref) {
+  (*(int *)ref)++;
+}
+
+/// The walk ends with an error if no session can be opened
+void checkWalkUnreachable() {
+  FTPClient<FTPLoopbackClient, 2> client;
+  client.setConnectPolicy(singleAttempt());
+  client.begin(UNREACHABLE_ADDRESS, "user", "password");
+  int count = 0;
+  bool ok = client.walk("/", countEntry, &count, 2);
+  check("walk of unreachable server fails", !ok && count == 0);
+  client.end();
+}
+
+/// Reads the whole file: returns the number of bytes
+long readAll(FTPFile &file) {
+  uint8_t buffer[512];
+  long total = 0;
+  int len;
+  while ((len = file.readBytes(buffer, sizeof(buffer))) > 0) total += len;
+  return total;
+}
+
+/// Files and listings which are not completed return their session
+void checkSessionRelease() {
+  FTPClient<FTPLoopbackClient, 2> client;
+  client.begin(IPAddress(127, 0, 0, 1), "user", "password");
+  for (int j = 0; j < 2; j++) {
+    FTPFile file = client.open("/file.bin");
+    file.read();
+  }
+  for (int j = 0; j < 2; j++) {
+    for (auto file : client.ls("/")) {
+      if (file) break;
+    }
+  }
+  FTPFile file = client.open("/file.bin");
+  check("dropped files and listings release the session",
+        readAll(file) == 3000);
+  file.close();
+  client.end();
+}
+
+/// Local file system with the single file /src/a.txt
+class OneFileFS : public FTPLocalFS {
+ public:
+  bool list(const char *dir,
+            void (*callback)(const FTPFileInfo &info, void *ref),
+            void *ref) override {
+    if (strcmp(dir, "/src") != 0) return false;
+    FTPFileInfo info;
+    info.name = "a.txt";
+    info.type = TypeFile;
+    info.size = 0;
+    callback(info, ref);
+    return true;
+  }
+  bool info(const char *path, FTPFileInfo &info) override { return false; }
+  bool mkdir(const char *path) override { return false; }
+  Stream *open(const char *path, FileMode mode) override {
+    return &null_stream;
+  }
+  void close(Stream *file) override {}
+};
+
+/// The upload creates the missing remote root directory
+void checkMirrorMissingRoot() {
+  FTPClient<FTPLoopbackClient, 2> client;
+  client.begin(IPAddress(127, 0, 0, 1), "user", "password");
+  OneFileFS fs;
+  FTPMirror<FTPLoopbackClient, 2> mirror(client.sessionMgr(), fs);
+  bool ok = mirror.mirror("/src", "/dst", MIRROR_UPLOAD);
+  FTPLoopbackFile *dir = server.find("/dst");
+  check("mirror creates the missing remote root",
+        ok && dir != nullptr && dir->is_directory &&
+            server.find("/dst/a.txt") != nullptr);
+  client.end();
+}
+
+void setup() {
+  Serial.begin(115200);
+  server.addFile("/file.bin", (uint64_t)3000);
+  server.begin();
+
+  checkTransferUnreachable();
+  checkWalkUnreachable();
+  checkSessionRelease();
+  checkMirrorMissingRoot();
+
+  Serial.print(failures);
+  Serial.println(" failed checks");
+  server.end();
+#ifdef IS_DESKTOP
+  exit(failures);
+#endif
+}
+
+void loop() {}
@@ -1,8 +1,13 @@
 #pragma once
 
 #include "Arduino.h"
+#include "FTPChecksum.h"
 #include "FTPCommon.h"
+#include "FTPDeflate.h"
 #include "FTPLogger.h"
+#include "FTPMetadataCache.h"
+#include "FTPReplyParser.h"
+#include "FTPStatistics.h"
 
 namespace ftp_client {
 
@@ -20,7 +25,16 @@ class FTPBasicAPI {
  public:
   FTPBasicAPI() { FTPLogger::writeLog(LOG_DEBUG, "FTPBasicAPI"); }
 
-  ~FTPBasicAPI() { FTPLogger::writeLog(LOG_DEBUG, "~FTPBasicAPI"); }
+  ~FTPBasicAPI() {
+    FTPLogger::writeLog(LOG_DEBUG, "~FTPBasicAPI");
+    setWriteBufferSize(0);
+    setReadBufferSize(0);
+    // the buffer of the decompressed data
+    delete[] read_buffer;
+    delete p_deflate;
+    delete p_inflate;
+    delete p_checksum;
+  }
 
   bool begin(Client *cmdPar, Client *dataPar, IPAddress &address, int port,
               const char *username, const char *password) {
@@ -29,7 +43,11 @@ class FTPBasicAPI {
     data_ptr = dataPar;
     remote_address = address;
 
+    FTP_STAT(unsigned long start = micros());
     if (!connect(address, port, command_ptr, true)) return false;
+    FTP_STAT(stats.connects++);
+    FTP_STAT(stats.connect_time_us += micros() - start);
+    FTP_STAT(start = micros());
     if (username != nullptr) {
       const char *ok_result[] = {"331", "230", "530", nullptr};
       if (!cmd("USER", username, ok_result)) return false;
@@ -38,6 +56,8 @@ class FTPBasicAPI {
       const char *ok_result[] = {"230", "202", nullptr};
       if (!cmd("PASS", password, ok_result)) return false;
     }
+    FTP_STAT(stats.logins++);
+    FTP_STAT(stats.login_time_us += micros() - start);
 
     is_open = true;
     const char *ok_result[] = {"200", nullptr};
@@ -61,84 +81,354 @@ class FTPBasicAPI {
 
   bool connected() { return is_open; }
 
+  /// Marks the session as unusable (e.g. if replies are still outstanding
+  /// after a timeout), so that the FTPSessionMgr replaces it
+  void setBroken() { is_open = false; }
+
   operator bool() { return is_open; }
 
+  /// Checks the idle command connection without any round trip: a closed
+  /// connection or unsolicited data (e.g. 421 Timeout) means that the session
+  /// can not be used any more
+  bool isAlive() {
+    return is_open && command_ptr->connected() &&
+           command_ptr->available() == 0;
+  }
+
+  /// Sends a NOOP to keep the connection open and to check that the server
+  /// is still responding
+  bool noop(unsigned long timeout_ms = FTP_PROBE_TIMEOUT_MS) {
+    reply_parser.reset();
+    sendCmd("NOOP", nullptr);
+    return waitReply(timeout_ms) && reply_parser.code() == 200;
+  }
+
+  /// Defines the callback which returns the session to its pool
+  void setReleaseCallback(void (*cb)(void *ref), void *ref) {
+    release_cb = cb;
+    release_cb_ref = ref;
+  }
+
+  /// Returns the session to the pool of the FTPSessionMgr
+  void release() {
+    if (release_cb != nullptr) release_cb(release_cb_ref);
+  }
+
+  /// Provides the time in ms since the last command has been sent
+  unsigned long idleTime() { return millis() - last_command_time; }
+
+  /// Provides a snapshot of the statistics of the session: all counters are
+  /// 0 if FTP_STATISTICS is not enabled
+  FTPStatistics statistics() {
+#if FTP_STATISTICS
+    return stats;
+#else
+    return FTPStatistics();
+#endif
+  }
+
+  /// Sets all counters of the statistics to 0
+  void resetStatistics() { FTP_STAT(stats.reset()); }
+
+  /// Counts the data which was read directly from the dataClient()
+  void countReceived(size_t len) {
+    (void)len;
+    FTP_STAT(stats.bytes_received += len);
+  }
+
+  /// Counts the data which was written directly to the dataClient()
+  void countSent(size_t len) {
+    (void)len;
+    FTP_STAT(stats.bytes_sent += len);
+  }
+
+  /// Opens the passive data connection: we use EPSV and fall back to PASV if
+  /// the server does not support it
   bool passv() {
     FTPLogger::writeLog(LOG_DEBUG, "FTPBasicAPI", "passv");
-    bool ok = cmd("PASV", nullptr, "227");
-    if (ok) {
-      char buffer[80];
-      FTPLogger::writeLog(LOG_DEBUG, "FTPBasicAPI::passv", result_reply);
-      // determine data port
-      int start1 = CStringFunctions::findNthInStr(result_reply, ',', 4) + 1;
-      int p1 = atoi(result_reply + start1);
+    FTP_STAT(unsigned long start = micros());
+    IPAddress host;
+    int port = -1;
+    if (!passiveAddress(host, port) || !connect(host, port, data_ptr)) {
+      return false;
+    }
+    FTP_STAT(stats.passive++);
+    FTP_STAT(stats.passive_time_us += micros() - start);
+    return true;
+  }
 
-      sprintf(buffer, "*** port1 -> %d ", p1);
-      FTPLogger::writeLog(LOG_DEBUG, "FTPBasicAPI::passv", buffer);
+  /// Provides the command which is used to open a passive data connection
+  const char *passiveCommand() { return use_epsv ? "EPSV" : "PASV"; }
 
-      int start2 = CStringFunctions::findNthInStr(result_reply, ',', 5) + 1;
-      int p2 = atoi(result_reply + start2);
+  /// Defines if EPSV should be tried before PASV
+  void setUseEPSV(bool flag) { use_epsv = flag; }
 
-      sprintf(buffer, "*** port2 -> %d ", p2);
-      FTPLogger::writeLog(LOG_DEBUG, "FTPBasicAPI::passv", buffer);
+  /// Returns true if EPSV is used to open the data connection
+  bool isUseEPSV() { return use_epsv; }
 
-      int dataPort = (p1 * 256) + p2;
-      sprintf(buffer, "*** data port: %d", dataPort);
-      FTPLogger::writeLog(LOG_DEBUG, "FTPBasicAPI::passv", buffer);
+  /// Returns true if the reply code tells that EPSV is not supported: other
+  /// failures (e.g. a timeout) do not switch to PASV
+  bool isEPSVRefused(int code) {
+    return use_epsv && code >= 500 && code <= 502;
+  }
 
-      ok = connect(remote_address, dataPort, data_ptr) == 1;
+  /// Defines if the host from the PASV reply is used for the data connection:
+  /// by default we connect to the address of the command connection, which
+  /// also works if the server reports a wrong (e.g. internal NAT) address
+  void setUsePasvHost(bool flag) { use_pasv_host = flag; }
+
+  /// Opens the data connection with the port from the EPSV or PASV reply
+  bool connectData() {
+    IPAddress host;
+    int port = -1;
+    if (!passiveReply(host, port)) return false;
+    return connect(host, port, data_ptr);
+  }
+
+  /// Requests a passive data port without connecting to it, so that another
+  /// server can connect (see port()): provides the host and port
+  bool passiveAddress(IPAddress &host, int &port) {
+    const char *ok[] = {"227", "229", nullptr};
+    bool is_ok = cmd(passiveCommand(), nullptr, ok);
+    if (!is_ok && isEPSVRefused(reply_parser.code())) {
+      FTPLogger::writeLog(LOG_INFO, "FTPBasicAPI", "EPSV not supported");
+      use_epsv = false;
+      is_ok = cmd("PASV", nullptr, ok);
     }
-    return ok;
+    // a late reply would be taken for the next command
+    if (!is_ok && reply_parser.code() == 0) setBroken();
+    return is_ok && passiveReply(host, port);
+  }
+
+  /// Tells the server to connect to the indicated host and port for the next
+  /// transfer
+  bool port(IPAddress host, int port) {
+    FTPLogger::writeLog(LOG_DEBUG, "FTPBasicAPI", "port");
+    char par[32];
+    snprintf(par, sizeof(par), "%d,%d,%d,%d,%d,%d", host[0], host[1],
+             host[2], host[3], port / 256, port % 256);
+    return cmd("PORT", par, "200");
+  }
+
+  /// Determines the host and port from the EPSV or PASV reply
+  bool passiveReply(IPAddress &host, int &port) {
+    const char *reply = reply_parser.line();
+    FTPLogger::writeLog(LOG_DEBUG, "FTPBasicAPI::passv", reply);
+    host = remote_address;
+    if (reply_parser.code() == 229) {
+      port = parseEPSV(reply);
+    } else {
+      IPAddress pasv_host;
+      port = parsePASV(reply, pasv_host);
+      if (port > 0 && use_pasv_host) host = pasv_host;
+    }
+    if (port <= 0) {
+      FTPLogger::writeLog(LOG_ERROR, "FTPBasicAPI::passv", "invalid reply");
+      return false;
+    }
+    return true;
+  }
+
+  /// Parses the reply "227 Entering Passive Mode (h1,h2,h3,h4,p1,p2)" in a
+  /// single pass: returns the port or -1
+  static int parsePASV(const char *reply, IPAddress &host) {
+    int values[6];
+    int count = 0;
+    int value = -1;
+    // skip the reply code
+    for (const char *p = reply + 3; count < 6; p++) {
+      if (*p >= '0' && *p <= '9') {
+        value = (value < 0 ? 0 : value * 10) + (*p - '0');
+        if (value > 255) return -1;
+      } else if (value >= 0) {
+        // a list of 6 numbers separated by comma
+        if (*p == ',' || count == 5) {
+          values[count++] = value;
+        } else {
+          count = 0;
+        }
+        value = -1;
+      }
+      if (*p == '\0') break;
+    }
+    if (count < 6) return -1;
+    host = IPAddress(values[0], values[1], values[2], values[3]);
+    return values[4] * 256 + values[5];
+  }
+
+  /// Parses the reply "229 Entering Extended Passive Mode (|||port|)":
+  /// returns the port or -1
+  static int parseEPSV(const char *reply) {
+    const char *p = strchr(reply, '(');
+    if (p == nullptr || p[1] == '\0') return -1;
+    // the delimiter is defined by the server
+    char delimiter = p[1];
+    if (p[2] != delimiter || p[3] != delimiter) return -1;
+    long port = 0;
+    for (p += 4; *p >= '0' && *p <= '9'; p++) {
+      port = port * 10 + (*p - '0');
+      if (port > 65535) return -1;
+    }
+    return *p == delimiter && port > 0 ? port : -1;
   }
 
   bool del(const char *file) {
     FTPLogger::writeLog(LOG_DEBUG, "FTPBasicAPI", "del");
+    invalidateMetadata(file);
     return cmd("DELE", file, "250");
   }
 
   bool mkdir(const char *dir) {
     FTPLogger::writeLog(LOG_DEBUG, "FTPBasicAPI", "mkdir");
+    invalidateMetadata(dir);
     return cmd("MKD", dir, "257");
   }
 
+  /// Creates multiple directories: the MKD commands are sent back-to-back
+  /// (up to FTP_PIPELINE_DEPTH outstanding commands), so that parents need
+  /// to be listed before their subdirectories. Returns the number of
+  /// created directories.
+  int mkdirs(const char *dirs[], int count) {
+    FTPLogger::writeLog(LOG_DEBUG, "FTPBasicAPI", "mkdirs");
+    int sent = 0;
+    int created = 0;
+    for (int received = 0; received < count; received++) {
+      // fill the pipeline
+      while (sent < count && sent - received < FTP_PIPELINE_DEPTH) {
+        invalidateMetadata(dirs[sent]);
+        sendCmd("MKD", dirs[sent]);
+        sent++;
+      }
+      reply_parser.reset();
+      if (!waitReply(policy.reply_timeout_ms)) {
+        FTPLogger::writeLog(LOG_ERROR, "FTPBasicAPI::mkdirs", dirs[received]);
+        setBroken();
+        return created;
+      }
+      if (reply_parser.code() == 257) {
+        created++;
+      } else {
+        FTPLogger::writeLog(LOG_WARN, "FTPBasicAPI::mkdirs", reply_parser.line());
+      }
+    }
+    return created;
+  }
+
   bool rmd(const char *dir) {
     FTPLogger::writeLog(LOG_DEBUG, "FTPBasicAPI", "rd");
+    invalidateMetadata(dir);
     return cmd("RMD", dir, "250");
   }
 
-  size_t size(const char *file) {
+  uint64_t size(const char *file) {
     FTPLogger::writeLog(LOG_DEBUG, "FTPBasicAPI", "size");
+    FTPFileInfo info;
+    if (getMetadata(file, info)) return info.size;
     if (cmd("SIZE", file, "213")) {
-      return atol(result_reply + 4);
+      info.size = CStringFunctions::toUInt64(result_reply + 4);
+      info.type = TypeFile;
+      putMetadata(file, info);
+      return info.size;
     }
     return 0;
   }
 
   ObjectType objectType(const char *file) {
     FTPLogger::writeLog(LOG_DEBUG, "FTPBasicAPI", "objectType");
+    FTPFileInfo info;
+    if (getMetadata(file, info)) return info.type;
     const char *ok_result[] = {"213", "550", nullptr};
     ObjectType result = TypeDirectory;
     if (cmd("SIZE", file, ok_result)) {
+      // a 550 is also the reply for a missing file: we only cache files
       if (strncmp(result_reply, "213", 3) == 0) {
         result = TypeFile;
+        info.size = CStringFunctions::toUInt64(result_reply + 4);
+        info.type = result;
+        putMetadata(file, info);
       }
     }
     return result;
   }
 
+  /// Defines the cache which is used for the size, type and modification
+  /// time of the files
+  void setMetadataCache(FTPMetadataCache *cache) { p_metadata = cache; }
+
+  /// Provides the metadata cache (or nullptr)
+  FTPMetadataCache *metadataCache() { return p_metadata; }
+
+  /// Removes the file from the metadata cache
+  void invalidateMetadata(const char *file) {
+    if (p_metadata != nullptr) p_metadata->invalidate(file);
+  }
+
+  /// Determines the size, type and modification time of multiple files: the
+  /// SIZE and MDTM commands are sent back-to-back (up to FTP_PIPELINE_DEPTH
+  /// outstanding commands) and the replies are matched in order
+  bool stat(const char *files[], int count, FTPFileInfo results[]) {
+    FTPLogger::writeLog(LOG_DEBUG, "FTPBasicAPI", "stat");
+    int total = count * 2;
+    int sent = 0;
+    for (int received = 0; received < total; received++) {
+      // fill the pipeline
+      while (sent < total && sent - received < FTP_PIPELINE_DEPTH) {
+        sendCmd(sent % 2 == 0 ? "SIZE" : "MDTM", files[sent / 2]);
+        sent++;
+      }
+      // process the oldest outstanding reply
+      reply_parser.reset();
+      if (!waitReply(policy.reply_timeout_ms)) {
+        FTPLogger::writeLog(LOG_ERROR, "FTPBasicAPI::stat", files[received / 2]);
+        // the outstanding replies would be taken for the next commands
+        setBroken();
+        return false;
+      }
+      FTPLogger::writeLog(LOG_DEBUG, "FTPBasicAPI::stat", reply_parser.line());
+      FTPFileInfo &info = results[received / 2];
+      info.name = files[received / 2];
+      int code = reply_parser.code();
+      bool is_ok = code == 213;
+      if (received % 2 == 0) {
+        info.size = is_ok ? CStringFunctions::toUInt64(reply_parser.line() + 4)
+                          : 0;
+        // SIZE is refused with 550 for directories: other errors (e.g. 502
+        // if SIZE is not supported) do not tell us anything
+        info.type = is_ok ? TypeFile
+                          : code == 550 ? TypeDirectory : TypeUndefined;
+      } else {
+        info.modify[0] = '\0';
+        if (is_ok) {
+          strncpy(info.modify, reply_parser.line() + 4, sizeof(info.modify) - 1);
+          info.modify[sizeof(info.modify) - 1] = '\0';
+        }
+        // a 550 can also mean that the file does not exist
+        if (info.type == TypeFile) putMetadata(info.name, info);
+      }
+    }
+    return true;
+  }
+
   bool abort() {
     bool rc = true;
     if (current_operation == READ_OP || current_operation == WRITE_OP ||
         current_operation == LS_OP) {
       FTPLogger::writeLog(LOG_DEBUG, "FTPBasicAPI", "abort");
       data_ptr->stop();
+      write_buffer_len = 0;
+      is_compressed = false;
+      clearReadBuffer();
 
       const char *ok[] = {"426", "226", "225", nullptr};
       setCurrentOperation(NOP);
       rc = cmd("ABOR", nullptr, ok);
-      delay(FTP_ABORT_DELAY_MS);
-      while (command_ptr->available() > 0) {
-        command_ptr->read();
+      // the reply for the interrupted transfer is followed by the reply for
+      // the ABOR
+      reply_parser.reset();
+      unsigned long deadline = millis() + FTP_ABORT_DELAY_MS;
+      while (!reply_parser.readFrom(*command_ptr) &&
+             (long)(millis() - deadline) < 0) {
+        delay(FTP_POLL_DELAY_MS);
       }
     }
     return rc;
@@ -161,34 +451,203 @@ class FTPBasicAPI {
     return cmd("TYPE", txt, "200");
   }
 
-  Stream *read(const char *file_name) {
+  /// Starts the download (if not already active): with an offset > 0 the
+  /// RETR is preceded by a REST. The data is decompressed by readData() if
+  /// MODE Z is used: pass compress = false to read the raw dataClient().
+  Stream *read(const char *file_name, uint64_t offset = 0,
+               bool compress = true) {
     if (current_operation != READ_OP) {
       FTPLogger::writeLog(LOG_DEBUG, "FTPBasicAPI", "read");
+      clearReadBuffer();
+      // the MODE command must not be sent between REST and RETR
+      bool is_z = selectMode(compress && use_mode_z && offset == 0);
+      if (offset > 0) rest(offset);
       const char *ok[] = {"150", "125", nullptr};
-      cmd("RETR", file_name, ok);
+      is_transfer_started = cmd("RETR", file_name, ok);
+      // no data will follow if the server refused the download
+      if (!is_transfer_started) data_ptr->stop();
+      if (is_transfer_started && is_z) beginInflate();
       setCurrentOperation(READ_OP);
     }
     return data_ptr;
   }
 
-  Stream *write(const char *file_name, FileMode mode) {
+  /// Defines the restart offset for the next RETR or STOR
+  bool rest(uint64_t offset) {
+    FTPLogger::writeLog(LOG_DEBUG, "FTPBasicAPI", "rest");
+    char offset_str[21];
+    return cmd("REST", CStringFunctions::toStr(offset, offset_str), "350");
+  }
+
+  /// Starts the upload (if not already active). With WRITE_RESUME_MODE we
+  /// continue at the offset: we use REST + STOR if supported and APPE
+  /// otherwise.
+  Stream *write(const char *file_name, FileMode mode, uint64_t offset = 0) {
     if (current_operation != WRITE_OP) {
       FTPLogger::writeLog(LOG_DEBUG, "FTPBasicAPI", "write");
       const char *ok_write[] = {"125", "150", nullptr};
-      cmd(mode == WRITE_APPEND_MODE ? "APPE" : "STOR", file_name, ok_write);
+      const char *command = mode == WRITE_APPEND_MODE ? "APPE" : "STOR";
+      bool is_resume = mode == WRITE_RESUME_MODE && offset > 0;
+      bool is_z = selectMode(use_mode_z && !is_resume);
+      if (is_resume) {
+        bool is_rest = hasFeature(FEAT_REST) && rest(offset);
+        if (!is_rest) command = "APPE";
+      }
+      invalidateMetadata(file_name);
+      is_transfer_started = cmd(command, file_name, ok_write);
+      if (!is_transfer_started) data_ptr->stop();
+      if (is_transfer_started && is_z) beginDeflate();
       setCurrentOperation(WRITE_OP);
     }
     return data_ptr;
   }
 
-  Stream *ls(const char *file_name) {
+  Stream *ls(const char *file_name, ListMode listMode = LIST_NLST) {
     FTPLogger::writeLog(LOG_DEBUG, "FTPBasicAPI", "ls");
+    // the listing is read directly from the data connection
+    selectMode(false);
     const char *ok[] = {"125", "150", nullptr};
-    cmd("NLST", file_name, ok);
+    cmd(listMode == LIST_MLSD ? "MLSD" : "NLST", file_name, ok);
     setCurrentOperation(LS_OP);
     return data_ptr;
   }
 
+  /// Queries the supported features with FEAT
+  bool feat() {
+    FTPLogger::writeLog(LOG_DEBUG, "FTPBasicAPI", "feat");
+    features = 0;
+    hash_algorithms = 0;
+    hash_selected = HASH_NONE;
+    features_queried = true;
+    reply_parser.setLineCallback(featureLineCallback, this);
+    const char *ok[] = {"211", nullptr};
+    bool result = cmd("FEAT", nullptr, ok);
+    reply_parser.setLineCallback(nullptr);
+    return result;
+  }
+
+  /// Returns true if the server supports the feature: FEAT is only
+  /// requested once
+  bool hasFeature(FTPFeature feature) {
+    if (!features_queried) feat();
+    return (features & feature) != 0;
+  }
+
+  /// Returns true if the server can calculate the hash of a file with the
+  /// algorithm (HASH, XCRC, XMD5 or XSHA1)
+  bool hasHash(FTPHashAlgorithm algorithm) {
+    if (!features_queried) feat();
+    if (hash_algorithms & (1 << algorithm)) return true;
+    switch (algorithm) {
+      case HASH_CRC32:
+        return (features & FEAT_XCRC) != 0;
+      case HASH_MD5:
+        return (features & FEAT_XMD5) != 0;
+      case HASH_SHA1:
+        return (features & FEAT_XSHA1) != 0;
+      default:
+        return false;
+    }
+  }
+
+  /// Requests the hash of the file from the server as hex string: the
+  /// buffer needs 2 * FTP_HASH_MAX_SIZE + 1 characters
+  bool remoteHash(const char *file, FTPHashAlgorithm algorithm, char *hex) {
+    FTPLogger::writeLog(LOG_DEBUG, "FTPBasicAPI", "remoteHash");
+    if (!hasHash(algorithm)) return false;
+    const char *ok[] = {"213", "250", "251", nullptr};
+    if (hash_algorithms & (1 << algorithm)) {
+      // HASH uses the algorithm which was selected with OPTS
+      if (hash_selected != algorithm) {
+        char par[20];
+        snprintf(par, sizeof(par), "HASH %s", FTPChecksum::name(algorithm));
+        if (!cmd("OPTS", par, "200")) return false;
+        hash_selected = algorithm;
+      }
+      if (!cmd("HASH", file, ok)) return false;
+    } else {
+      const char *command = algorithm == HASH_CRC32 ? "XCRC"
+                            : algorithm == HASH_MD5 ? "XMD5"
+                                                    : "XSHA1";
+      if (!cmd(command, file, ok)) return false;
+    }
+    // "213 SHA-1 0-49 hash file" or "250 hash"
+    int max_len = 2 * FTPChecksum::size(algorithm);
+    const char *token = result_reply + 3;
+    while (*token != '\0') {
+      while (*token == ' ') token++;
+      int len = 0;
+      while (isxdigit(token[len])) len++;
+      bool is_end = token[len] == '\0' || token[len] == ' ' ||
+                    token[len] == '\r' || token[len] == '\n';
+      // a CRC32 might be reported without leading zeros
+      if (is_end && len > 0 &&
+          (len == max_len || (algorithm == HASH_CRC32 && len < max_len))) {
+        strncpy(hex, token, len);
+        hex[len] = '\0';
+        return true;
+      }
+      while (*token != '\0' && *token != ' ') token++;
+    }
+    FTPLogger::writeLog(LOG_ERROR, "FTPBasicAPI", "invalid hash reply");
+    return false;
+  }
+
+  /// Starts the calculation of the checksum of the transferred data
+  FTPChecksum *beginChecksum(FTPHashAlgorithm algorithm) {
+    if (p_checksum == nullptr) p_checksum = new FTPChecksum();
+    p_checksum->begin(algorithm);
+    is_checksum = algorithm != HASH_NONE;
+    return checksum();
+  }
+
+  /// Provides the active checksum or nullptr
+  FTPChecksum *checksum() { return is_checksum ? p_checksum : nullptr; }
+
+  /// Stops the calculation of the checksum
+  void endChecksum() { is_checksum = false; }
+
+  /// Parses a MLSD line (e.g. "type=file;size=12;modify=20240101120000; name")
+  /// into the info: the name is pointing into the line
+  static bool parseMLSD(const char *line, FTPFileInfo &info) {
+    info = FTPFileInfo();
+    const char *fact = line;
+    // the facts are terminated by a space
+    while (*fact != '\0' && *fact != ' ') {
+      const char *value = strchr(fact, '=');
+      const char *end = strchr(fact, ';');
+      if (value == nullptr || end == nullptr || value > end) break;
+      value++;
+      int value_len = end - value;
+      if (strncasecmp(fact, "type=", 5) == 0) {
+        info.type = parseType(value, value_len);
+      } else if (strncasecmp(fact, "size=", 5) == 0) {
+        info.size = CStringFunctions::toUInt64(value);
+      } else if (strncasecmp(fact, "modify=", 7) == 0) {
+        copyFact(info.modify, sizeof(info.modify), value, value_len);
+      } else if (strncasecmp(fact, "perm=", 5) == 0) {
+        copyFact(info.perm, sizeof(info.perm), value, value_len);
+      }
+      fact = end + 1;
+    }
+    if (*fact != ' ') return false;
+    info.name = fact + 1;
+    return true;
+  }
+
+  /// Determines the type from the value of the MLSD type fact: the facts can
+  /// be in any order, so the cdir and pdir entries get their own type
+  static ObjectType parseType(const char *value, int len) {
+    if (len == 4 && strncasecmp(value, "file", 4) == 0) return TypeFile;
+    if (len == 3 && strncasecmp(value, "dir", 3) == 0) return TypeDirectory;
+    if (len == 4 && strncasecmp(value, "cdir", 4) == 0) return TypeCurrentDir;
+    if (len == 4 && strncasecmp(value, "pdir", 4) == 0) return TypeParentDir;
+    return TypeUndefined;
+  }
+
+  /// Provides the client of the data connection
+  Client *dataClient() { return data_ptr; }
+
   void closeData() {
     FTPLogger::writeLog(LOG_INFO, "FTPBasicAPI", "closeData");
     data_ptr->stop();
@@ -198,39 +657,255 @@ class FTPBasicAPI {
   }
 
   void setCurrentOperation(CurrentOperation op) {
-    char msg[80];
-    sprintf(msg, "setCurrentOperation: %d", (int)op);
-    FTPLogger::writeLog(LOG_DEBUG, "FTPBasicAPI", msg);
+    FTPLogger::writeLogf(LOG_DEBUG, "FTPBasicAPI", "setCurrentOperation: %d",
+                         (int)op);
     current_operation = op;
+    // the deadline does not limit the duration of the transfer
+    if (op != NOP) clearDeadline();
+    if (op == NOP) is_compressed = false;
   }
 
   CurrentOperation currentOperation() { return current_operation; }
 
   void flush() {
     FTPLogger::writeLog(LOG_DEBUG, "FTPBasicAPI", "flush");
+    if (is_compressed) {
+      FTP_STAT(uint64_t sent = p_deflate->totalOut());
+      p_deflate->flush();
+      FTP_STAT(stats.bytes_sent += p_deflate->totalOut() - sent);
+    } else {
+      flushWriteBuffer();
+    }
     data_ptr->flush();
   }
 
+  /// Sends the remaining data at the end of an upload: with MODE Z this
+  /// ends the compressed stream
+  bool finishWrite() {
+    bool ok = true;
+    if (is_compressed) {
+      FTP_STAT(uint64_t sent = p_deflate->totalOut());
+      ok = p_deflate->end();
+      FTP_STAT(stats.bytes_sent += p_deflate->totalOut() - sent);
+    } else {
+      ok = flushWriteBuffer();
+    }
+    data_ptr->flush();
+    return ok;
+  }
+
+  /// Defines if the files are transferred compressed with MODE Z if the
+  /// server supports it
+  void setUseModeZ(bool flag) { use_mode_z = flag; }
+
+  /// Returns true if MODE Z is used for the file transfers
+  bool isUseModeZ() { return use_mode_z; }
+
+  /// Switches the server between MODE Z and MODE S (if necessary): returns
+  /// false if the server does not support the mode
+  bool setModeZ(bool compressed) {
+    if (compressed == is_mode_z) return true;
+    if (compressed && !hasFeature(FEAT_MODEZ)) return false;
+    if (!cmd("MODE", compressed ? "Z" : "S", "200")) return false;
+    is_mode_z = compressed;
+    return true;
+  }
+
+  /// Returns true if the data of the current transfer is compressed
+  bool isCompressed() { return is_compressed; }
+
+  /// Checks the decompressed data of a MODE Z download: returns false if the
+  /// data is corrupt or if the stream ended before its final block
+  bool isInflateOk(bool isEOF) {
+    if (!is_compressed || p_inflate == nullptr) return true;
+    if (p_inflate->isError()) {
+      FTPLogger::writeLog(LOG_ERROR, "FTPBasicAPI", "corrupt MODE Z data");
+      return false;
+    }
+    if (isEOF && !p_inflate->isDone()) {
+      FTPLogger::writeLog(LOG_ERROR, "FTPBasicAPI", "truncated MODE Z data");
+      return false;
+    }
+    return true;
+  }
+
+  /// Returns true if the server accepted the last RETR, STOR or APPE
+  bool isTransferStarted() { return is_transfer_started; }
+
+  /// Defines the size of the buffer which collects small writes to the data
+  /// connection, so that we send full segments (0 = no buffering)
+  void setWriteBufferSize(size_t size) {
+    if (size == write_buffer_size) return;
+    flushWriteBuffer();
+    delete[] write_buffer;
+    write_buffer = nullptr;
+    write_buffer_size = size;
+  }
+
+  /// Defines the size of the buffer which is filled with big reads from the
+  /// data connection (0 = no buffering)
+  void setReadBufferSize(size_t size) {
+    if (size == read_buffer_size) return;
+    delete[] read_buffer;
+    read_buffer = nullptr;
+    read_buffer_capacity = 0;
+    read_buffer_size = size;
+    clearReadBuffer();
+  }
+
+  /// Provides the number of bytes which can be read without blocking
+  int availableData() {
+    int result = read_buffer_len - read_buffer_pos;
+    // we can not tell the decompressed size in advance
+    if (is_compressed) {
+      if (p_inflate->isError()) return result;
+      return result + (p_inflate->canRead() || data_ptr->available() > 0);
+    }
+    return result + data_ptr->available();
+  }
+
+  /// Reads a single byte from the read buffer or the data connection: returns
+  /// -1 if no data is available
+  int readData() {
+    if (read_buffer_size == 0 && !is_compressed) {
+      int c = data_ptr->read();
+      FTP_STAT(if (c >= 0) stats.bytes_received++);
+      return c;
+    }
+    if (read_buffer_pos == read_buffer_len && !fillReadBuffer()) return -1;
+    return read_buffer[read_buffer_pos++];
+  }
+
+  /// Provides the next byte without removing it: returns -1 if no data is
+  /// available
+  int peekData() {
+    if (read_buffer_size == 0 && !is_compressed) return data_ptr->peek();
+    if (read_buffer_pos == read_buffer_len && !fillReadBuffer()) return -1;
+    return read_buffer[read_buffer_pos];
+  }
+
+  /// Reads the available data without blocking: returns the number of bytes
+  size_t readData(uint8_t *data, size_t len) {
+    size_t result = 0;
+    // provide the buffered data
+    if (read_buffer_pos < read_buffer_len) {
+      result = read_buffer_len - read_buffer_pos;
+      if (result > len) result = len;
+      memcpy(data, read_buffer + read_buffer_pos, result);
+      read_buffer_pos += result;
+      if (result == len) return result;
+    }
+    // big reads and unbuffered reads are done directly
+    if (is_compressed && len - result >= readBufferSize()) {
+      return result + inflateData(data + result, len - result);
+    }
+    if (!is_compressed && len - result >= read_buffer_size) {
+      int available = data_ptr->available();
+      if (available <= 0) return result;
+      size_t n = len - result;
+      if (n > (size_t)available) n = available;
+      int rc = data_ptr->read(data + result, n);
+      if (rc <= 0) return result;
+      FTP_STAT(stats.bytes_received += rc);
+      return result + rc;
+    }
+    if (!fillReadBuffer()) return result;
+    return result + readData(data + result, len - result);
+  }
+
+  /// Provides the data of the download to the callback until the server
+  /// closes the data connection: the data is not copied to the caller but
+  /// points into the read buffer and is only valid during the call. Returns
+  /// false if the callback returned false or if no data arrived within the
+  /// reply timeout.
+  bool receiveData(FTPDataCallback callback, void *ref) {
+    // provide the data which has already been buffered
+    if (read_buffer_pos < read_buffer_len) {
+      size_t len = read_buffer_len - read_buffer_pos;
+      uint8_t *data = read_buffer + read_buffer_pos;
+      clearReadBuffer();
+      if (!callback(data, len, ref)) return false;
+    }
+    size_t size = read_buffer_size > 0 ? read_buffer_size
+                  : is_compressed      ? FTP_MODEZ_BUFFER_SIZE
+                                       : FTP_RECEIVE_BUFFER_SIZE;
+    allocReadBuffer(size);
+    unsigned long last_data = millis();
+    while (true) {
+      size_t len = 0;
+      if (is_compressed) {
+        len = inflateData(read_buffer, size);
+      } else {
+        int available = data_ptr->available();
+        if (available > 0) {
+          int rc = data_ptr->read(read_buffer,
+                                  (size_t)available < size ? available : size);
+          if (rc > 0) len = rc;
+          FTP_STAT(stats.bytes_received += len);
+        }
+      }
+      if (len > 0) {
+        last_data = millis();
+        if (!callback(read_buffer, len, ref)) return false;
+      } else if (is_compressed && p_inflate->isError()) {
+        return isInflateOk(false);
+      } else if (!data_ptr->connected() && data_ptr->available() <= 0 &&
+                 (!is_compressed || !p_inflate->canRead())) {
+        return isInflateOk(true);
+      } else if (millis() - last_data > policy.reply_timeout_ms) {
+        FTPLogger::writeLog(LOG_ERROR, "FTPBasicAPI", "receiveData timeout");
+        return false;
+      } else {
+        delay(FTP_POLL_DELAY_MS);
+      }
+    }
+  }
+
+  /// Writes the data to the data connection using the write buffer
+  size_t writeData(const uint8_t *data, size_t len) {
+    if (is_compressed) {
+      FTP_STAT(uint64_t sent = p_deflate->totalOut());
+      size_t result = p_deflate->write(data, len);
+      FTP_STAT(stats.bytes_sent += p_deflate->totalOut() - sent);
+      return result;
+    }
+    // big writes do not need to be copied
+    if (write_buffer_size == 0 ||
+        (write_buffer_len == 0 && len >= write_buffer_size)) {
+      size_t result = data_ptr->write(data, len);
+      FTP_STAT(stats.bytes_sent += result);
+      return result;
+    }
+    if (write_buffer == nullptr) write_buffer = new uint8_t[write_buffer_size];
+    size_t result = 0;
+    while (result < len) {
+      size_t n = len - result;
+      if (n > write_buffer_size - write_buffer_len) {
+        n = write_buffer_size - write_buffer_len;
+      }
+      memcpy(write_buffer + write_buffer_len, data + result, n);
+      write_buffer_len += n;
+      result += n;
+      if (write_buffer_len == write_buffer_size && !flushWriteBuffer()) {
+        return 0;
+      }
+    }
+    return result;
+  }
+
   bool checkResult(const char *expected[], const char *command,
-                   bool wait_for_data = true) {
-    // consume all result lines
+                   bool wait_for_data = true,
+                   unsigned long timeout_ms = 0) {
     bool ok = false;
     result_reply[0] = '\0';
-    Stream *stream_ptr = command_ptr;
-
-    char result_str[FTP_RESULT_BUFFER_SIZE];
-    if (wait_for_data || stream_ptr->available()) {
-      // wait for reply
-      while (stream_ptr->available() == 0) {
-        delay(100);
-      }
-      // read reply
-      // result_str = stream_ptr->readStringUntil('\n').c_str();
-      CStringFunctions::readln(*stream_ptr, result_str, FTP_RESULT_BUFFER_SIZE);
+    reply_parser.reset();
 
-      if (strlen(result_str) > 3) {
+    if (wait_for_data || command_ptr->available() > 0) {
+      if (waitReply(timeout_ms == 0 ? policy.reply_timeout_ms : timeout_ms)) {
+        const char *result_str = reply_parser.line();
         FTPLogger::writeLog(LOG_DEBUG, "FTPBasicAPI::checkResult", result_str);
         strncpy(result_reply, result_str, sizeof(result_reply) - 1);
+        result_reply[sizeof(result_reply) - 1] = '\0';
         // if we did not expect anything
         if (expected[0] == nullptr) {
           ok = true;
@@ -238,20 +913,17 @@ class FTPBasicAPI {
                               "success because of not expected result codes");
         } else {
           // check for valid codes
-          char msg[80];
           for (int j = 0; expected[j] != nullptr; j++) {
-            sprintf(msg, "- checking with %s", expected[j]);
-            FTPLogger::writeLog(LOG_DEBUG, "FTPBasicAPI::checkResult", msg);
             if (strncmp(result_str, expected[j], 3) == 0) {
-              sprintf(msg, " -> success with %s", expected[j]);
-              FTPLogger::writeLog(LOG_DEBUG, "FTPBasicAPI::checkResult", msg);
+              FTPLogger::writeLogf(LOG_DEBUG, "FTPBasicAPI::checkResult",
+                                   " -> success with %s", expected[j]);
               ok = true;
               break;
             }
           }
         }
       } else {
-        // if we got am empty line and we dont need to wait we are still ok
+        // if we did not get any reply and we dont need to wait we are still ok
         if (!wait_for_data) ok = true;
       }
     } else {
@@ -266,6 +938,49 @@ class FTPBasicAPI {
     return ok;
   }
 
+  /// Defines the max time in ms that we wait for the reply of a command
+  void setReplyTimeout(unsigned long timeoutMs) {
+    policy.reply_timeout_ms = timeoutMs;
+  }
+
+  /// Defines the connect attempts, backoff, timeouts and deadline
+  void setConnectPolicy(const FTPConnectPolicy &policy) {
+    this->policy = policy;
+  }
+
+  /// Provides the connect attempts, backoff, timeouts and deadline
+  const FTPConnectPolicy &connectPolicy() { return policy; }
+
+  /// Starts the deadline of an operation (if defined in the policy): the
+  /// connects and replies fail when it has expired
+  void startDeadline(unsigned long startTime) {
+    has_deadline = policy.deadline_ms > 0;
+    deadline = startTime + policy.deadline_ms;
+  }
+
+  void startDeadline() { startDeadline(millis()); }
+
+  /// Ends the deadline of the current operation
+  void clearDeadline() { has_deadline = false; }
+
+  /// Provides the parser with the last reply
+  FTPReplyParser &reply() { return reply_parser; }
+
+  /// Returns true if nothing was received since the indicated time for longer
+  /// than the reply timeout or if the deadline of the operation has expired:
+  /// used by the non-blocking engines which poll with pollReply()
+  bool isReplyOverdue(unsigned long since) {
+    return millis() - since > policy.reply_timeout_ms || isDeadlineExpired();
+  }
+
+  /// Processes the available characters of the reply without blocking:
+  /// returns true when the reply to a command sent with sendCmd() is complete
+  bool pollReply() {
+    if (!reply_parser.readFrom(*command_ptr)) return false;
+    FTP_STAT(countReply());
+    return true;
+  }
+
   bool cmd(const char *command, const char *par, const char *expected,
            bool wait_for_data = true) {
     const char *expected_array[] = {expected, nullptr};
@@ -274,21 +989,29 @@ class FTPBasicAPI {
 
   bool cmd(const char *command_str, const char *par, const char *expected[],
            bool wait_for_data = true) {
-    char command_buffer[FTP_COMMAND_BUFFER_SIZE];
-    Stream *stream_ptr = command_ptr;
-    if (par == nullptr) {
-      strncpy(command_buffer, command_str, FTP_COMMAND_BUFFER_SIZE);
-      stream_ptr->println(command_buffer);
-    } else {
-      snprintf(command_buffer, FTP_COMMAND_BUFFER_SIZE, "%s %s", command_str,
-               par);
-      stream_ptr->println(command_buffer);
-    }
-    FTPLogger::writeLog(LOG_DEBUG, "FTPBasicAPI::cmd", command_buffer);
-
+    const char *command_buffer = sendCmd(command_str, par);
     return checkResult(expected, command_buffer, wait_for_data);
   }
 
+  /// Sends a command without waiting for the reply: returns the command line
+  const char *sendCmd(const char *command_str, const char *par) {
+    // reserve the space for the CRLF
+    const int max_len = FTP_COMMAND_BUFFER_SIZE - 2;
+    int len = par == nullptr
+                  ? snprintf(command_buffer, max_len, "%s", command_str)
+                  : snprintf(command_buffer, max_len, "%s %s", command_str, par);
+    if (len >= max_len) len = max_len - 1;
+    // send the command with a single write
+    command_buffer[len] = '\r';
+    command_buffer[len + 1] = '\n';
+    command_ptr->write((const uint8_t *)command_buffer, len + 2);
+    last_command_time = millis();
+    command_buffer[len] = '\0';
+    FTP_STAT(countCommand(command_buffer));
+    FTPLogger::writeLog(LOG_DEBUG, "FTPBasicAPI::cmd", command_buffer);
+    return command_buffer;
+  }
+
   void setUseTypeCommand(bool useType) {
     use_type = useType;
   }
@@ -300,42 +1023,298 @@ class FTPBasicAPI {
   Client *data_ptr = nullptr;     // Client for upload and download of files
   IPAddress remote_address;
   bool is_open = false;
+  unsigned long last_command_time = 0;
+  FTPMetadataCache *p_metadata = nullptr;
+  void (*release_cb)(void *ref) = nullptr;
+  void *release_cb_ref = nullptr;
   bool use_type = false;
+  bool use_epsv = FTP_USE_EPSV;
+  bool use_pasv_host = false;
   char result_reply[100];
+  int features = 0;
+  bool features_queried = false;
+  char command_buffer[FTP_COMMAND_BUFFER_SIZE];
+  FTPReplyParser reply_parser;
+  FTPConnectPolicy policy;
+  unsigned long deadline = 0;
+  bool has_deadline = false;
+  uint8_t *read_buffer = nullptr;
+  size_t read_buffer_capacity = 0;
+  size_t read_buffer_size = FTP_READ_BUFFER_SIZE;
+  size_t read_buffer_len = 0;
+  size_t read_buffer_pos = 0;
+  uint8_t *write_buffer = nullptr;
+  size_t write_buffer_size = FTP_WRITE_BUFFER_SIZE;
+  size_t write_buffer_len = 0;
+  bool use_mode_z = FTP_USE_MODE_Z;
+  // the server is in MODE Z
+  bool is_mode_z = false;
+  // the current transfer is compressed
+  bool is_compressed = false;
+  bool is_transfer_started = false;
+  FTPDeflate *p_deflate = nullptr;
+  FTPInflate *p_inflate = nullptr;
+  FTPChecksum *p_checksum = nullptr;
+  bool is_checksum = false;
+  // algorithms which are supported by HASH as bits
+  int hash_algorithms = 0;
+  FTPHashAlgorithm hash_selected = HASH_NONE;
+#if FTP_STATISTICS
+  FTPStatistics stats;
+  // send times of the commands which are waiting for their reply
+  unsigned long pending_time[FTP_PIPELINE_DEPTH];
+  int pending_start = 0;
+  int pending_count = 0;
+
+  void countCommand(const char *commandLine) {
+    stats.commands[FTPStatistics::command(commandLine)]++;
+    // if the pipeline is full we drop the oldest entry
+    if (pending_count == FTP_PIPELINE_DEPTH) {
+      pending_start = (pending_start + 1) % FTP_PIPELINE_DEPTH;
+      pending_count--;
+    }
+    pending_time[(pending_start + pending_count) % FTP_PIPELINE_DEPTH] =
+        micros();
+    pending_count++;
+  }
+
+  /// Records the latency of the reply: replies which do not belong to a
+  /// command (e.g. the 226 at the end of a transfer) are ignored
+  void countReply() {
+    if (pending_count == 0) return;
+    stats.addReply(micros() - pending_time[pending_start]);
+    pending_start = (pending_start + 1) % FTP_PIPELINE_DEPTH;
+    pending_count--;
+  }
+#endif
+
+  bool getMetadata(const char *file, FTPFileInfo &info) {
+    if (p_metadata == nullptr || !p_metadata->get(file, info)) return false;
+    FTPLogger::writeLog(LOG_DEBUG, "FTPBasicAPI", "metadata: cached");
+    return info.type != TypeUndefined;
+  }
+
+  void putMetadata(const char *file, const FTPFileInfo &info) {
+    if (p_metadata != nullptr) p_metadata->put(file, info);
+  }
+
+  /// Refills the empty read buffer with the available data: returns false
+  /// if there is no data
+  bool fillReadBuffer() {
+    clearReadBuffer();
+    if (is_compressed) {
+      allocReadBuffer(readBufferSize());
+      read_buffer_len = inflateData(read_buffer, readBufferSize());
+      return read_buffer_len > 0;
+    }
+    int available = data_ptr->available();
+    if (available <= 0) return false;
+    allocReadBuffer(read_buffer_size);
+    size_t len = read_buffer_size;
+    if (len > (size_t)available) len = available;
+    int rc = data_ptr->read(read_buffer, len);
+    if (rc <= 0) return false;
+    FTP_STAT(stats.bytes_received += rc);
+    read_buffer_len = rc;
+    return true;
+  }
+
+  /// Makes sure that the read buffer can hold the indicated number of bytes
+  void allocReadBuffer(size_t size) {
+    if (read_buffer != nullptr && read_buffer_capacity >= size) return;
+    delete[] read_buffer;
+    read_buffer = new uint8_t[size];
+    read_buffer_capacity = size;
+  }
+
+  void clearReadBuffer() {
+    read_buffer_len = 0;
+    read_buffer_pos = 0;
+  }
+
+  /// The decompressed data is always buffered
+  size_t readBufferSize() {
+    if (is_compressed && read_buffer_size == 0) return FTP_MODEZ_BUFFER_SIZE;
+    return read_buffer_size;
+  }
+
+  /// Selects MODE Z or MODE S for the next transfer: returns true if the
+  /// data is compressed
+  bool selectMode(bool compress) {
+    if (compress && setModeZ(true)) return true;
+    setModeZ(false);
+    return false;
+  }
+
+  void beginInflate() {
+    if (p_inflate == nullptr) p_inflate = new FTPInflate();
+    p_inflate->begin();
+    is_compressed = true;
+  }
+
+  void beginDeflate() {
+    if (p_deflate == nullptr) p_deflate = new FTPDeflate();
+    FTP_STAT(uint64_t sent = p_deflate->totalOut());
+    p_deflate->begin(*data_ptr);
+    FTP_STAT(stats.bytes_sent += p_deflate->totalOut() - sent);
+    is_compressed = true;
+  }
+
+  /// Decompresses the available data without blocking
+  size_t inflateData(uint8_t *data, size_t len) {
+    size_t result = p_inflate->read(data, len);
+    while (result == 0 && p_inflate->needsInput()) {
+      int available = data_ptr->available();
+      if (available <= 0) break;
+      size_t space;
+      uint8_t *input = p_inflate->inputBuffer(space);
+      if (space > (size_t)available) space = available;
+      int rc = data_ptr->read(input, space);
+      if (rc <= 0) break;
+      FTP_STAT(stats.bytes_received += rc);
+      p_inflate->addInput(rc);
+      result = p_inflate->read(data, len);
+    }
+    return result;
+  }
+
+  /// Sends the collected data
+  bool flushWriteBuffer() {
+    if (write_buffer_len == 0) return true;
+    size_t len = data_ptr->write(write_buffer, write_buffer_len);
+    FTP_STAT(stats.bytes_sent += len);
+    bool ok = len == write_buffer_len;
+    write_buffer_len = 0;
+    if (!ok) FTPLogger::writeLog(LOG_ERROR, "FTPBasicAPI", "write failed");
+    return ok;
+  }
+
+  static void featureLineCallback(const char *line, void *ref) {
+    FTPBasicAPI *self = (FTPBasicAPI *)ref;
+    // features are listed as " FEATURE parameters"
+    if (line[0] != ' ') return;
+    const char *feature = line + 1;
+    if (strncasecmp(feature, "MLST", 4) == 0) self->features |= FEAT_MLST;
+    if (strncasecmp(feature, "SIZE", 4) == 0) self->features |= FEAT_SIZE;
+    if (strncasecmp(feature, "MDTM", 4) == 0) self->features |= FEAT_MDTM;
+    if (strncasecmp(feature, "REST", 4) == 0) self->features |= FEAT_REST;
+    if (strncasecmp(feature, "EPSV", 4) == 0) self->features |= FEAT_EPSV;
+    if (strncasecmp(feature, "MODE Z", 6) == 0) self->features |= FEAT_MODEZ;
+    if (strncasecmp(feature, "XCRC", 4) == 0) self->features |= FEAT_XCRC;
+    if (strncasecmp(feature, "XMD5", 4) == 0) self->features |= FEAT_XMD5;
+    if (strncasecmp(feature, "XSHA1", 5) == 0) self->features |= FEAT_XSHA1;
+    if (strncasecmp(feature, "HASH ", 5) == 0) {
+      self->features |= FEAT_HASH;
+      self->parseHashAlgorithms(feature + 5);
+    }
+  }
+
+  /// Parses the algorithms of the HASH feature e.g. "SHA-256;SHA-1*;MD5":
+  /// the selected one is marked with *
+  void parseHashAlgorithms(const char *list) {
+    while (*list != '\0') {
+      int len = strcspn(list, ";*\r\n");
+      for (int alg = HASH_CRC32; alg <= HASH_SHA1; alg++) {
+        const char *name = FTPChecksum::name((FTPHashAlgorithm)alg);
+        if ((int)strlen(name) == len && strncasecmp(list, name, len) == 0) {
+          hash_algorithms |= 1 << alg;
+          if (list[len] == '*') hash_selected = (FTPHashAlgorithm)alg;
+        }
+      }
+      list += len;
+      while (*list == '*' || *list == ';' || *list == '\r' || *list == '\n') {
+        list++;
+      }
+    }
+  }
+
+  static void copyFact(char *target, int target_size, const char *value,
+                       int value_len) {
+    if (value_len > target_size - 1) value_len = target_size - 1;
+    strncpy(target, value, value_len);
+    target[value_len] = '\0';
+  }
+
+  /// Feeds the reply parser until the reply is complete or the timeout has
+  /// expired
+  bool waitReply(unsigned long timeout_ms) {
+    unsigned long end = millis() + limitToDeadline(timeout_ms);
+    while (!reply_parser.readFrom(*command_ptr)) {
+      if (!command_ptr->connected() && command_ptr->available() == 0) {
+        FTPLogger::writeLog(LOG_ERROR, "FTPBasicAPI", "connection closed");
+        return false;
+      }
+      if ((long)(millis() - end) >= 0) {
+        FTPLogger::writeLog(LOG_ERROR, "FTPBasicAPI",
+                            isDeadlineExpired() ? "deadline expired"
+                                                : "reply timeout");
+        return false;
+      }
+      delay(FTP_POLL_DELAY_MS);
+    }
+    FTP_STAT(countReply());
+    return true;
+  }
+
+  /// Provides the timeout reduced to the time which is left until the
+  /// deadline
+  unsigned long limitToDeadline(unsigned long timeout_ms) {
+    if (!has_deadline) return timeout_ms;
+    long left = (long)(deadline - millis());
+    if (left <= 0) return 0;
+    return (unsigned long)left < timeout_ms ? left : timeout_ms;
+  }
+
+  bool isDeadlineExpired() {
+    return has_deadline && (long)(millis() - deadline) >= 0;
+  }
+
+  /// Provides the backoff with a random variation of +/- jitter_percent
+  unsigned long jitter(unsigned long backoff) {
+    long range = backoff * policy.jitter_percent / 100;
+    if (range <= 0) return backoff;
+    return backoff - range + random(0, 2 * range + 1);
+  }
 
   bool connect(IPAddress adr, int port, Client *client_ptr,
                bool doCheckResult = false) {
-    char buffer[80];
-    bool ok = true;
-#if defined(ESP32) || defined(ESP8266)
-    sprintf(buffer, "connect %s:%d", adr.toString().c_str(), port);
-    FTPLogger::writeLog(LOG_DEBUG, "FTPBasicAPI::connect", buffer);
-#endif
-    // try to connect 10 times
+    bool ok = false;
+    FTPLogger::writeLogf(LOG_DEBUG, "FTPBasicAPI::connect", "%d.%d.%d.%d:%d",
+                         adr[0], adr[1], adr[2], adr[3], port);
     if (client_ptr->connected()) client_ptr->stop();  // make sure we start with a clean state
-    for (int j = 0; j < 10; j++) {
-      ok = client_ptr->connect(adr, port);
+    unsigned long backoff = policy.backoff_ms;
+    for (int j = 0; j < policy.max_attempts && !isDeadlineExpired(); j++) {
+      if (j > 0) {
+        // we do not wait if the deadline expires before the next attempt
+        unsigned long wait = jitter(backoff);
+        if (limitToDeadline(wait) < wait) break;
+        FTP_STAT(stats.connect_retries++);
+        delay(wait);
+        backoff = backoff * 2 > policy.max_backoff_ms ? policy.max_backoff_ms
+                                                      : backoff * 2;
+      }
+      if (policy.connect_timeout_ms > 0) {
+        unsigned long timeout = client_ptr->getTimeout();
+        client_ptr->setTimeout(policy.connect_timeout_ms);
+        ok = client_ptr->connect(adr, port);
+        client_ptr->setTimeout(timeout);
+      } else {
+        ok = client_ptr->connect(adr, port);
+      }
       if (ok) break;
-      delay(500);
+      FTPLogger::writeLogf(LOG_WARN, "FTPBasicAPI::connect", "attempt %d failed",
+                           j + 1);
     }
-    // ok = client_ptr->connect(adr, port);
-    ok = client_ptr->connected();
+    ok = ok && client_ptr->connected();
+    FTP_STAT(if (!ok) stats.connect_failures++);
     if (ok && doCheckResult) {
       const char *ok_result[] = {"220", "200", nullptr};
       ok = checkResult(ok_result, "connect");
-
-      // there might be some more messages: e.g. in FileZilla: we just ignore
-      // them
-      while (command_ptr->available() > 0) {
-        command_ptr->read();
-      }
     }
     // log result
-    if (ok) {
-      FTPLogger::writeLog(LOG_DEBUG, "FTPBasicAPI::connected", buffer);
-    } else {
-      FTPLogger::writeLog(LOG_ERROR, "FTPBasicAPI::connected", buffer);
-    }
+    FTPLogger::writeLogf(ok ? LOG_DEBUG : LOG_ERROR, "FTPBasicAPI::connected",
+                         "%d.%d.%d.%d:%d", adr[0], adr[1], adr[2], adr[3],
+                         port);
     return ok;
   }
 };
@@ -0,0 +1,319 @@
+#pragma once
+
+#include "Arduino.h"
+#include "FTPCommon.h"
+
+namespace ftp_client {
+
+/// Hash algorithms which can be used to verify a transfer
+enum FTPHashAlgorithm { HASH_NONE = 0, HASH_CRC32, HASH_MD5, HASH_SHA1 };
+
+/// Result of the verification of a transfer
+enum FTPVerifyResult {
+  /// no checksum was requested
+  VERIFY_NONE,
+  /// the checksum is equal to the hash of the server
+  VERIFY_OK,
+  VERIFY_MISMATCH,
+  /// the server could not provide the hash
+  VERIFY_UNSUPPORTED,
+  /// the transfer failed or only covered a part of the file
+  VERIFY_INCOMPLETE
+};
+
+/**
+ * @brief FTPChecksum
+ * Incremental CRC32, MD5 or SHA-1 of the transferred data, so that a file
+ * can be verified without a second pass over the data. MD5 and SHA-1 share
+ * the same 64 byte block buffer, so that the object needs about 100 bytes.
+ * @author Phil Schatzmann
+ */
+class FTPChecksum {
+ public:
+  FTPChecksum(FTPHashAlgorithm algorithm = HASH_NONE) { begin(algorithm); }
+
+  /// Starts a new calculation
+  void begin(FTPHashAlgorithm algorithm) {
+    this->algorithm = algorithm;
+    count = 0;
+    is_final = false;
+    switch (algorithm) {
+      case HASH_CRC32:
+        state[0] = 0xFFFFFFFF;
+        break;
+      case HASH_MD5:
+        state[0] = 0x67452301;
+        state[1] = 0xEFCDAB89;
+        state[2] = 0x98BADCFE;
+        state[3] = 0x10325476;
+        break;
+      case HASH_SHA1:
+        state[0] = 0x67452301;
+        state[1] = 0xEFCDAB89;
+        state[2] = 0x98BADCFE;
+        state[3] = 0x10325476;
+        state[4] = 0xC3D2E1F0;
+        break;
+      default:
+        break;
+    }
+  }
+
+  /// Adds the data
+  void update(const uint8_t *data, size_t len) {
+    if (is_final) return;
+    if (algorithm == HASH_CRC32) {
+      uint32_t crc = state[0];
+      for (size_t j = 0; j < len; j++) {
+        crc ^= data[j];
+        crc = (crc >> 4) ^ crcTable()[crc & 0x0F];
+        crc = (crc >> 4) ^ crcTable()[crc & 0x0F];
+      }
+      state[0] = crc;
+      count += len;
+    } else if (algorithm == HASH_MD5 || algorithm == HASH_SHA1) {
+      while (len > 0) {
+        size_t pos = count % 64;
+        size_t n = 64 - pos;
+        if (n > len) n = len;
+        memcpy(block + pos, data, n);
+        count += n;
+        data += n;
+        len -= n;
+        if (pos + n == 64) transform();
+      }
+    }
+  }
+
+  void update(uint8_t value) { update(&value, 1); }
+
+  /// Completes the calculation and provides the digest with size() bytes
+  const uint8_t *digest() {
+    if (!is_final) finish();
+    return block;
+  }
+
+  /// Provides the digest as lower case hex string: the buffer needs
+  /// 2 * size() + 1 characters
+  const char *toHex(char *hex) {
+    static const char digits[] = "0123456789abcdef";
+    const uint8_t *value = digest();
+    int len = size();
+    for (int j = 0; j < len; j++) {
+      hex[2 * j] = digits[value[j] >> 4];
+      hex[2 * j + 1] = digits[value[j] & 0x0F];
+    }
+    hex[2 * len] = '\0';
+    return hex;
+  }
+
+  /// Compares the digest with the hex string reported by a server (case
+  /// insensitive): servers may omit the leading zeros of a CRC32
+  bool equals(const char *hex) {
+    char local[2 * FTP_HASH_MAX_SIZE + 1];
+    toHex(local);
+    int len = strlen(hex);
+    int local_len = strlen(local);
+    if (len == 0 || len > local_len) return false;
+    // missing leading digits must be 0
+    for (int j = 0; j < local_len - len; j++) {
+      if (local[j] != '0') return false;
+    }
+    return strncasecmp(local + local_len - len, hex, len) == 0;
+  }
+
+  /// Size of the digest in bytes
+  int size() const { return size(algorithm); }
+
+  /// Number of processed bytes
+  uint64_t processed() const { return count; }
+
+  FTPHashAlgorithm hashAlgorithm() const { return algorithm; }
+
+  /// Size of the digest in bytes
+  static int size(FTPHashAlgorithm algorithm) {
+    switch (algorithm) {
+      case HASH_CRC32:
+        return 4;
+      case HASH_MD5:
+        return 16;
+      case HASH_SHA1:
+        return 20;
+      default:
+        return 0;
+    }
+  }
+
+  /// Name of the algorithm as used by the HASH command
+  static const char *name(FTPHashAlgorithm algorithm) {
+    switch (algorithm) {
+      case HASH_CRC32:
+        return "CRC32";
+      case HASH_MD5:
+        return "MD5";
+      case HASH_SHA1:
+        return "SHA-1";
+      default:
+        return nullptr;
+    }
+  }
+
+ protected:
+  FTPHashAlgorithm algorithm = HASH_NONE;
+  uint32_t state[5];
+  // data of the current block and finally the digest
+  uint8_t block[64];
+  uint64_t count = 0;
+  bool is_final = false;
+
+  static const uint32_t *crcTable() {
+    static const uint32_t table[16] = {
+        0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC,
+        0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+        0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C,
+        0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C};
+    return table;
+  }
+
+  static uint32_t rotl(uint32_t value, int bits) {
+    return (value << bits) | (value >> (32 - bits));
+  }
+
+  void finish() {
+    if (algorithm == HASH_CRC32) {
+      putBigEndian(block, ~state[0]);
+    } else if (algorithm == HASH_MD5 || algorithm == HASH_SHA1) {
+      uint64_t bits = count * 8;
+      // padding: 0x80, zeros and the length in bits
+      uint8_t pad = 0x80;
+      update(&pad, 1);
+      pad = 0;
+      while (count % 64 != 56) update(&pad, 1);
+      uint8_t length[8];
+      for (int j = 0; j < 8; j++) {
+        int shift = algorithm == HASH_MD5 ? j * 8 : (7 - j) * 8;
+        length[j] = (uint8_t)(bits >> shift);
+      }
+      update(length, 8);
+      int words = algorithm == HASH_MD5 ? 4 : 5;
+      for (int j = 0; j < words; j++) {
+        if (algorithm == HASH_MD5) {
+          for (int k = 0; k < 4; k++) block[j * 4 + k] = state[j] >> (k * 8);
+        } else {
+          putBigEndian(block + j * 4, state[j]);
+        }
+      }
+    }
+    is_final = true;
+  }
+
+  static void putBigEndian(uint8_t *target, uint32_t value) {
+    for (int k = 0; k < 4; k++) target[k] = value >> ((3 - k) * 8);
+  }
+
+  void transform() {
+    if (algorithm == HASH_MD5) {
+      transformMD5();
+    } else {
+      transformSHA1();
+    }
+  }
+
+  void transformMD5() {
+    static const uint32_t k[64] = {
+        0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf,
+        0x4787c62a, 0xa8304613, 0xfd469501, 0x698098d8, 0x8b44f7af,
+        0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e,
+        0x49b40821, 0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa,
+        0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8, 0x21e1cde6,
+        0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8,
+        0x676f02d9, 0x8d2a4c8a, 0xfffa3942, 0x8771f681, 0x6d9d6122,
+        0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+        0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039,
+        0xe6db99e5, 0x1fa27cf8, 0xc4ac5665, 0xf4292244, 0x432aff97,
+        0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d,
+        0x85845dd1, 0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1,
+        0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391};
+    static const uint8_t shifts[16] = {7, 12, 17, 22, 5, 9,  14, 20,
+                                       4, 11, 16, 23, 6, 10, 15, 21};
+    uint32_t m[16];
+    for (int j = 0; j < 16; j++) {
+      m[j] = (uint32_t)block[j * 4] | ((uint32_t)block[j * 4 + 1] << 8) |
+             ((uint32_t)block[j * 4 + 2] << 16) |
+             ((uint32_t)block[j * 4 + 3] << 24);
+    }
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    for (int j = 0; j < 64; j++) {
+      uint32_t f;
+      int g;
+      if (j < 16) {
+        f = (b & c) | (~b & d);
+        g = j;
+      } else if (j < 32) {
+        f = (d & b) | (~d & c);
+        g = (5 * j + 1) % 16;
+      } else if (j < 48) {
+        f = b ^ c ^ d;
+        g = (3 * j + 5) % 16;
+      } else {
+        f = c ^ (b | ~d);
+        g = (7 * j) % 16;
+      }
+      uint32_t tmp = d;
+      d = c;
+      c = b;
+      b = b + rotl(a + f + k[j] + m[g], shifts[(j / 16) * 4 + j % 4]);
+      a = tmp;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+  }
+
+  void transformSHA1() {
+    uint32_t w[16];
+    for (int j = 0; j < 16; j++) {
+      w[j] = ((uint32_t)block[j * 4] << 24) |
+             ((uint32_t)block[j * 4 + 1] << 16) |
+             ((uint32_t)block[j * 4 + 2] << 8) | (uint32_t)block[j * 4 + 3];
+    }
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3],
+             e = state[4];
+    for (int j = 0; j < 80; j++) {
+      // the message schedule is calculated in place
+      if (j >= 16) {
+        w[j % 16] = rotl(w[(j + 13) % 16] ^ w[(j + 8) % 16] ^
+                             w[(j + 2) % 16] ^ w[j % 16],
+                         1);
+      }
+      uint32_t f, k;
+      if (j < 20) {
+        f = (b & c) | (~b & d);
+        k = 0x5A827999;
+      } else if (j < 40) {
+        f = b ^ c ^ d;
+        k = 0x6ED9EBA1;
+      } else if (j < 60) {
+        f = (b & c) | (b & d) | (c & d);
+        k = 0x8F1BBCDC;
+      } else {
+        f = b ^ c ^ d;
+        k = 0xCA62C1D6;
+      }
+      uint32_t tmp = rotl(a, 5) + f + e + k + w[j % 16];
+      e = d;
+      d = c;
+      c = rotl(b, 30);
+      b = a;
+      a = tmp;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+  }
+};
+
+}  // namespace ftp_client
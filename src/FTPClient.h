@@ -5,6 +5,13 @@
 #include "FTPBasicAPI.h"
 #include "FTPFile.h"
 #include "FTPFileIterator.h"
+#include "FTPListingCache.h"
+#include "FTPMirror.h"
+#include "FTPSegmentedDownload.h"
+#include "FTPServerCopy.h"
+#include "FTPStreamCopy.h"
+#include "FTPTransferQueue.h"
+#include "FTPTreeWalker.h"
 #include "FTPSessionMgr.h"
 #include "IPAddress.h"
 #include "Stream.h"
@@ -14,10 +21,12 @@ namespace ftp_client {
 /**
  * @brief FTPClient
  * Basic FTP access class which supports directory operations and the opening
- * of files
+ * of files. Each operation checks out its own session from the pool of up to
+ * N sessions: opened files and directory listings keep their session until
+ * they are closed or the listing has ended.
  * @author Phil Schatzmann
  */
-template <class ClientType>
+template <class ClientType, int N = FTP_MAX_SESSIONS>
 class FTPClient {
  public:
   /// Default constructor: Provide the client class as template argument e.g. FTPClient<WiFiClient> client;
@@ -25,6 +34,9 @@ class FTPClient {
     FTPLogger::writeLog(LOG_DEBUG, "FTPClient");
     setUseTypeCommand(useType);
     setPort(port);
+    listing_cache.begin(FTP_LISTING_CACHE_SIZE, FTP_LISTING_CACHE_TTL_MS);
+    metadata_cache.begin(FTP_METADATA_CACHE_ENTRIES, FTP_METADATA_CACHE_TTL_MS);
+    mgr.setMetadataCache(&metadata_cache);
   }
 
   /// if set to true the BIN and ASCII command are executed as type I or A 
@@ -42,87 +54,353 @@ class FTPClient {
     return mgr.begin(remote_addr, this->port, user, password);
   }
 
+  /// Defines the number of sessions which are opened in begin() (or in the
+  /// background by loop()) and kept open
+  void setWarmSessions(int count, bool inBackground = false) {
+    mgr.setWarmSessions(count, inBackground);
+  }
+
+  /// Defines the interval in ms for the NOOP keepalive of idle sessions
+  void setKeepAlive(unsigned long intervalMs) { mgr.setKeepAlive(intervalMs); }
+
+  /// Call regularly to keep the idle sessions alive and to replace broken ones
+  void loop() { mgr.loop(); }
+
+  /// Defines the connect attempts, backoff with jitter, connect and reply
+  /// timeouts and the deadline of the operations
+  void setConnectPolicy(const FTPConnectPolicy &policy) {
+    mgr.setConnectPolicy(policy);
+  }
+
+  /// Defines if the files are downloaded and uploaded compressed (MODE Z)
+  /// if the server supports it: listings and partial transfers are never
+  /// compressed
+  void setUseModeZ(bool flag) { mgr.setUseModeZ(flag); }
+
+  /// Defines if the data connections are opened with EPSV (falling back to
+  /// PASV) or only with PASV
+  void setUseEPSV(bool flag) { mgr.setUseEPSV(flag); }
+
+  /// If set to true we connect to the host which is reported in the PASV
+  /// reply, otherwise to the address of the FTP server
+  void setUsePasvHost(bool flag) { mgr.setUsePasvHost(flag); }
+
   /// Close the sessions by calling QUIT or BYE
   void end() {
     FTPLogger::writeLog(LOG_INFO, "FTPClient", "end");
     mgr.end();
   }
 
-  /// Open a file
+  /// Open a file: with WRITE_RESUME_MODE the upload continues at the end
+  /// of the remote file (see FTPFile::resumeOffset())
   FTPFile open(const char *filename, FileMode mode = READ_MODE,
                bool autoClose = false) {
-    char msg[200];
-    snprintf(msg, sizeof(msg), "open: %s", filename);
-    FTPLogger::writeLog(LOG_INFO, "FTPClient", msg);
+    FTPLogger::writeLogf(LOG_INFO, "FTPClient", "open: %s", filename);
 
-    FTPBasicAPI &api = mgr.session().api();
+    FTPSessionLease<ClientType, N> lease = mgr.acquire();
+    if (!lease) return FTPFile();
+    FTPBasicAPI &api = lease.api();
+    if (mode != READ_MODE) listing_cache.invalidateParent(filename);
 
-    // Open new data connection
-    api.passv();
+    // determine the size of the partial upload
+    uint64_t offset = 0;
+    if (mode == WRITE_RESUME_MODE) {
+      api.type("I");
+      offset = api.size(filename);
+    }
+
+    // Open new data connection: on failure the lease returns the session
+    if (!api.passv()) return FTPFile();
+    api.setWriteBufferSize(write_buffer_size);
+    api.setReadBufferSize(read_buffer_size);
+
+    // the session is released by FTPFile::close()
+    return FTPFile(lease.detach(), filename, mode, autoClose, offset, true);
+  }
 
-    return FTPFile(&api, filename, mode, autoClose);
+  /// Downloads the file into the sink with two buffers of
+  /// setCopyBufferSize() bytes, so that receiving and writing overlap
+  bool download(const char *filename, Stream &sink,
+                FTPProgressCallback progress = nullptr, void *ref = nullptr) {
+    FTPLogger::writeLog(LOG_INFO, "FTPClient", "download");
+    FTPFile file = open(filename, READ_MODE);
+    if (!file) return false;
+    FTPStreamCopy copy(copy_buffer_size);
+    if (progress != nullptr) {
+      copy.setProgress(progress, ref);
+      copy.setTotal(file.size());
+    }
+    if (!copy.download(file, sink)) {
+      file.cancel();
+      return false;
+    }
+    return file.close();
+  }
+
+  /// Provides the data of the file to the callback as it arrives, without
+  /// copying it: the data is only valid during the call
+  bool read(const char *filename, FTPDataCallback callback,
+            void *ref = nullptr) {
+    FTPLogger::writeLog(LOG_INFO, "FTPClient", "read");
+    FTPFile file = open(filename, READ_MODE);
+    if (!file) return false;
+    if (!file.read(callback, ref)) {
+      file.cancel();
+      return false;
+    }
+    return file.close();
+  }
+
+  /// Copies the file directly to the server of the target client (FXP):
+  /// the data does not pass through this device
+  template <class TargetClientType, int M>
+  bool copyTo(const char *filename, FTPClient<TargetClientType, M> &target,
+              const char *targetFilename) {
+    FTPLogger::writeLog(LOG_INFO, "FTPClient", "copyTo");
+    FTPSessionLease<ClientType, N> lease = mgr.acquire();
+    if (!lease) return false;
+    FTPSessionLease<TargetClientType, M> target_lease =
+        target.sessionMgr().acquire();
+    if (!target_lease) return false;
+    target.listingCache().invalidateParent(targetFilename);
+    FTPServerCopy copy;
+    return copy.copy(lease.api(), filename, target_lease.api(),
+                     targetFilename);
+  }
+
+  /// Uploads the available data of the source with two buffers of
+  /// setCopyBufferSize() bytes, so that reading and sending overlap
+  template <class StreamType>
+  bool upload(StreamType &source, const char *filename,
+              FTPProgressCallback progress = nullptr, void *ref = nullptr) {
+    FTPLogger::writeLog(LOG_INFO, "FTPClient", "upload");
+    FTPFile file = open(filename, WRITE_MODE);
+    if (!file) return false;
+    FTPStreamCopy copy(copy_buffer_size);
+    if (progress != nullptr) {
+      copy.setProgress(progress, ref);
+      copy.setTotal(source.available());
+    }
+    if (!copy.upload(source, file)) {
+      file.cancel();
+      return false;
+    }
+    return file.close();
+  }
+
+  /// Downloads the file over multiple sessions in parallel: each byte range
+  /// is provided with its position to the writer callback
+  bool downloadSegmented(const char *filename, FTPPositionalWriter writer,
+                         void *ref = nullptr, int segments = 4) {
+    FTPSegmentedDownload<ClientType, N> download(mgr);
+    download.setSegments(segments);
+    return download.download(filename, writer, ref);
+  }
+
+  /// Downloads the file over multiple sessions in parallel and writes the
+  /// data in sequence to the output stream
+  bool downloadSegmented(const char *filename, Stream &out, int segments = 4) {
+    FTPSegmentedDownload<ClientType, N> download(mgr);
+    download.setSegments(segments);
+    return download.download(filename, out);
+  }
+
+  /// Uploads or downloads the indicated files concurrently over up to
+  /// maxSessions sessions: returns true if all jobs were successful
+  bool transfer(FTPTransferJob jobs[], int n, int maxSessions = 4) {
+    FTPLogger::writeLog(LOG_INFO, "FTPClient", "transfer");
+    FTPTransferQueue<ClientType, N> queue(mgr);
+    queue.setMaxSessions(maxSessions);
+    for (int j = 0; j < n; j++) {
+      if (jobs[j].mode != READ_MODE) {
+        listing_cache.invalidateParent(jobs[j].remote_path);
+        metadata_cache.invalidate(jobs[j].remote_path);
+      }
+      queue.add(jobs[j]);
+    }
+    return queue.run();
+  }
+
+  /// Synchronizes a local directory and a remote directory recursively:
+  /// only new and changed files are transferred concurrently over up to
+  /// maxSessions sessions
+  bool mirror(FTPLocalFS &fs, const char *localDir, const char *remoteDir,
+              FTPMirrorDirection direction, int maxSessions = 4) {
+    FTPLogger::writeLog(LOG_INFO, "FTPClient", "mirror");
+    FTPMirror<ClientType, N> mirror(mgr, fs);
+    mirror.setMaxSessions(maxSessions);
+    bool result = mirror.mirror(localDir, remoteDir, direction);
+    if (direction == MIRROR_UPLOAD) {
+      listing_cache.clear();
+      metadata_cache.clear();
+    }
+    return result;
+  }
+
+  /// Walks the remote directory tree breadth first: the subdirectories are
+  /// listed concurrently over up to maxSessions sessions and the visitor is
+  /// called for each file and directory with the path of its parent
+  bool walk(const char *root,
+            void (*visitor)(const char *dir, const FTPFileInfo &info,
+                            void *ref),
+            void *ref = nullptr, int maxSessions = 4) {
+    FTPLogger::writeLog(LOG_INFO, "FTPClient", "walk");
+    FTPTreeWalker<ClientType, N> walker(mgr);
+    walker.setMaxSessions(maxSessions);
+    walker.setVisitor(visitor, ref);
+    return walker.walk(root);
   }
 
   /// Create the requested directory hierarchy--if intermediate directories
   /// do not exist they will be created.
   bool mkdir(const char *filepath) {
     FTPLogger::writeLog(LOG_INFO, "FTPClient", "mkdir");
-    FTPBasicAPI &api = mgr.session().api();
-    if (!api) return false;
+    FTPSessionLease<ClientType, N> lease = mgr.acquire();
+    if (!lease) return false;
+    FTPBasicAPI &api = lease.api();
+    listing_cache.invalidateParent(filepath);
     return api.mkdir(filepath);
   }
 
   /// Delete the file
   bool remove(const char *filepath) {
     FTPLogger::writeLog(LOG_INFO, "FTPClient", "remove");
-    FTPBasicAPI &api = mgr.session().api();
-    if (!api) return false;
+    FTPSessionLease<ClientType, N> lease = mgr.acquire();
+    if (!lease) return false;
+    FTPBasicAPI &api = lease.api();
+    listing_cache.invalidateParent(filepath);
     return api.del(filepath);
   }
 
+  /// Requests the hash of the remote file (HASH, XCRC, XMD5 or XSHA1) as
+  /// hex string: the buffer needs 2 * FTP_HASH_MAX_SIZE + 1 characters
+  bool remoteHash(const char *filepath, FTPHashAlgorithm algorithm,
+                  char *hex) {
+    FTPLogger::writeLog(LOG_INFO, "FTPClient", "remoteHash");
+    FTPSessionLease<ClientType, N> lease = mgr.acquire();
+    if (!lease) return false;
+    return lease.api().remoteHash(filepath, algorithm, hex);
+  }
+
   /// Removes a directory
   bool rmdir(const char *filepath) {
     FTPLogger::writeLog(LOG_INFO, "FTPClient", "rmdir");
-    FTPBasicAPI &api = mgr.session().api();
-    if (!api) return false;
+    FTPSessionLease<ClientType, N> lease = mgr.acquire();
+    if (!lease) return false;
+    FTPBasicAPI &api = lease.api();
+    listing_cache.invalidate(filepath);
+    listing_cache.invalidateParent(filepath);
     return api.rmd(filepath);
   }
 
-  /// Lists all file names in the specified directory
-  FTPFileIterator ls(const char *path, FileMode mode = WRITE_MODE) {
+  /// Determines the size, type and modification time of multiple files with
+  /// pipelined SIZE and MDTM commands on a single control connection
+  bool stat(const char *paths[], int n, FTPFileInfo results[]) {
+    FTPLogger::writeLog(LOG_INFO, "FTPClient", "stat");
+    FTPSessionLease<ClientType, N> lease = mgr.acquire();
+    if (!lease) return false;
+    FTPBasicAPI &api = lease.api();
+    return api.stat(paths, n, results);
+  }
+
+  /// Lists all file names in the specified directory. With LIST_MLSD the
+  /// entries provide the type, size and modification time: if the server
+  /// does not support MLST we fall back to NLST. If the listing cache is
+  /// active, a cached listing is replayed without any network access.
+  FTPFileIterator ls(const char *path, FileMode mode = WRITE_MODE,
+                     ListMode listMode = LIST_NLST) {
     FTPLogger::writeLog(LOG_INFO, "FTPClient", "ls");
-    FTPBasicAPI &api = mgr.session().api();
+    if (listing_cache.isActive()) {
+      FTPListingRef listing = listing_cache.find(path, listMode);
+      if (listing) {
+        FTPLogger::writeLog(LOG_DEBUG, "FTPClient", "ls: cached");
+        return FTPFileIterator(listing, path, mode);
+      }
+    }
+    ListMode key_mode = listMode;
+    FTPSessionLease<ClientType, N> lease = mgr.acquire();
+    if (!lease) return FTPFileIterator();
+    FTPBasicAPI &api = lease.api();
+    if (listMode == LIST_MLSD && !api.hasFeature(FEAT_MLST)) {
+      FTPLogger::writeLog(LOG_WARN, "FTPClient", "MLSD not supported");
+      listMode = LIST_NLST;
+    }
 
-    // Open new data connection
-    api.passv();
+    // Open new data connection: on failure the lease returns the session
+    if (!api.passv()) return FTPFileIterator();
 
-    FTPFileIterator it(&api, path, mode);
+    // the session is released at the end of the listing
+    FTPFileIterator it(lease.detach(), path, mode, listMode);
+    if (listing_cache.isActive()) it.setCache(&listing_cache, key_mode);
     return it;
   }
 
+  /// Lists the directory with the indicated list mode
+  FTPFileIterator ls(const char *path, ListMode listMode) {
+    return ls(path, WRITE_MODE, listMode);
+  }
+
   /// Switch to binary mode
   bool binary() {
-    FTPBasicAPI &api = mgr.session().api();
-    if (!api) return false;
+    FTPSessionLease<ClientType, N> lease = mgr.acquire();
+    if (!lease) return false;
+    FTPBasicAPI &api = lease.api();
     api.setUseTypeCommand(use_type_command);
     return api.binary();
   }
 
   /// Switch to ascii mode
   bool ascii() {
-    FTPBasicAPI &api = mgr.session().api();
-    if (!api) return false;
+    FTPSessionLease<ClientType, N> lease = mgr.acquire();
+    if (!lease) return false;
+    FTPBasicAPI &api = lease.api();
     api.setUseTypeCommand(use_type_command);
     return api.ascii();
   }
 
   /// Binary or ascii with type command
   bool type(const char *str) {
-    FTPBasicAPI &api = mgr.session().api();
-    if (!api) return false;
+    FTPSessionLease<ClientType, N> lease = mgr.acquire();
+    if (!lease) return false;
+    FTPBasicAPI &api = lease.api();
     return api.type(str);
   }
 
+  /// Activates the cache for directory listings with the indicated memory
+  /// limit in bytes (0 = inactive): the cached listings of a directory are
+  /// invalidated by mkdir(), remove(), rmdir() and uploads via this client
+  void setListingCache(size_t maxBytes,
+                       unsigned long ttlMs = FTP_LISTING_CACHE_TTL_MS) {
+    listing_cache.begin(maxBytes, ttlMs);
+  }
+
+  /// Provides access to the listing cache
+  FTPListingCache &listingCache() { return listing_cache; }
+
+  /// Activates the cache for the size, type and modification time of up to
+  /// maxEntries files (0 = inactive): the entries are filled by MLSD
+  /// listings, stat() and the first lookup and are invalidated by the write
+  /// operations of this client
+  void setMetadataCache(int maxEntries,
+                        unsigned long ttlMs = FTP_METADATA_CACHE_TTL_MS) {
+    metadata_cache.begin(maxEntries, ttlMs);
+  }
+
+  /// Provides access to the metadata cache
+  FTPMetadataCache &metadataCache() { return metadata_cache; }
+
+  /// Defines the size of the read-ahead buffer of the files which are opened
+  /// for reading (0 = no buffering)
+  void setReadBufferSize(size_t size) { read_buffer_size = size; }
+
+  /// Defines the size of the buffer which collects small writes of the
+  /// files which are opened for writing (0 = no buffering)
+  void setWriteBufferSize(size_t size) { write_buffer_size = size; }
+
+  /// Defines the size of each of the two buffers which are used by
+  /// download() and upload()
+  void setCopyBufferSize(size_t size) { copy_buffer_size = size; }
+
   void setPort(int port) {
     this->port = port;
   }
@@ -132,12 +410,18 @@ class FTPClient {
     return mgr.abort(op);
   } 
 
+  /// Provides the statistics of all sessions (requires FTP_STATISTICS)
+  FTPStatistics statistics() { return mgr.statistics(); }
+
+  /// Sets the statistics of all sessions to 0
+  void resetStatistics() { mgr.resetStatistics(); }
+
   /// Provides access to the session manager
-  FTPSessionMgr<ClientType> &sessionMgr() {
+  FTPSessionMgr<ClientType, N> &sessionMgr() {
     return mgr;
   }
  protected:
-  FTPSessionMgr<ClientType> mgr;
+  FTPSessionMgr<ClientType, N> mgr;
   IPAddress remote_addr;
   const char *userid = nullptr;
   const char *password = nullptr;
@@ -145,6 +429,11 @@ class FTPClient {
   bool cleanup_clients;
   bool auto_close = true;
   bool use_type_command = false;
+  size_t write_buffer_size = FTP_WRITE_BUFFER_SIZE;
+  size_t read_buffer_size = FTP_READ_BUFFER_SIZE;
+  size_t copy_buffer_size = FTP_COPY_BUFFER_SIZE;
+  FTPListingCache listing_cache;
+  FTPMetadataCache metadata_cache;
 
 };
 
@@ -13,6 +13,14 @@
 #define FTP_ABORT_DELAY_MS 300
 #endif
 
+#ifndef FTP_MIN_LOG_LEVEL 
+#define FTP_MIN_LOG_LEVEL LOG_DEBUG
+#endif
+
+#ifndef FTP_LOG_BUFFER_SIZE 
+#define FTP_LOG_BUFFER_SIZE 80
+#endif
+
 #ifndef FTP_COMMAND_BUFFER_SIZE 
 #define FTP_COMMAND_BUFFER_SIZE 300
 #endif
@@ -21,21 +29,268 @@
 #define FTP_RESULT_BUFFER_SIZE 300
 #endif
 
+#ifndef FTP_REPLY_TIMEOUT_MS 
+#define FTP_REPLY_TIMEOUT_MS 10000
+#endif
+
+// max number of attempts to open a connection
+#ifndef FTP_CONNECT_ATTEMPTS
+#define FTP_CONNECT_ATTEMPTS 3
+#endif
+
+// delay before the 2nd connect attempt: it is doubled for each attempt
+#ifndef FTP_CONNECT_BACKOFF_MS
+#define FTP_CONNECT_BACKOFF_MS 250
+#endif
+
+#ifndef FTP_CONNECT_MAX_BACKOFF_MS
+#define FTP_CONNECT_MAX_BACKOFF_MS 4000
+#endif
+
+// random variation of the backoff in percent
+#ifndef FTP_CONNECT_JITTER_PERCENT
+#define FTP_CONNECT_JITTER_PERCENT 25
+#endif
+
+// timeout which is set on the Client for a connect (0 = Client default)
+#ifndef FTP_CONNECT_TIMEOUT_MS
+#define FTP_CONNECT_TIMEOUT_MS 0
+#endif
+
+// max time to acquire a session and to start an operation (0 = no limit)
+#ifndef FTP_OPERATION_DEADLINE_MS
+#define FTP_OPERATION_DEADLINE_MS 0
+#endif
+
+#ifndef FTP_POLL_DELAY_MS 
+#define FTP_POLL_DELAY_MS 1
+#endif
+
+#ifndef FTP_MAX_LINE_SIZE 
+#define FTP_MAX_LINE_SIZE 256
+#endif
+
 #ifndef FTP_COMMAND_PORT 
 #define FTP_COMMAND_PORT 21
 #endif
 
+#ifndef FTP_PIPELINE_DEPTH
+#define FTP_PIPELINE_DEPTH 32
+#endif
+
+#ifndef FTP_MAX_SEGMENTS
+#define FTP_MAX_SEGMENTS 8
+#endif
+
+#ifndef FTP_SEGMENT_MIN_SIZE
+#define FTP_SEGMENT_MIN_SIZE 65536
+#endif
+
+#ifndef FTP_SEGMENT_BUFFER_SIZE
+#define FTP_SEGMENT_BUFFER_SIZE 4096
+#endif
+
+#ifndef FTP_TRANSFER_CHUNK_SIZE
+#define FTP_TRANSFER_CHUNK_SIZE 1024
+#endif
+
+// size of each of the two buffers of FTPClient::download() and upload()
+#ifndef FTP_COPY_BUFFER_SIZE
+#define FTP_COPY_BUFFER_SIZE 4096
+#endif
+
+// buffer of FTPClient::read() with a callback if no read buffer size has
+// been defined
+#ifndef FTP_RECEIVE_BUFFER_SIZE
+#define FTP_RECEIVE_BUFFER_SIZE 2048
+#endif
+
+// max duration in ms of a server to server copy (0 = unlimited)
+#ifndef FTP_SERVER_COPY_TIMEOUT_MS
+#define FTP_SERVER_COPY_TIMEOUT_MS 3600000
+#endif
+
+#ifndef FTP_READ_BUFFER_SIZE
+#define FTP_READ_BUFFER_SIZE 0
+#endif
+
+#ifndef FTP_WRITE_BUFFER_SIZE
+#define FTP_WRITE_BUFFER_SIZE 0
+#endif
+
+#ifndef FTP_USE_EPSV
+#define FTP_USE_EPSV true
+#endif
+
+#ifndef FTP_LISTING_CACHE_SIZE
+#define FTP_LISTING_CACHE_SIZE 0
+#endif
+
+#ifndef FTP_LISTING_CACHE_TTL_MS
+#define FTP_LISTING_CACHE_TTL_MS 30000
+#endif
+
+#ifndef FTP_METADATA_CACHE_ENTRIES
+#define FTP_METADATA_CACHE_ENTRIES 0
+#endif
+
+#ifndef FTP_METADATA_CACHE_TTL_MS
+#define FTP_METADATA_CACHE_TTL_MS 30000
+#endif
+
 #ifndef FTP_MAX_SESSIONS
 #define FTP_MAX_SESSIONS 10
 #endif
 
+// Size of the queue of pending directories of the FTPTreeWalker in bytes
+#ifndef FTP_WALK_QUEUE_SIZE
+#define FTP_WALK_QUEUE_SIZE 4096
+#endif
+
+#ifndef FTP_WARM_SESSIONS
+#define FTP_WARM_SESSIONS 0
+#endif
+
+#ifndef FTP_KEEPALIVE_MS
+#define FTP_KEEPALIVE_MS 30000
+#endif
+
+#ifndef FTP_RECONNECT_DELAY_MS
+#define FTP_RECONNECT_DELAY_MS 1000
+#endif
+
+#ifndef FTP_PROBE_TIMEOUT_MS
+#define FTP_PROBE_TIMEOUT_MS 2000
+#endif
+
+// max size of a digest in bytes (SHA-1)
+#define FTP_HASH_MAX_SIZE 20
+
+// transfer the files compressed with MODE Z if the server supports it
+#ifndef FTP_USE_MODE_Z
+#define FTP_USE_MODE_Z false
+#endif
+
+// window of the MODE Z compression (9 - 14): it needs about 4 * 2^bits bytes
+#ifndef FTP_DEFLATE_WINDOW_BITS
+#define FTP_DEFLATE_WINDOW_BITS 12
+#endif
+
+#ifndef FTP_DEFLATE_HASH_BITS
+#define FTP_DEFLATE_HASH_BITS 10
+#endif
+
+// max number of candidates which are compared to find a match
+#ifndef FTP_DEFLATE_MAX_CHAIN
+#define FTP_DEFLATE_MAX_CHAIN 8
+#endif
+
+// window of the MODE Z decompression: servers usually use 15 (32 KB)
+#ifndef FTP_INFLATE_WINDOW_BITS
+#define FTP_INFLATE_WINDOW_BITS 15
+#endif
+
+// input and output buffer of the MODE Z (de)compression (min 512)
+#ifndef FTP_MODEZ_BUFFER_SIZE
+#define FTP_MODEZ_BUFFER_SIZE 512
+#endif
+
+// collect the FTPStatistics (otherwise the counters are compiled out)
+#ifndef FTP_STATISTICS
+#define FTP_STATISTICS false
+#endif
+
+// max bytes in flight on a loopback connection (like the TCP window)
+#ifndef FTP_LOOPBACK_WINDOW
+#define FTP_LOOPBACK_WINDOW 16384
+#endif
+
+// max number of delayed replies per loopback connection
+#ifndef FTP_LOOPBACK_MAX_MARKS
+#define FTP_LOOPBACK_MAX_MARKS 16
+#endif
+
+#ifndef FTP_LOOPBACK_MAX_SERVERS
+#define FTP_LOOPBACK_MAX_SERVERS 4
+#endif
+
+#ifndef FTP_LOOPBACK_MAX_SESSIONS
+#define FTP_LOOPBACK_MAX_SESSIONS 16
+#endif
+
 namespace ftp_client {
 
 /// @brief File Mode
-enum FileMode { READ_MODE, WRITE_MODE, WRITE_APPEND_MODE };
+enum FileMode { READ_MODE, WRITE_MODE, WRITE_APPEND_MODE, WRITE_RESUME_MODE };
 enum CurrentOperation { READ_OP, WRITE_OP, LS_OP, NOP, IS_EOF };
-enum LogLevel { LOG_DEBUG, LOG_INFO, LOG_WARN, LOG_ERROR };
-enum ObjectType { TypeFile, TypeDirectory, TypeUndefined };
+enum LogLevel { LOG_DEBUG, LOG_INFO, LOG_WARN, LOG_ERROR, LOG_NONE };
+/// @brief Type of a file system object: TypeCurrentDir and TypeParentDir are
+/// the cdir and pdir entries of a MLSD listing
+enum ObjectType {
+  TypeFile,
+  TypeDirectory,
+  TypeUndefined,
+  TypeCurrentDir,
+  TypeParentDir
+};
+/// @brief Command which is used to list a directory
+enum ListMode { LIST_NLST, LIST_MLSD };
+/// @brief Features reported by the server with FEAT
+enum FTPFeature {
+  FEAT_MLST = 1,
+  FEAT_SIZE = 2,
+  FEAT_MDTM = 4,
+  FEAT_REST = 8,
+  FEAT_EPSV = 16,
+  FEAT_MODEZ = 32,
+  FEAT_HASH = 64,
+  FEAT_XCRC = 128,
+  FEAT_XMD5 = 256,
+  FEAT_XSHA1 = 512
+};
+
+/**
+ * @brief FTPFileInfo
+ * Meta information of a remote file
+ */
+struct FTPFileInfo {
+  const char *name = nullptr;
+  uint64_t size = 0;
+  ObjectType type = TypeUndefined;
+  /// modification time as YYYYMMDDHHMMSS (empty if not available)
+  char modify[15] = {0};
+  /// perm fact of MLSD (empty if not available)
+  char perm[12] = {0};
+};
+
+/// Receives the data of a download: the data is only valid during the call.
+/// Return false to stop the download.
+typedef bool (*FTPDataCallback)(const uint8_t *data, size_t len, void *ref);
+
+/**
+ * @brief FTPConnectPolicy
+ * Defines how often we try to open the command and data connections and how
+ * long we wait: the delay between the attempts grows exponentially with a
+ * random variation, so that many clients do not retry at the same time.
+ */
+struct FTPConnectPolicy {
+  /// max number of connect attempts
+  int max_attempts = FTP_CONNECT_ATTEMPTS;
+  /// delay before the 2nd attempt: doubled for each further attempt
+  unsigned long backoff_ms = FTP_CONNECT_BACKOFF_MS;
+  /// upper limit of the delay between two attempts
+  unsigned long max_backoff_ms = FTP_CONNECT_MAX_BACKOFF_MS;
+  /// random variation of the delay in percent
+  int jitter_percent = FTP_CONNECT_JITTER_PERCENT;
+  /// timeout of a connect which is set with setTimeout() on the Client (0 =
+  /// default of the Client)
+  unsigned long connect_timeout_ms = FTP_CONNECT_TIMEOUT_MS;
+  /// max time to wait for the reply of a command
+  unsigned long reply_timeout_ms = FTP_REPLY_TIMEOUT_MS;
+  /// max time from acquiring the session until the data transfer starts or
+  /// the command has been completed, including all retries (0 = no limit)
+  unsigned long deadline_ms = FTP_OPERATION_DEADLINE_MS;
+};
 
 /**
  * @brief CStringFunctions
@@ -49,7 +304,7 @@ class CStringFunctions {
     int occur = 0;
     // Loop to find the Nth
     // occurence of the character
-    for (unsigned int i = 0; i < strlen(str); i++) {
+    for (int i = 0; str[i] != '\0'; i++) {
       if (str[i] == ch) {
         occur += 1;
       }
@@ -78,6 +333,31 @@ class CStringFunctions {
     memset(str + len, 0, maxLen - len);
     return len;
   }
+
+  /// Converts the decimal number to a 64 bit value
+  static uint64_t toUInt64(const char *str) {
+    uint64_t result = 0;
+    while (*str == ' ') str++;
+    while (*str >= '0' && *str <= '9') {
+      result = result * 10 + (*str - '0');
+      str++;
+    }
+    return result;
+  }
+
+  /// Converts the 64 bit value to a decimal string: the buffer needs to
+  /// provide at least 21 characters
+  static char *toStr(uint64_t value, char *str) {
+    char tmp[21];
+    int len = 0;
+    do {
+      tmp[len++] = '0' + (value % 10);
+      value /= 10;
+    } while (value > 0);
+    for (int j = 0; j < len; j++) str[j] = tmp[len - j - 1];
+    str[len] = '\0';
+    return str;
+  }
 };
 
 }
@@ -0,0 +1,791 @@
+#pragma once
+
+#include "Arduino.h"
+#include "FTPCommon.h"
+#include "FTPLogger.h"
+
+namespace ftp_client {
+
+/**
+ * @brief FTPAdler32
+ * Checksum of the zlib format (RFC 1950)
+ */
+class FTPAdler32 {
+ public:
+  void reset() {
+    a = 1;
+    b = 0;
+  }
+
+  void update(const uint8_t *data, size_t len) {
+    while (len > 0) {
+      // max number of bytes before the sums need to be reduced
+      size_t n = len < 5552 ? len : 5552;
+      len -= n;
+      while (n-- > 0) {
+        a += *data++;
+        b += a;
+      }
+      a %= 65521;
+      b %= 65521;
+    }
+  }
+
+  uint32_t value() { return (b << 16) | a; }
+
+ protected:
+  uint32_t a = 1;
+  uint32_t b = 0;
+};
+
+/**
+ * @brief FTPDeflateTables
+ * Base values and extra bits of the length and distance codes (RFC 1951)
+ */
+struct FTPDeflateTables {
+  static const uint16_t *lengthBase() {
+    static const uint16_t result[29] = {3,  4,  5,  6,   7,   8,   9,   10,
+                                        11, 13, 15, 17,  19,  23,  27,  31,
+                                        35, 43, 51, 59,  67,  83,  99,  115,
+                                        131, 163, 195, 227, 258};
+    return result;
+  }
+  static const uint8_t *lengthExtra() {
+    static const uint8_t result[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1,
+                                       1, 1, 2, 2, 2, 2, 3, 3, 3, 3,
+                                       4, 4, 4, 4, 5, 5, 5, 5, 0};
+    return result;
+  }
+  static const uint16_t *distBase() {
+    static const uint16_t result[30] = {
+        1,    2,    3,    4,    5,    7,     9,     13,    17,    25,
+        33,   49,   65,   97,   129,  193,   257,   385,   513,   769,
+        1025, 1537, 2049, 3073, 4097, 6145,  8193,  12289, 16385, 24577};
+    return result;
+  }
+  static const uint8_t *distExtra() {
+    static const uint8_t result[30] = {0, 0, 0, 0, 1, 1, 2,  2,  3,  3,
+                                       4, 4, 5, 5, 6, 6, 7,  7,  8,  8,
+                                       9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+    return result;
+  }
+};
+
+/**
+ * @brief FTPDeflate
+ * Streaming compressor which creates the zlib format (RFC 1950, 1951) that is
+ * used by MODE Z. In order to keep the memory small we use a window of
+ * 2^FTP_DEFLATE_WINDOW_BITS bytes, a hash chain which is limited to
+ * FTP_DEFLATE_MAX_CHAIN entries and the fixed Huffman codes: this needs about
+ * 4 * 2^FTP_DEFLATE_WINDOW_BITS bytes. The data is split into blocks of the
+ * window size: if the fixed codes of a block needed more space than the
+ * uncompressed data, the next block is stored, so that incompressible data
+ * does not grow by more than a few bytes per block.
+ * @author Phil Schatzmann
+ */
+class FTPDeflate {
+ public:
+  ~FTPDeflate() { release(); }
+
+  /// Starts a new stream which is written to the output
+  bool begin(Print &out) {
+    if (window == nullptr) {
+      window = new uint8_t[2 * window_size];
+      head = new uint16_t[hash_size];
+      prev = new uint16_t[window_size];
+    }
+    p_out = &out;
+    memset(head, 0, hash_size * sizeof(uint16_t));
+    strstart = 0;
+    lookahead = 0;
+    bit_buffer = 0;
+    bit_count = 0;
+    out_len = 0;
+    total_in = 0;
+    total_out = 0;
+    is_ok = true;
+    is_block = false;
+    use_stored = false;
+    adler.reset();
+    // zlib header: deflate with the window size and the fastest level
+    uint8_t cmf = ((FTP_DEFLATE_WINDOW_BITS - 8) << 4) | 8;
+    putByte(cmf);
+    putByte((31 - (cmf * 256) % 31) % 31);
+    return true;
+  }
+
+  /// Compresses the data: returns len or 0 if the output failed
+  size_t write(const uint8_t *data, size_t len) {
+    if (p_out == nullptr) return 0;
+    size_t done = 0;
+    while (done < len) {
+      if (strstart + lookahead == 2 * window_size) {
+        // the data of a stored block must still be in the window
+        endBlock();
+        slide();
+      }
+      size_t n = 2 * window_size - strstart - lookahead;
+      if (n > len - done) n = len - done;
+      memcpy(window + strstart + lookahead, data + done, n);
+      adler.update(data + done, n);
+      lookahead += n;
+      done += n;
+      compress(false);
+    }
+    total_in += len;
+    return is_ok ? len : 0;
+  }
+
+  /// Writes the completed output bytes
+  bool flush() {
+    flushOutput();
+    return is_ok;
+  }
+
+  /// Compresses the remaining data and writes the end of the stream
+  bool end() {
+    if (p_out == nullptr) return false;
+    compress(true);
+    endBlock();
+    // empty final block
+    putBits(1, 1);
+    putBits(1, 2);
+    putHuffman(0, 7);
+    if (bit_count > 0) putBits(0, 8 - bit_count);
+    uint32_t checksum = adler.value();
+    for (int j = 3; j >= 0; j--) putByte(checksum >> (j * 8));
+    flushOutput();
+    p_out = nullptr;
+    return is_ok;
+  }
+
+  /// Releases the memory
+  void release() {
+    delete[] window;
+    delete[] head;
+    delete[] prev;
+    window = nullptr;
+    head = nullptr;
+    prev = nullptr;
+    p_out = nullptr;
+  }
+
+  /// Number of uncompressed bytes
+  uint64_t totalIn() { return total_in; }
+
+  /// Number of compressed bytes which have been written to the output
+  uint64_t totalOut() { return total_out; }
+
+ protected:
+  static_assert(FTP_DEFLATE_WINDOW_BITS >= 9 && FTP_DEFLATE_WINDOW_BITS <= 14,
+                "FTP_DEFLATE_WINDOW_BITS must be between 9 and 14");
+  static const size_t window_size = 1u << FTP_DEFLATE_WINDOW_BITS;
+  static const size_t hash_size = 1u << FTP_DEFLATE_HASH_BITS;
+  static const int min_match = 3;
+  static const int max_match = 258;
+  static const size_t min_lookahead = max_match + min_match + 1;
+  Print *p_out = nullptr;
+  uint8_t *window = nullptr;
+  // positions + 1 of the last string with the hash (0 = none)
+  uint16_t *head = nullptr;
+  // positions + 1 of the previous string with the same hash
+  uint16_t *prev = nullptr;
+  size_t strstart = 0;
+  size_t lookahead = 0;
+  uint32_t bit_buffer = 0;
+  int bit_count = 0;
+  uint8_t out_buffer[FTP_MODEZ_BUFFER_SIZE];
+  size_t out_len = 0;
+  uint64_t total_in = 0;
+  uint64_t total_out = 0;
+  bool is_ok = true;
+  // current block: start in the window and size with the fixed codes in bits
+  size_t block_start = 0;
+  uint32_t block_bits = 0;
+  bool is_block = false;
+  bool is_stored = false;
+  // type of the next block
+  bool use_stored = false;
+  FTPAdler32 adler;
+
+  /// Multiplicative hash of the next 3 bytes
+  uint32_t hash(size_t pos) {
+    uint32_t value = ((uint32_t)window[pos] << 16) |
+                     ((uint32_t)window[pos + 1] << 8) | window[pos + 2];
+    return (value * 2654435761u) >> (32 - FTP_DEFLATE_HASH_BITS);
+  }
+
+  void insert(size_t pos) {
+    uint32_t h = hash(pos);
+    prev[pos & (window_size - 1)] = head[h];
+    head[h] = pos + 1;
+  }
+
+  /// Moves the upper half of the window down to make room for new data
+  void slide() {
+    memmove(window, window + window_size, window_size);
+    strstart -= window_size;
+    for (size_t j = 0; j < hash_size; j++) {
+      head[j] = head[j] > window_size ? head[j] - window_size : 0;
+    }
+    for (size_t j = 0; j < window_size; j++) {
+      prev[j] = prev[j] > window_size ? prev[j] - window_size : 0;
+    }
+  }
+
+  /// Finds the longest match in the hash chain: returns the length
+  int longestMatch(size_t &matchPos) {
+    int max_len = lookahead < (size_t)max_match ? lookahead : max_match;
+    size_t max_dist = window_size - min_lookahead;
+    size_t limit = strstart > max_dist ? strstart - max_dist : 0;
+    int best_len = 0;
+    uint16_t candidate = head[hash(strstart)];
+    for (int chain = FTP_DEFLATE_MAX_CHAIN; candidate != 0 && chain > 0;
+         chain--) {
+      size_t pos = candidate - 1;
+      if (pos < limit || pos >= strstart) break;
+      const uint8_t *a = window + pos;
+      const uint8_t *b = window + strstart;
+      if (a[best_len] == b[best_len]) {
+        int len = 0;
+        while (len < max_len && a[len] == b[len]) len++;
+        if (len > best_len) {
+          best_len = len;
+          matchPos = pos;
+          if (len == max_len) break;
+        }
+      }
+      candidate = prev[pos & (window_size - 1)];
+    }
+    return best_len;
+  }
+
+  /// Compresses the data in the window: we keep min_lookahead bytes, so that
+  /// we can find the longest match unless we are at the end of the stream
+  void compress(bool finish) {
+    while (lookahead >= min_lookahead || (finish && lookahead > 0)) {
+      if (!is_block) beginBlock();
+      int len = 0;
+      size_t match_pos = 0;
+      if (lookahead >= (size_t)min_match) {
+        len = longestMatch(match_pos);
+        insert(strstart);
+      }
+      if (len >= min_match) {
+        putMatch(len, strstart - match_pos);
+        for (int j = 1; j < len; j++) {
+          if (lookahead - j >= (size_t)min_match) insert(strstart + j);
+        }
+        strstart += len;
+        lookahead -= len;
+      } else {
+        putLiteral(window[strstart]);
+        strstart++;
+        lookahead--;
+      }
+      if (strstart - block_start >= window_size) endBlock();
+    }
+  }
+
+  void beginBlock() {
+    block_start = strstart;
+    block_bits = 0;
+    is_block = true;
+    is_stored = use_stored;
+    // the header of a stored block is written at the end
+    if (!is_stored) {
+      putBits(0, 1);
+      putBits(1, 2);
+    }
+  }
+
+  /// Ends the block and selects the type of the next block by comparing the
+  /// size with the fixed codes with the size of a stored block
+  void endBlock() {
+    if (!is_block) return;
+    is_block = false;
+    size_t len = strstart - block_start;
+    uint32_t stored_bits = 3 + (8 - (bit_count + 3) % 8) % 8 + 32 + 8 * len;
+    uint32_t fixed_bits = 3 + block_bits + 7;
+    use_stored = stored_bits < fixed_bits;
+    if (!is_stored) {
+      putHuffman(0, 7);
+      return;
+    }
+    putBits(0, 1);
+    putBits(0, 2);
+    if (bit_count > 0) putBits(0, 8 - bit_count);
+    putBits(len, 16);
+    putBits(~len & 0xffff, 16);
+    for (size_t j = 0; j < len; j++) putByte(window[block_start + j]);
+  }
+
+  /// The symbols are only written for blocks with fixed codes, but the size
+  /// is always determined
+  void putLiteral(uint8_t c) {
+    block_bits += c < 144 ? 8 : 9;
+    if (is_stored) return;
+    if (c < 144) {
+      putHuffman(0x30 + c, 8);
+    } else {
+      putHuffman(0x190 + c - 144, 9);
+    }
+  }
+
+  void putMatch(int len, size_t dist) {
+    int code = 28;
+    while (FTPDeflateTables::lengthBase()[code] > len) code--;
+    int dist_code = 29;
+    while (FTPDeflateTables::distBase()[dist_code] > dist) dist_code--;
+    block_bits += (code < 23 ? 7 : 8) + FTPDeflateTables::lengthExtra()[code] +
+                  5 + FTPDeflateTables::distExtra()[dist_code];
+    if (is_stored) return;
+    int symbol = 257 + code;
+    if (symbol < 280) {
+      putHuffman(symbol - 256, 7);
+    } else {
+      putHuffman(0xC0 + symbol - 280, 8);
+    }
+    putBits(len - FTPDeflateTables::lengthBase()[code],
+            FTPDeflateTables::lengthExtra()[code]);
+    putHuffman(dist_code, 5);
+    putBits(dist - FTPDeflateTables::distBase()[dist_code],
+            FTPDeflateTables::distExtra()[dist_code]);
+  }
+
+  /// Huffman codes are written starting with the most significant bit
+  void putHuffman(uint32_t code, int len) {
+    uint32_t reversed = 0;
+    for (int j = 0; j < len; j++) {
+      reversed = (reversed << 1) | (code & 1);
+      code >>= 1;
+    }
+    putBits(reversed, len);
+  }
+
+  void putBits(uint32_t value, int len) {
+    bit_buffer |= value << bit_count;
+    bit_count += len;
+    while (bit_count >= 8) {
+      putByte(bit_buffer);
+      bit_buffer >>= 8;
+      bit_count -= 8;
+    }
+  }
+
+  void putByte(uint8_t value) {
+    out_buffer[out_len++] = value;
+    if (out_len == sizeof(out_buffer)) flushOutput();
+  }
+
+  void flushOutput() {
+    if (out_len == 0) return;
+    if (p_out->write(out_buffer, out_len) != out_len) {
+      FTPLogger::writeLog(LOG_ERROR, "FTPDeflate", "write failed");
+      is_ok = false;
+    }
+    total_out += out_len;
+    out_len = 0;
+  }
+};
+
+/**
+ * @brief FTPInflate
+ * Streaming decompressor for the zlib format (RFC 1950, 1951) which is used
+ * by MODE Z. The compressed data is added to the input buffer and the
+ * decompressed data is read without blocking: a symbol is only decoded when
+ * all its bits are available. The window has 2^FTP_INFLATE_WINDOW_BITS
+ * bytes: streams which refer to older data are rejected.
+ * @author Phil Schatzmann
+ */
+class FTPInflate {
+ public:
+  ~FTPInflate() { release(); }
+
+  /// Starts a new stream
+  bool begin() {
+    if (window == nullptr) window = new uint8_t[window_size];
+    state = STATE_HEADER;
+    in_pos = 0;
+    in_len = 0;
+    bit_buffer = 0;
+    bit_count = 0;
+    window_pos = 0;
+    total_out = 0;
+    needs_input = false;
+    adler.reset();
+    return true;
+  }
+
+  /// Releases the memory
+  void release() {
+    delete[] window;
+    window = nullptr;
+  }
+
+  /// Provides the free part of the input buffer: the data needs to be
+  /// confirmed with addInput()
+  uint8_t *inputBuffer(size_t &space) {
+    // keep the unprocessed data at the beginning
+    if (in_pos > 0) {
+      memmove(input, input + in_pos, in_len - in_pos);
+      in_len -= in_pos;
+      in_pos = 0;
+    }
+    space = sizeof(input) - in_len;
+    return input + in_len;
+  }
+
+  /// Confirms the data which was written to the inputBuffer()
+  void addInput(size_t len) {
+    in_len += len;
+    needs_input = false;
+  }
+
+  /// Adds compressed data: returns the number of bytes which were accepted
+  size_t write(const uint8_t *data, size_t len) {
+    size_t space;
+    uint8_t *buffer = inputBuffer(space);
+    if (len > space) len = space;
+    memcpy(buffer, data, len);
+    addInput(len);
+    return len;
+  }
+
+  /// Provides the decompressed data which is available: returns 0 if more
+  /// input is needed or the stream has ended
+  size_t read(uint8_t *out, size_t len) {
+    size_t n = 0;
+    while (n < len && !needs_input && state < STATE_CHECK_DONE) {
+      // the position is restored if not all bits of a step are available
+      size_t save_pos = in_pos;
+      uint32_t save_buffer = bit_buffer;
+      int save_count = bit_count;
+      if (!step(out, len, n)) {
+        if (state == STATE_FAILED) break;
+        in_pos = save_pos;
+        bit_buffer = save_buffer;
+        bit_count = save_count;
+        needs_input = true;
+      }
+    }
+    adler.update(out, n);
+    total_out += n;
+    if (state == STATE_CHECK_DONE) {
+      if (adler.value() != expected_adler) {
+        FTPLogger::writeLog(LOG_ERROR, "FTPInflate", "invalid checksum");
+        state = STATE_FAILED;
+      } else {
+        state = STATE_DONE;
+      }
+    }
+    return n;
+  }
+
+  /// Returns true if more input is needed to continue
+  bool needsInput() { return needs_input && !isDone() && !isError(); }
+
+  /// Returns true if read() might provide data without additional input
+  bool canRead() { return !needs_input && !isDone() && !isError(); }
+
+  /// Returns true if the stream has been decompressed completely
+  bool isDone() { return state == STATE_DONE; }
+
+  /// Returns true if the data is not valid
+  bool isError() { return state == STATE_FAILED; }
+
+  /// Number of decompressed bytes
+  uint64_t totalOut() { return total_out; }
+
+ protected:
+  enum State {
+    STATE_HEADER,
+    STATE_BLOCK,
+    STATE_STORED,
+    STATE_CODES,
+    STATE_MATCH,
+    STATE_CHECK,
+    STATE_CHECK_DONE,
+    STATE_DONE,
+    STATE_FAILED
+  };
+  struct Huffman {
+    uint16_t count[16];
+    uint16_t symbol[288];
+  };
+  static_assert(FTP_MODEZ_BUFFER_SIZE >= 512,
+                "the input buffer needs to hold a dynamic block header");
+  static const size_t window_size = 1u << FTP_INFLATE_WINDOW_BITS;
+  State state = STATE_HEADER;
+  uint8_t input[FTP_MODEZ_BUFFER_SIZE];
+  size_t in_pos = 0;
+  size_t in_len = 0;
+  uint32_t bit_buffer = 0;
+  int bit_count = 0;
+  bool needs_input = false;
+  bool is_last_block = false;
+  uint8_t *window = nullptr;
+  size_t window_pos = 0;
+  uint64_t total_out = 0;
+  size_t stored_len = 0;
+  int match_len = 0;
+  size_t match_dist = 0;
+  uint32_t expected_adler = 0;
+  FTPAdler32 adler;
+  Huffman lencode;
+  Huffman distcode;
+
+  bool need(int n) {
+    while (bit_count < n) {
+      if (in_pos == in_len) return false;
+      bit_buffer |= (uint32_t)input[in_pos++] << bit_count;
+      bit_count += 8;
+    }
+    return true;
+  }
+
+  uint32_t bits(int n) {
+    uint32_t result = bit_buffer & ((1u << n) - 1);
+    bit_buffer >>= n;
+    bit_count -= n;
+    return result;
+  }
+
+  bool fail(const char *msg) {
+    FTPLogger::writeLog(LOG_ERROR, "FTPInflate", msg);
+    state = STATE_FAILED;
+    return false;
+  }
+
+  void output(uint8_t *out, size_t &n, uint8_t value) {
+    window[window_pos++ & (window_size - 1)] = value;
+    out[n++] = value;
+  }
+
+  /// Processes the next element of the stream: returns false if more input
+  /// is needed or the stream has ended
+  bool step(uint8_t *out, size_t len, size_t &n) {
+    switch (state) {
+      case STATE_HEADER: {
+        if (!need(16)) return false;
+        uint32_t cmf = bits(8);
+        uint32_t flg = bits(8);
+        if ((cmf & 15) != 8 || (cmf * 256 + flg) % 31 != 0 || (flg & 0x20)) {
+          return fail("invalid header");
+        }
+        state = STATE_BLOCK;
+        return true;
+      }
+      case STATE_BLOCK:
+        return blockHeader();
+      case STATE_STORED: {
+        // the copied bytes are committed
+        size_t start = n;
+        while (stored_len > 0 && n < len) {
+          if (bit_count == 0 && in_pos == in_len) return n > start;
+          uint8_t value = bit_count > 0 ? bits(8) : input[in_pos++];
+          output(out, n, value);
+          stored_len--;
+        }
+        if (stored_len == 0) endBlock();
+        return true;
+      }
+      case STATE_CODES:
+        return codes(out, n);
+      case STATE_MATCH:
+        while (match_len > 0 && n < len) {
+          output(out, n, window[(window_pos - match_dist) & (window_size - 1)]);
+          match_len--;
+        }
+        if (match_len == 0) state = STATE_CODES;
+        return true;
+      case STATE_CHECK:
+        if (!need(bit_count & 7)) return false;
+        bits(bit_count & 7);
+        expected_adler = 0;
+        for (int j = 0; j < 4; j++) {
+          if (!need(8)) return false;
+          expected_adler = (expected_adler << 8) | bits(8);
+        }
+        state = STATE_CHECK_DONE;
+        return true;
+      default:
+        return false;
+    }
+  }
+
+  void endBlock() { state = is_last_block ? STATE_CHECK : STATE_BLOCK; }
+
+  bool blockHeader() {
+    if (!need(3)) return false;
+    is_last_block = bits(1);
+    switch (bits(2)) {
+      case 0: {
+        // stored block: starts at the next byte
+        bits(bit_count & 7);
+        if (!need(16)) return false;
+        uint32_t len = bits(16);
+        if (!need(16)) return false;
+        uint32_t nlen = bits(16);
+        if (len != (~nlen & 0xffff)) return fail("invalid stored block");
+        stored_len = len;
+        state = STATE_STORED;
+        if (stored_len == 0) endBlock();
+        return true;
+      }
+      case 1:
+        fixedCodes();
+        state = STATE_CODES;
+        return true;
+      case 2:
+        if (!dynamicCodes()) return false;
+        state = STATE_CODES;
+        return true;
+      default:
+        return fail("invalid block type");
+    }
+  }
+
+  /// Decodes a literal or a length/distance pair
+  bool codes(uint8_t *out, size_t &n) {
+    int symbol = decode(lencode);
+    if (symbol < 0) return symbol == -1 ? false : fail("invalid code");
+    if (symbol < 256) {
+      output(out, n, symbol);
+      return true;
+    }
+    if (symbol == 256) {
+      endBlock();
+      return true;
+    }
+    symbol -= 257;
+    if (symbol >= 29) return fail("invalid length");
+    int extra = FTPDeflateTables::lengthExtra()[symbol];
+    if (!need(extra)) return false;
+    int len = FTPDeflateTables::lengthBase()[symbol] + bits(extra);
+    symbol = decode(distcode);
+    if (symbol < 0) return symbol == -1 ? false : fail("invalid code");
+    if (symbol >= 30) return fail("invalid distance");
+    extra = FTPDeflateTables::distExtra()[symbol];
+    if (!need(extra)) return false;
+    size_t dist = FTPDeflateTables::distBase()[symbol] + bits(extra);
+    if (dist > total_out + n || dist > window_size) {
+      return fail("distance too far");
+    }
+    match_len = len;
+    match_dist = dist;
+    state = STATE_MATCH;
+    return true;
+  }
+
+  /// Decodes a symbol: returns -1 if more input is needed and -2 if the
+  /// code is invalid
+  int decode(const Huffman &h) {
+    int code = 0;
+    int first = 0;
+    int index = 0;
+    for (int len = 1; len < 16; len++) {
+      if (!need(1)) return -1;
+      code |= bits(1);
+      int count = h.count[len];
+      if (code - count < first) return h.symbol[index + (code - first)];
+      index += count;
+      first += count;
+      first <<= 1;
+      code <<= 1;
+    }
+    return -2;
+  }
+
+  /// Builds the canonical Huffman code from the code lengths: returns 0 for a
+  /// complete code, > 0 for an incomplete one and < 0 if it is invalid
+  static int build(Huffman &h, const uint8_t *length, int n) {
+    uint16_t offs[16];
+    for (int len = 0; len < 16; len++) h.count[len] = 0;
+    for (int symbol = 0; symbol < n; symbol++) h.count[length[symbol]]++;
+    if (h.count[0] == n) return 0;
+    int left = 1;
+    for (int len = 1; len < 16; len++) {
+      left <<= 1;
+      left -= h.count[len];
+      if (left < 0) return left;
+    }
+    offs[1] = 0;
+    for (int len = 1; len < 15; len++) offs[len + 1] = offs[len] + h.count[len];
+    for (int symbol = 0; symbol < n; symbol++) {
+      if (length[symbol] != 0) h.symbol[offs[length[symbol]]++] = symbol;
+    }
+    return left;
+  }
+
+  /// An incomplete code is only valid if it consists of a single code
+  static bool isValid(const Huffman &h, int result, int n) {
+    return result == 0 || (result > 0 && n - h.count[0] == 1);
+  }
+
+  void fixedCodes() {
+    uint8_t lengths[288];
+    int symbol = 0;
+    for (; symbol < 144; symbol++) lengths[symbol] = 8;
+    for (; symbol < 256; symbol++) lengths[symbol] = 9;
+    for (; symbol < 280; symbol++) lengths[symbol] = 7;
+    for (; symbol < 288; symbol++) lengths[symbol] = 8;
+    build(lencode, lengths, 288);
+    for (symbol = 0; symbol < 30; symbol++) lengths[symbol] = 5;
+    build(distcode, lengths, 30);
+  }
+
+  /// Reads the code lengths of a dynamic block
+  bool dynamicCodes() {
+    static const uint8_t order[19] = {16, 17, 18, 0, 8,  7, 9,  6, 10, 5,
+                                      11, 4,  12, 3, 13, 2, 14, 1, 15};
+    uint8_t lengths[320];
+    if (!need(14)) return false;
+    int nlen = bits(5) + 257;
+    int ndist = bits(5) + 1;
+    int ncode = bits(4) + 4;
+    if (nlen > 286 || ndist > 30) return fail("invalid code counts");
+    int index = 0;
+    for (; index < ncode; index++) {
+      if (!need(3)) return false;
+      lengths[order[index]] = bits(3);
+    }
+    for (; index < 19; index++) lengths[order[index]] = 0;
+    if (build(lencode, lengths, 19) != 0) return fail("invalid code lengths");
+    index = 0;
+    while (index < nlen + ndist) {
+      int symbol = decode(lencode);
+      if (symbol < 0) return symbol == -1 ? false : fail("invalid code");
+      if (symbol < 16) {
+        lengths[index++] = symbol;
+        continue;
+      }
+      uint8_t len = 0;
+      int repeat;
+      if (symbol == 16) {
+        if (index == 0) return fail("invalid repeat");
+        len = lengths[index - 1];
+        if (!need(2)) return false;
+        repeat = 3 + bits(2);
+      } else if (symbol == 17) {
+        if (!need(3)) return false;
+        repeat = 3 + bits(3);
+      } else {
+        if (!need(7)) return false;
+        repeat = 11 + bits(7);
+      }
+      if (index + repeat > nlen + ndist) return fail("invalid repeat");
+      while (repeat-- > 0) lengths[index++] = len;
+    }
+    if (lengths[256] == 0) return fail("missing end of block");
+    if (!isValid(lencode, build(lencode, lengths, nlen), nlen)) {
+      return fail("invalid literal codes");
+    }
+    if (!isValid(distcode, build(distcode, lengths + nlen, ndist), ndist)) {
+      return fail("invalid distance codes");
+    }
+    return true;
+  }
+};
+
+}  // namespace ftp_client
@@ -17,17 +17,46 @@ class FTPFile : public Stream {
  public:
   FTPFile() { is_open = false; }
 
+  /// With releaseOnClose the session is returned to the FTPSessionMgr by
+  /// close() or cancel()
   FTPFile(FTPBasicAPI *api_ptr, const char *name, FileMode mode,
-          bool autoClose = true) {
+          bool autoClose = true, uint64_t offset = 0,
+          bool releaseOnClose = false) {
     FTPLogger::writeLog(LOG_DEBUG, "FTPFile", name);
     auto_close = autoClose;
     if (name != nullptr) file_name = name;
     this->mode = mode;
     this->api_ptr = api_ptr;
+    this->offset = offset;
+    release_on_close = releaseOnClose;
+    // files of a cached listing have no session
+    is_open = api_ptr != nullptr;
   }
 
+  /// Files can be moved but not copied, so that the session is released
+  /// only once
+  FTPFile(FTPFile &&other) { moveFrom(other); }
+
+  FTPFile &operator=(FTPFile &&other) {
+    if (this != &other) {
+      // we would lose the session otherwise
+      if (release_on_close) close();
+      moveFrom(other);
+    }
+    return *this;
+  }
+
+  FTPFile(const FTPFile &) = delete;
+  FTPFile &operator=(const FTPFile &) = delete;
+
+  /// A file which still holds its session aborts the transfer and returns
+  /// the session to the FTPSessionMgr
   ~FTPFile() {
-    if (auto_close) close();
+    if (auto_close) {
+      close();
+    } else if (release_on_close) {
+      cancel();
+    }
   }
 
   size_t write(uint8_t data) {
@@ -37,8 +66,10 @@ class FTPFile : public Stream {
       FTPLogger::writeLog(LOG_ERROR, "FTPFile", "Cannot write in READ_MODE");
       return 0;
     }
-    Stream *result_ptr = api_ptr->write(file_name.c_str(), mode);
-    return result_ptr->write(data);
+    api_ptr->write(file_name.c_str(), mode, offset);
+    size_t result = api_ptr->writeData(&data, 1);
+    updateChecksum(&data, result);
+    return result;
   }
 
   size_t write(const uint8_t *data, size_t len) override {
@@ -48,8 +79,10 @@ class FTPFile : public Stream {
       FTPLogger::writeLog(LOG_ERROR, "FTPFile", "Cannot write in READ_MODE");
       return 0;
     }
-    Stream *result_ptr = api_ptr->write(file_name.c_str(), mode);
-    return result_ptr->write(data, len);
+    api_ptr->write(file_name.c_str(), mode, offset);
+    size_t result = api_ptr->writeData(data, len);
+    updateChecksum(data, result);
+    return result;
   }
 
   size_t write(const char *data, int len)  {
@@ -59,8 +92,13 @@ class FTPFile : public Stream {
   int read() {
     if (!is_open) return -1;
     FTPLogger::writeLog(LOG_DEBUG, "FTPFile", "read");
-    Stream *result_ptr = api_ptr->read(file_name.c_str());
-    return result_ptr->read();
+    api_ptr->read(file_name.c_str(), offset);
+    int c = api_ptr->readData();
+    if (c >= 0) {
+      uint8_t value = c;
+      updateChecksum(&value, 1);
+    }
+    return c;
   }
 
   size_t readBytes(char *buf, size_t nbyte) {
@@ -70,38 +108,67 @@ class FTPFile : public Stream {
   size_t readBytes(uint8_t *buf, size_t nbyte) {
     if (!is_open) return 0;
     FTPLogger::writeLog(LOG_DEBUG, "FTPFile", "readBytes");
-    memset(buf, 0, nbyte);
-    Stream *result_ptr = api_ptr->read(file_name.c_str());
-    return result_ptr->readBytes((char *)buf, nbyte);
+    api_ptr->read(file_name.c_str(), offset);
+    return readTimed(buf, nbyte, -1);
   }
 
+  /// Provides the data to the callback until the end of the file: the data
+  /// points into the read buffer and is only valid during the call. Returns
+  /// false if the callback stopped the download or the data did not arrive.
+  bool read(FTPDataCallback callback, void *ref = nullptr) {
+    if (!is_open || mode != READ_MODE) return false;
+    FTPLogger::writeLog(LOG_DEBUG, "FTPFile", "read callback");
+    api_ptr->read(file_name.c_str(), offset);
+    if (api_ptr->checksum() == nullptr) {
+      return api_ptr->receiveData(callback, ref);
+    }
+    // the checksum is updated before the data is provided
+    Receiver receiver{this, callback, ref};
+    return api_ptr->receiveData(receiveChecksum, &receiver);
+  }
+
+  /// Reads a line (without the EOL character): the result is null terminated
   size_t readln(char *buf, size_t nbyte) {
-    if (!is_open) return 0;
+    if (!is_open || nbyte == 0) return 0;
     FTPLogger::writeLog(LOG_DEBUG, "FTPFile", "readln");
-    memset(buf, 0, nbyte);
-    Stream *result_ptr = api_ptr->read(file_name.c_str());
-    return result_ptr->readBytesUntil(eol[0], (char *)buf, nbyte);
+    api_ptr->read(file_name.c_str(), offset);
+    size_t len = readTimed((uint8_t *)buf, nbyte - 1, eol[0]);
+    buf[len] = '\0';
+    return len;
   }
 
   int peek() {
     if (!is_open) return -1;
     FTPLogger::writeLog(LOG_DEBUG, "FTPFile", "peek");
-    Stream *result_ptr = api_ptr->read(file_name.c_str());
-    return result_ptr->peek();
+    api_ptr->read(file_name.c_str(), offset);
+    return api_ptr->peekData();
   }
 
   int available() {
-    if (api_ptr->currentOperation() == IS_EOF) return 0;
     if (!is_open) return 0;
+    if (api_ptr->currentOperation() == IS_EOF) return 0;
 
-    char msg[80];
-    Stream *result_ptr = api_ptr->read(file_name.c_str());
-    int len = result_ptr->available();
-    sprintf(msg, "available: %d", len);
-    FTPLogger::writeLog(LOG_DEBUG, "FTPFile", msg);
+    api_ptr->read(file_name.c_str(), offset);
+    int len = api_ptr->availableData();
+    FTPLogger::writeLogf(LOG_DEBUG, "FTPFile", "available: %d", len);
     return len;
   }
 
+  /// Returns true if the transfer made no progress since the indicated time
+  /// for longer than the reply timeout of the connect policy
+  bool isTimeout(unsigned long lastProgress) {
+    if (!is_open) return true;
+    return api_ptr->isReplyOverdue(lastProgress);
+  }
+
+  /// Returns true if all data of the download has been read
+  bool isEOF() {
+    if (!is_open) return true;
+    if (api_ptr->currentOperation() != READ_OP) return false;
+    return !api_ptr->dataClient()->connected() &&
+           api_ptr->availableData() == 0;
+  }
+
   void flush() {
     if (!is_open) return;
     if (api_ptr->currentOperation() == WRITE_OP) {
@@ -112,43 +179,141 @@ class FTPFile : public Stream {
 
   void reopen() { is_open = true; }
 
-  void close() {
+  /// Defines the size of the read-ahead buffer which is filled with big reads
+  /// from the data connection
+  void setReadBufferSize(size_t size) {
+    if (api_ptr != nullptr) api_ptr->setReadBufferSize(size);
+  }
+
+  /// Defines the size of the buffer which collects small writes: the data
+  /// is sent when the buffer is full and on flush() or close()
+  void setWriteBufferSize(size_t size) {
+    if (api_ptr != nullptr) api_ptr->setWriteBufferSize(size);
+  }
+
+  /// Continues the download at the indicated position (using REST): an
+  /// active transfer is aborted and a new data connection is opened
+  bool seek(uint64_t pos) {
+    if (!is_open || mode != READ_MODE) return false;
+    if (FTPLogger::isLogging(LOG_DEBUG)) {
+      char msg[21];
+      FTPLogger::writeLog(LOG_DEBUG, "FTPFile::seek",
+                          CStringFunctions::toStr(pos, msg));
+    }
+    if (api_ptr->currentOperation() == READ_OP) {
+      api_ptr->abort();
+      if (!api_ptr->passv()) return false;
+    }
+    offset = pos;
+    return true;
+  }
+
+  /// Calculates the checksum of the transferred data which is compared with
+  /// the hash of the server on close(): call it before the first read or
+  /// write. Returns false if the server can not provide the hash.
+  bool setVerify(FTPHashAlgorithm algorithm) {
+    if (!is_open) return false;
+    verify_result = VERIFY_NONE;
+    api_ptr->beginChecksum(algorithm);
+    return algorithm != HASH_NONE && api_ptr->hasHash(algorithm);
+  }
+
+  /// Result of the verification by close()
+  FTPVerifyResult verifyResult() const { return verify_result; }
+
+  /// Provides the checksum of the data which has been transferred so far:
+  /// only available while the file is open
+  FTPChecksum *checksum() { return is_open ? api_ptr->checksum() : nullptr; }
+
+  /// Provides the start position of the transfer: for WRITE_RESUME_MODE this
+  /// is the size of the remote file, so the local data needs to be provided
+  /// from this position
+  uint64_t resumeOffset() const { return offset; }
+
+  /// Completes the transfer: returns false if the server reported an error
+  bool close() {
+    bool result = true;
     if (is_open) {
       FTPLogger::writeLog(LOG_DEBUG, "FTPFile", "close");
+      // the checksum is only comparable if it covers the whole file
+      bool is_complete = false;
+      bool is_transfer = false;
       if (api_ptr->currentOperation() == WRITE_OP) {
         // end of write operation !!!
+        is_transfer = true;
+        bool ok_write = api_ptr->finishWrite();
         api_ptr->data_ptr->stop();
         const char *ok[] = {"226", "250", nullptr};
-        api_ptr->checkResult(ok, "close-write", true);
+        // there is no final reply if the server refused the upload
+        result = api_ptr->isTransferStarted() &&
+                 api_ptr->checkResult(ok, "close-write", true) && ok_write;
+        is_complete = result && offset == 0 && mode != WRITE_APPEND_MODE;
+        api_ptr->invalidateMetadata(file_name.c_str());
       } else if (api_ptr->currentOperation() == READ_OP) {
         // end of read operation !!!
+        is_transfer = true;
+        bool is_eof = !api_ptr->dataClient()->connected() &&
+                      api_ptr->availableData() == 0;
+        // a corrupt or truncated MODE Z stream would look like the end
+        bool is_valid = api_ptr->isInflateOk(is_eof);
         api_ptr->data_ptr->stop();
         const char *ok[] = {"226", "250", nullptr};
-        api_ptr->checkResult(ok, "close-read", true);
+        result = api_ptr->isTransferStarted() &&
+                 api_ptr->checkResult(ok, "close-read", true) && is_valid;
+        is_complete = result && is_eof && offset == 0;
       }
       api_ptr->setCurrentOperation(NOP);
+      if (api_ptr->checksum() != nullptr && is_transfer) verify(is_complete);
+      api_ptr->endChecksum();
       is_open = false;
+      if (release_on_close) api_ptr->release();
     }
+    return result;
   }
 
   bool cancel() {
     if (is_open) {
       FTPLogger::writeLog(LOG_INFO, "FTPFile", "cancel");
       bool result = api_ptr->abort();
+      api_ptr->endChecksum();
       is_open = false;
+      if (release_on_close) api_ptr->release();
       return result;
     }
     return true;
   }
 
-  const char *name() const { return file_name.c_str(); }
+  const char *name() const { return file_name.c_str() + name_offset; }
+
+  /// Defines the directory of a relative name (e.g. of a listing): the server
+  /// and the metadata cache are accessed with the full path, while name()
+  /// stays unchanged
+  void setDirectory(const char *dir) {
+    if (dir == nullptr || dir[0] == '\0' || name_offset > 0) return;
+    if (file_name.length() == 0 || file_name.c_str()[0] == '/') return;
+    String path = dir;
+    if (dir[strlen(dir) - 1] != '/') path += "/";
+    name_offset = path.length();
+    path += file_name;
+    file_name = path;
+  }
+
+  /// Defines the type and size which are known e.g. from a MLSD listing, so
+  /// that size() and isDirectory() do not need to query the server
+  void setFileInfo(const FTPFileInfo &info) {
+    object_type = info.type;
+    file_size = info.size;
+  }
 
-  size_t size() const {
+  uint64_t size() const {
+    if (object_type != TypeUndefined) return file_size;
     if (!is_open) return 0;
-    char msg[80];
-    size_t size = api_ptr->size(file_name.c_str());
-    sprintf(msg, "size: %ld", size);
-    FTPLogger::writeLog(LOG_DEBUG, "FTPFile", msg);
+    uint64_t size = api_ptr->size(file_name.c_str());
+    if (FTPLogger::isLogging(LOG_DEBUG)) {
+      char msg[21];
+      FTPLogger::writeLog(LOG_DEBUG, "FTPFile::size",
+                          CStringFunctions::toStr(size, msg));
+    }
     return size;
   }
 
@@ -158,8 +323,9 @@ class FTPFile : public Stream {
   }
 
   bool isDirectory() const {
-    if (!is_open) return false;
     FTPLogger::writeLog(LOG_DEBUG, "FTPFile", "isDirectory");
+    if (object_type != TypeUndefined) return object_type == TypeDirectory;
+    if (!is_open) return false;
     return api_ptr->objectType(file_name.c_str()) == TypeDirectory;
   }
 
@@ -167,12 +333,111 @@ class FTPFile : public Stream {
 
  protected:
   String file_name;
+  // start of the name if the file_name contains the directory
+  size_t name_offset = 0;
   const char *eol = "\n";
   FileMode mode;
-  FTPBasicAPI *api_ptr;
+  FTPBasicAPI *api_ptr = nullptr;
   ObjectType object_type = TypeUndefined;
+  uint64_t file_size = 0;
+  uint64_t offset = 0;
   bool is_open = true;
   bool auto_close = false;
+  bool release_on_close = false;
+  FTPVerifyResult verify_result = VERIFY_NONE;
+
+  /// Takes over the state of the other file which is left closed
+  void moveFrom(FTPFile &other) {
+    file_name = other.file_name;
+    name_offset = other.name_offset;
+    eol = other.eol;
+    mode = other.mode;
+    api_ptr = other.api_ptr;
+    object_type = other.object_type;
+    file_size = other.file_size;
+    offset = other.offset;
+    is_open = other.is_open;
+    auto_close = other.auto_close;
+    release_on_close = other.release_on_close;
+    verify_result = other.verify_result;
+    setTimeout(other.getTimeout());
+    other.is_open = false;
+    other.auto_close = false;
+    other.release_on_close = false;
+  }
+
+  struct Receiver {
+    FTPFile *p_file;
+    FTPDataCallback callback;
+    void *ref;
+  };
+
+  static bool receiveChecksum(const uint8_t *data, size_t len, void *ref) {
+    Receiver &receiver = *(Receiver *)ref;
+    receiver.p_file->updateChecksum(data, len);
+    return receiver.callback(data, len, receiver.ref);
+  }
+
+  void updateChecksum(const uint8_t *data, size_t len) {
+    FTPChecksum *p_checksum = api_ptr->checksum();
+    if (p_checksum != nullptr) p_checksum->update(data, len);
+  }
+
+  /// Compares the local checksum with the hash of the server
+  void verify(bool isComplete) {
+    FTPChecksum &checksum = *api_ptr->checksum();
+    char hex[2 * FTP_HASH_MAX_SIZE + 1];
+    if (!isComplete) {
+      verify_result = VERIFY_INCOMPLETE;
+    } else if (!api_ptr->remoteHash(file_name.c_str(),
+                                    checksum.hashAlgorithm(), hex)) {
+      verify_result = VERIFY_UNSUPPORTED;
+    } else {
+      verify_result = checksum.equals(hex) ? VERIFY_OK : VERIFY_MISMATCH;
+    }
+    if (verify_result == VERIFY_MISMATCH) {
+      FTPLogger::writeLog(LOG_ERROR, "FTPFile", "checksum mismatch");
+    } else if (verify_result != VERIFY_OK) {
+      FTPLogger::writeLog(LOG_WARN, "FTPFile", "checksum not verified");
+    }
+  }
+
+  /// Reads up to len bytes or until the terminator (if >= 0) has been found:
+  /// we wait for data up to the Stream timeout or until the data connection
+  /// has been closed
+  size_t readTimed(uint8_t *buf, size_t len, int terminator) {
+    size_t result = 0;
+    unsigned long start = millis();
+    while (result < len) {
+      size_t n = 0;
+      if (terminator < 0) {
+        n = api_ptr->readData(buf + result, len - result);
+      } else {
+        int c = api_ptr->readData();
+        if (c == terminator) {
+          // the terminator is part of the file
+          uint8_t value = c;
+          updateChecksum(&value, 1);
+          break;
+        }
+        if (c >= 0) {
+          buf[result] = c;
+          n = 1;
+        }
+      }
+      if (n > 0) {
+        updateChecksum(buf + result, n);
+        result += n;
+        start = millis();
+      } else if (!api_ptr->dataClient()->connected() ||
+                 millis() - start >= _timeout) {
+        break;
+      } else {
+        delay(FTP_POLL_DELAY_MS);
+      }
+    }
+    return result;
+  }
 };
 
 }  // namespace ftp_client
\ No newline at end of file
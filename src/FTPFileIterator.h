@@ -3,6 +3,7 @@
 #include "Arduino.h"
 #include "FTPBasicAPI.h"  // Include for FTPBasicAPI class
 #include "FTPFile.h"      // Include for FTPFile class
+#include "FTPListingCache.h"
 #include "Stream.h"
 
 namespace ftp_client {
@@ -13,27 +14,74 @@ namespace ftp_client {
  * directories. We open a separate session for the ls operation so that we do
  * not need to keep the result in memory and we don't lose the data when we mix
  * it with read and write operations.
+ * The lines are read into a fixed buffer (FTP_MAX_LINE_SIZE or a buffer which
+ * is provided with setBuffer()), so fileName() and info() do not need any
+ * heap allocation.
+ * Listings can be collected in a FTPListingCache and replayed from there
+ * without any network access: the files of a replayed listing only provide
+ * the name and the information of the listing.
+ * The session is returned to the FTPSessionMgr at the end of the listing or
+ * when the iterator is destroyed: a copy takes it over, so that the copy
+ * which is used by a range based for loop releases it.
  * @author Phil Schatzmann
  */
 class FTPFileIterator {
  public:
   FTPFileIterator() = default;
 
-  FTPFileIterator(FTPBasicAPI *api, const char *dir, FileMode mode) {
+  FTPFileIterator(FTPBasicAPI *api, const char *dir, FileMode mode,
+                  ListMode listMode = LIST_NLST) {
     FTPLogger::writeLog(LOG_DEBUG, "FTPFileIterator()");
     this->directory_name = dir;
     this->api_ptr = api;
     this->file_mode = mode;
+    this->list_mode = listMode;
+    this->is_owner = api != nullptr;
+  }
+
+  /// Replays a cached listing
+  FTPFileIterator(FTPListingRef listing, const char *dir, FileMode mode) {
+    FTPLogger::writeLog(LOG_DEBUG, "FTPFileIterator()", "cached");
+    this->directory_name = dir;
+    this->cached = listing;
+    this->file_mode = mode;
+    this->list_mode = listing.listMode();
+  }
+
+  /// The copy takes over the session
+  FTPFileIterator(const FTPFileIterator &other) { copyFrom(other); }
+
+  FTPFileIterator &operator=(const FTPFileIterator &other) {
+    if (this != &other) {
+      releaseSession();
+      copyFrom(other);
+    }
+    return *this;
+  }
+
+  /// An unfinished listing is aborted
+  ~FTPFileIterator() { releaseSession(); }
+
+  /// Collects the lines of the listing in the cache
+  void setCache(FTPListingCache *cache, ListMode keyMode) {
+    p_cache = cache;
+    cache_key_mode = keyMode;
   }
 
   FTPFileIterator &begin() {
     FTPLogger::writeLog(LOG_DEBUG, "FTPFileIterator", "begin");
-    if (api_ptr != nullptr && directory_name != nullptr) {
-      stream_ptr = api_ptr->ls(directory_name);
+    if (cached) {
+      readLine();
+    } else if (api_ptr != nullptr && directory_name != nullptr) {
+      stream_ptr = api_ptr->ls(directory_name, list_mode);
+      if (p_cache != nullptr) {
+        capture_id =
+            p_cache->beginCapture(directory_name, cache_key_mode, list_mode);
+      }
       readLine();
     } else {
       FTPLogger::writeLog(LOG_ERROR, "FTPFileIterator", "api_ptr is null");
-      buffer = "";
+      clear();
     }
     return *this;
   }
@@ -41,10 +89,18 @@ class FTPFileIterator {
   FTPFileIterator &end() {
     FTPLogger::writeLog(LOG_DEBUG, "FTPFileIterator", "end");
     static FTPFileIterator end;
-    end.buffer = "";
+    end.clear();
     return end;
   }
 
+  /// Defines the buffer which is used to read the lines instead of the
+  /// internal buffer of FTP_MAX_LINE_SIZE characters
+  void setBuffer(char *buffer, int size) {
+    p_buffer = buffer;
+    buffer_size = size;
+    clear();
+  }
+
   FTPFileIterator &operator++() {
     FTPLogger::writeLog(LOG_DEBUG, "FTPFileIterator", "++");
     readLine();
@@ -60,35 +116,53 @@ class FTPFileIterator {
   FTPFile operator*() {
     FTPLogger::writeLog(LOG_DEBUG, "FTPFileIterator", "*");
     // return file that does not autoclose
-    return FTPFile(api_ptr, buffer.c_str(), file_mode, false);
+    FTPFile file(api_ptr, fileName(), file_mode, false);
+    file.setDirectory(directory_name);
+    if (list_mode == LIST_MLSD) file.setFileInfo(entry);
+    return file;
   }
 
-  bool operator!=(const FTPFileIterator &comp) { return buffer != comp.buffer; }
+  /// Provides the parsed entry: with LIST_MLSD this includes the type, size,
+  /// modification time and permissions, with LIST_NLST only the name
+  const FTPFileInfo &info() {
+    entry.name = fileName();
+    return entry;
+  }
 
-  bool operator==(const FTPFileIterator &comp) { return buffer == comp.buffer; }
+  bool operator!=(const FTPFileIterator &comp) { return compare(comp) != 0; }
 
-  bool operator>(const FTPFileIterator &comp) { return buffer > comp.buffer; }
+  bool operator==(const FTPFileIterator &comp) { return compare(comp) == 0; }
 
-  bool operator<(const FTPFileIterator &comp) { return buffer < comp.buffer; }
+  bool operator>(const FTPFileIterator &comp) { return compare(comp) > 0; }
 
-  bool operator>=(const FTPFileIterator &comp) { return buffer >= comp.buffer; }
+  bool operator<(const FTPFileIterator &comp) { return compare(comp) < 0; }
 
-  bool operator<=(const FTPFileIterator &comp) { return buffer <= comp.buffer; }
+  bool operator>=(const FTPFileIterator &comp) { return compare(comp) >= 0; }
 
-  const char *fileName() { return buffer.c_str(); }
+  bool operator<=(const FTPFileIterator &comp) { return compare(comp) <= 0; }
+
+  /// Provides the name of the current entry
+  const char *fileName() const { return buffer() + name_offset; }
 
  protected:
   void readLine() {
     FTPLogger::writeLog(LOG_DEBUG, "FTPFileIterator", "readLine");
-    buffer = "";
-    if (stream_ptr != nullptr) {
-      buffer = stream_ptr->readStringUntil('\n');
-      // For Windows compatibility, remove trailing \r
-      if (buffer.endsWith("\r")) buffer.remove(buffer.length() - 1);
-      FTPLogger::writeLog(LOG_DEBUG, "line", buffer.c_str());
+    clear();
+    if (cached) {
+      do {
+        if (!cached.readLine(buffer(), buffer_size)) buffer()[0] = '\0';
+      } while (!parseLine());
+    } else if (stream_ptr != nullptr) {
+      do {
+        readLineBuffer();
+        FTPLogger::writeLog(LOG_DEBUG, "line", buffer());
+        if (p_cache != nullptr && buffer()[0] != 0) {
+          p_cache->append(capture_id, buffer());
+        }
+      } while (!parseLine());
 
       // End of ls !!!
-      if (api_ptr->currentOperation() == LS_OP && buffer[0] == 0) {
+      if (api_ptr->currentOperation() == LS_OP && buffer()[0] == 0) {
         // Close data connection
         api_ptr->closeData();
         // Reset operation status
@@ -96,18 +170,152 @@ class FTPFileIterator {
 
         // Get final status
         const char *ok[] = {"226", "250", nullptr};
-        api_ptr->checkResult(ok, "ls-end", true);
+        bool is_ok = api_ptr->checkResult(ok, "ls-end", true);
+        if (p_cache != nullptr) {
+          if (is_ok) {
+            p_cache->endCapture(capture_id);
+          } else {
+            p_cache->cancelCapture();
+          }
+        }
+        // Return the session to the FTPSessionMgr
+        if (is_owner) {
+          is_owner = false;
+          api_ptr->release();
+        }
       }
     } else {
       FTPLogger::writeLog(LOG_ERROR, "FTPFileIterator", "stream_ptr is null");
     }
   }
 
+  /// Reads the next line into the buffer: lines which are too long are
+  /// truncated
+  void readLineBuffer() {
+    char *line = buffer();
+    // at the end of the listing we do not wait for the stream timeout
+    if (!waitData()) {
+      line[0] = '\0';
+      return;
+    }
+    int len = 0;
+    size_t consumed = 0;
+    char c;
+    while (stream_ptr->readBytes(&c, 1) == 1) {
+      consumed++;
+      if (c == '\n') break;
+      // skip the rest of a line which is too long
+      if (len < buffer_size - 1) line[len++] = c;
+    }
+    // the '\n' is missing in the last line if it is truncated
+    api_ptr->countReceived(consumed);
+    // For Windows compatibility, remove trailing \r
+    if (len > 0 && line[len - 1] == '\r') len--;
+    line[len] = '\0';
+  }
+
+  /// Waits for data: returns false if the data connection has been closed
+  /// or the timeout has been reached
+  bool waitData() {
+    unsigned long start = millis();
+    while (stream_ptr->available() <= 0) {
+      if (!api_ptr->dataClient()->connected() ||
+          millis() - start >= stream_ptr->getTimeout()) {
+        return false;
+      }
+      delay(FTP_POLL_DELAY_MS);
+    }
+    return true;
+  }
+
+  /// Updates the entry from the buffer: returns false if the line needs to
+  /// be skipped
+  bool parseLine() {
+    const char *line = buffer();
+    entry = FTPFileInfo();
+    name_offset = 0;
+    if (line[0] == 0) return true;
+    if (list_mode == LIST_MLSD) {
+      if (!FTPBasicAPI::parseMLSD(line, entry)) return false;
+      // skip the current and parent directory
+      if (entry.type == TypeCurrentDir || entry.type == TypeParentDir) {
+        return false;
+      }
+      // the name is at the end of the line
+      name_offset = entry.name - line;
+      if (api_ptr != nullptr && api_ptr->metadataCache() != nullptr) {
+        api_ptr->metadataCache()->put(directory_name, entry.name, entry);
+      }
+    }
+    return true;
+  }
+
+  /// Aborts an unfinished listing and returns the session to the
+  /// FTPSessionMgr
+  void releaseSession() {
+    if (!is_owner) return;
+    is_owner = false;
+    if (api_ptr->currentOperation() == LS_OP) {
+      api_ptr->abort();
+      if (p_cache != nullptr) p_cache->cancelCapture();
+    }
+    api_ptr->release();
+  }
+
+  void copyFrom(const FTPFileIterator &other) {
+    api_ptr = other.api_ptr;
+    stream_ptr = other.stream_ptr;
+    cached = other.cached;
+    p_cache = other.p_cache;
+    cache_key_mode = other.cache_key_mode;
+    capture_id = other.capture_id;
+    entry = other.entry;
+    list_mode = other.list_mode;
+    file_mode = other.file_mode;
+    directory_name = other.directory_name;
+    memcpy(line_buffer, other.line_buffer, sizeof(line_buffer));
+    // the name of a parsed entry points into the line buffer
+    if (other.p_buffer == nullptr && entry.name >= other.line_buffer &&
+        entry.name < other.line_buffer + sizeof(line_buffer)) {
+      entry.name = line_buffer + (entry.name - other.line_buffer);
+    }
+    p_buffer = other.p_buffer;
+    buffer_size = other.buffer_size;
+    name_offset = other.name_offset;
+    is_owner = other.is_owner;
+    other.is_owner = false;
+  }
+
+  void clear() {
+    buffer()[0] = '\0';
+    name_offset = 0;
+    entry = FTPFileInfo();
+  }
+
+  char *buffer() const {
+    return p_buffer != nullptr ? p_buffer : (char *)line_buffer;
+  }
+
+  int compare(const FTPFileIterator &comp) const {
+    return strcmp(fileName(), comp.fileName());
+  }
+
   FTPBasicAPI *api_ptr = nullptr;
   Stream *stream_ptr = nullptr;
-  FileMode file_mode;
+  FTPListingRef cached;
+  FTPListingCache *p_cache = nullptr;
+  ListMode cache_key_mode = LIST_NLST;
+  int capture_id = 0;
+  FTPFileInfo entry;
+  ListMode list_mode = LIST_NLST;
+  FileMode file_mode = READ_MODE;
   const char *directory_name = "";
-  String buffer = "";
+  char line_buffer[FTP_MAX_LINE_SIZE] = {0};
+  char *p_buffer = nullptr;
+  int buffer_size = FTP_MAX_LINE_SIZE;
+  int name_offset = 0;
+  // the copies pass on the session
+  mutable bool is_owner = false;
 };
 
 }  // namespace ftp_client
@@ -0,0 +1,329 @@
+#pragma once
+
+#include "Arduino.h"
+#include "FTPCommon.h"
+#include "FTPLogger.h"
+
+namespace ftp_client {
+
+/**
+ * @brief FTPListingEntry
+ * A cached directory listing: the data contains the path followed by the
+ * lines which were received from the server. The entry is deleted when it
+ * has been removed from the cache and it is not referenced any more.
+ */
+struct FTPListingEntry {
+  ~FTPListingEntry() { delete[] data; }
+  char *data = nullptr;
+  size_t size = 0;
+  size_t lines_start = 0;
+  ListMode key_mode = LIST_NLST;
+  ListMode list_mode = LIST_NLST;
+  unsigned long time = 0;
+  int refs = 0;
+  bool in_cache = false;
+  FTPListingEntry *prev = nullptr;
+  FTPListingEntry *next = nullptr;
+
+  const char *path() const { return data; }
+};
+
+/**
+ * @brief FTPListingRef
+ * Reference to a cached listing which is used to replay the lines: the
+ * listing stays valid even if it is invalidated in the cache while we are
+ * iterating.
+ * @author Phil Schatzmann
+ */
+class FTPListingRef {
+ public:
+  FTPListingRef() = default;
+
+  FTPListingRef(FTPListingEntry *entry) {
+    p_entry = entry;
+    if (p_entry != nullptr) p_entry->refs++;
+    pos = entry != nullptr ? entry->lines_start : 0;
+  }
+
+  FTPListingRef(const FTPListingRef &other) {
+    p_entry = other.p_entry;
+    if (p_entry != nullptr) p_entry->refs++;
+    pos = other.pos;
+  }
+
+  FTPListingRef &operator=(const FTPListingRef &other) {
+    if (this != &other) {
+      FTPListingEntry *entry = other.p_entry;
+      if (entry != nullptr) entry->refs++;
+      clear();
+      p_entry = entry;
+      pos = other.pos;
+    }
+    return *this;
+  }
+
+  ~FTPListingRef() { clear(); }
+
+  operator bool() const { return p_entry != nullptr; }
+
+  /// Provides the list mode which was used to request the listing
+  ListMode listMode() const {
+    return p_entry != nullptr ? p_entry->list_mode : LIST_NLST;
+  }
+
+  /// Copies the next line into the buffer (lines which are too long are
+  /// truncated): returns false at the end of the listing
+  bool readLine(char *buffer, int size) {
+    if (p_entry == nullptr || pos >= p_entry->size) return false;
+    const char *data = p_entry->data;
+    int len = 0;
+    while (pos < p_entry->size && data[pos] != '\n') {
+      if (len < size - 1) buffer[len++] = data[pos];
+      pos++;
+    }
+    // skip the '\n'
+    pos++;
+    buffer[len] = '\0';
+    return true;
+  }
+
+  void clear() {
+    if (p_entry != nullptr && --p_entry->refs == 0 && !p_entry->in_cache) {
+      delete p_entry;
+    }
+    p_entry = nullptr;
+    pos = 0;
+  }
+
+ protected:
+  FTPListingEntry *p_entry = nullptr;
+  size_t pos = 0;
+};
+
+/**
+ * @brief FTPListingCache
+ * Keeps the lines of the recent directory listings in memory, so that
+ * repeated listings of the same directory can be replayed without any
+ * network access. The entries expire after the TTL and the least recently
+ * used entries are removed when the memory limit is reached. A listing is
+ * only stored after it has been received completely: a listing of a
+ * directory which is invalidated while it is received is not stored.
+ * @author Phil Schatzmann
+ */
+class FTPListingCache {
+ public:
+  ~FTPListingCache() {
+    clear();
+    cancelCapture();
+  }
+
+  /// Activates the cache with the indicated memory limit in bytes (0 =
+  /// inactive) and time to live in ms
+  void begin(size_t maxBytes, unsigned long ttlMs) {
+    max_size = maxBytes;
+    ttl_ms = ttlMs;
+    clear();
+  }
+
+  /// Returns true if the cache is active
+  bool isActive() { return max_size > 0; }
+
+  /// Provides the cached listing: the result is empty if the directory is
+  /// not cached or the entry has expired
+  FTPListingRef find(const char *path, ListMode mode) {
+    size_t len = keyLen(path);
+    FTPListingEntry *entry = p_head;
+    while (entry != nullptr) {
+      FTPListingEntry *next = entry->next;
+      if (millis() - entry->time > ttl_ms) {
+        remove(entry);
+      } else if (entry->key_mode == mode && isKey(entry->path(), path, len)) {
+        // move to the front to keep the order of the last use
+        unlink(entry);
+        pushFront(entry);
+        return FTPListingRef(entry);
+      }
+      entry = next;
+    }
+    return FTPListingRef();
+  }
+
+  /// Removes the listings of the directory
+  void invalidate(const char *path) { invalidate(path, keyLen(path)); }
+
+  /// Removes the listings of the directory which contains the path
+  void invalidateParent(const char *path) {
+    size_t len = keyLen(path);
+    // find the last '/'
+    size_t parent_len = 0;
+    for (size_t j = 0; j < len; j++) {
+      if (path[j] == '/') parent_len = j == 0 ? 1 : j;
+    }
+    invalidate(path, parent_len);
+  }
+
+  /// Removes all listings
+  void clear() {
+    while (p_head != nullptr) remove(p_head);
+  }
+
+  /// Provides the number of bytes which are used by the listings
+  size_t size() { return used_size; }
+
+  /// Starts to collect the lines of a listing: returns the id of the
+  /// capture. Only one listing is collected at a time.
+  int beginCapture(const char *path, ListMode keyMode, ListMode listMode) {
+    if (!isActive()) return 0;
+    cancelCapture();
+    size_t len = keyLen(path);
+    if (!reserve(len + 1)) return 0;
+    memcpy(capture_data, path, len);
+    capture_data[len] = '\0';
+    capture_len = len + 1;
+    capture_key_mode = keyMode;
+    capture_list_mode = listMode;
+    return ++capture_id;
+  }
+
+  /// Adds a line to the listing which is collected
+  void append(int id, const char *line) {
+    if (id == 0 || id != capture_id || capture_data == nullptr) return;
+    size_t len = strlen(line);
+    if (!reserve(capture_len + len + 1)) {
+      FTPLogger::writeLog(LOG_INFO, "FTPListingCache", "listing too big");
+      cancelCapture();
+      return;
+    }
+    memcpy(capture_data + capture_len, line, len);
+    capture_data[capture_len + len] = '\n';
+    capture_len += len + 1;
+  }
+
+  /// Stores the collected listing in the cache
+  void endCapture(int id) {
+    if (id == 0 || id != capture_id || capture_data == nullptr) return;
+    const char *path = capture_data;
+    invalidate(path, strlen(path), capture_key_mode);
+    // remove the least recently used entries
+    while (p_tail != nullptr && used_size + capture_len > max_size) {
+      remove(p_tail);
+    }
+    // we keep only the used memory
+    if (capture_size > capture_len) {
+      char *data = new char[capture_len];
+      memcpy(data, capture_data, capture_len);
+      delete[] capture_data;
+      capture_data = data;
+    }
+    FTPListingEntry *entry = new FTPListingEntry();
+    entry->lines_start = strlen(capture_data) + 1;
+    entry->data = capture_data;
+    entry->size = capture_len;
+    entry->key_mode = capture_key_mode;
+    entry->list_mode = capture_list_mode;
+    entry->time = millis();
+    entry->in_cache = true;
+    pushFront(entry);
+    used_size += entry->size;
+    capture_data = nullptr;
+    capture_len = 0;
+    capture_size = 0;
+  }
+
+  /// Discards the collected lines
+  void cancelCapture() {
+    delete[] capture_data;
+    capture_data = nullptr;
+    capture_len = 0;
+    capture_size = 0;
+  }
+
+ protected:
+  FTPListingEntry *p_head = nullptr;
+  FTPListingEntry *p_tail = nullptr;
+  size_t max_size = 0;
+  size_t used_size = 0;
+  unsigned long ttl_ms = FTP_LISTING_CACHE_TTL_MS;
+  char *capture_data = nullptr;
+  size_t capture_len = 0;
+  size_t capture_size = 0;
+  int capture_id = 0;
+  ListMode capture_key_mode = LIST_NLST;
+  ListMode capture_list_mode = LIST_NLST;
+
+  /// Length of the path without trailing '/' (the root stays "/")
+  static size_t keyLen(const char *path) {
+    if (path == nullptr) return 0;
+    size_t len = strlen(path);
+    while (len > 1 && path[len - 1] == '/') len--;
+    return len;
+  }
+
+  static bool isKey(const char *key, const char *path, size_t len) {
+    return strncmp(key, path, len) == 0 && key[len] == '\0';
+  }
+
+  void invalidate(const char *path, size_t len) {
+    invalidate(path, len, LIST_NLST);
+    invalidate(path, len, LIST_MLSD);
+  }
+
+  void invalidate(const char *path, size_t len, ListMode mode) {
+    // a listing which is collected right now might be outdated
+    if (capture_data != nullptr && capture_key_mode == mode &&
+        path != capture_data && isKey(capture_data, path, len)) {
+      cancelCapture();
+    }
+    FTPListingEntry *entry = p_head;
+    while (entry != nullptr) {
+      FTPListingEntry *next = entry->next;
+      if (entry->key_mode == mode && isKey(entry->path(), path, len)) {
+        remove(entry);
+      }
+      entry = next;
+    }
+  }
+
+  /// Makes sure that the capture buffer has the requested size
+  bool reserve(size_t size) {
+    if (size > max_size) return false;
+    if (size <= capture_size) return true;
+    size_t new_size = capture_size == 0 ? 128 : capture_size * 2;
+    while (new_size < size) new_size *= 2;
+    if (new_size > max_size) new_size = max_size;
+    char *data = new char[new_size];
+    if (capture_data != nullptr) {
+      memcpy(data, capture_data, capture_len);
+      delete[] capture_data;
+    }
+    capture_data = data;
+    capture_size = new_size;
+    return true;
+  }
+
+  void pushFront(FTPListingEntry *entry) {
+    entry->prev = nullptr;
+    entry->next = p_head;
+    if (p_head != nullptr) p_head->prev = entry;
+    p_head = entry;
+    if (p_tail == nullptr) p_tail = entry;
+  }
+
+  void unlink(FTPListingEntry *entry) {
+    if (entry->prev != nullptr) entry->prev->next = entry->next;
+    if (entry->next != nullptr) entry->next->prev = entry->prev;
+    if (p_head == entry) p_head = entry->next;
+    if (p_tail == entry) p_tail = entry->prev;
+    entry->prev = nullptr;
+    entry->next = nullptr;
+  }
+
+  void remove(FTPListingEntry *entry) {
+    unlink(entry);
+    used_size -= entry->size;
+    entry->in_cache = false;
+    if (entry->refs == 0) delete entry;
+  }
+};
+
+}  // namespace ftp_client
@@ -0,0 +1,126 @@
+#pragma once
+
+#include "Arduino.h"
+#include "FTPCommon.h"
+#include "Stream.h"
+#include <time.h>
+#if defined(ESP32) || defined(ESP8266)
+#include <FS.h>
+#endif
+
+namespace ftp_client {
+
+/**
+ * @brief FTPLocalFS
+ * Abstract local file system which is used by the FTPMirror, so that the
+ * mirror can be used with any storage (SD, SPIFFS, LittleFS or a desktop
+ * file system). The paths are absolute and use '/' as separator. The
+ * modification times are provided as YYYYMMDDHHMMSS in UTC like the MDTM
+ * reply: an empty time is not compared.
+ * @author Phil Schatzmann
+ */
+class FTPLocalFS {
+ public:
+  virtual ~FTPLocalFS() = default;
+
+  /// Calls the callback for each entry of the directory (the name is
+  /// without the path): returns false if the directory does not exist
+  virtual bool list(const char *dir,
+                    void (*callback)(const FTPFileInfo &info, void *ref),
+                    void *ref) = 0;
+
+  /// Determines the type, size and modification time: returns false if the
+  /// file does not exist
+  virtual bool info(const char *path, FTPFileInfo &info) = 0;
+
+  virtual bool mkdir(const char *path) = 0;
+
+  /// Opens the file for reading (READ_MODE) or writing (WRITE_MODE): returns
+  /// nullptr if this is not possible
+  virtual Stream *open(const char *path, FileMode mode) = 0;
+
+  /// Closes a file which was opened with open()
+  virtual void close(Stream *file) = 0;
+
+  /// Sets the modification time of a downloaded file: optional
+  virtual bool setModified(const char *, const char *) {
+    return false;
+  }
+};
+
+/**
+ * @brief FTPLocalFSAdapter
+ * FTPLocalFS for the Arduino file systems of the ESP32 and ESP8266 (SD,
+ * SD_MMC, SPIFFS, LittleFS) which provide fs::FS and fs::File: e.g.
+ * FTPArduinoFS local(SD);
+ * @author Phil Schatzmann
+ */
+template <class FSType, class FileType>
+class FTPLocalFSAdapter : public FTPLocalFS {
+ public:
+  FTPLocalFSAdapter(FSType &fs) { p_fs = &fs; }
+
+  bool list(const char *dir,
+            void (*callback)(const FTPFileInfo &info, void *ref),
+            void *ref) override {
+    FileType root = p_fs->open(dir, "r");
+    if (!root || !root.isDirectory()) return false;
+    FileType file = root.openNextFile();
+    while (file) {
+      FTPFileInfo info;
+      toInfo(file, info);
+      callback(info, ref);
+      file = root.openNextFile();
+    }
+    return true;
+  }
+
+  bool info(const char *path, FTPFileInfo &info) override {
+    if (!p_fs->exists(path)) return false;
+    FileType file = p_fs->open(path, "r");
+    if (!file) return false;
+    toInfo(file, info);
+    info.name = nullptr;
+    return true;
+  }
+
+  bool mkdir(const char *path) override { return p_fs->mkdir(path); }
+
+  Stream *open(const char *path, FileMode mode) override {
+    FileType file = p_fs->open(path, mode == READ_MODE ? "r" : "w");
+    if (!file) return nullptr;
+    return new FileType(file);
+  }
+
+  void close(Stream *file) override {
+    FileType *p_file = (FileType *)file;
+    p_file->close();
+    delete p_file;
+  }
+
+ protected:
+  FSType *p_fs = nullptr;
+
+  static void toInfo(FileType &file, FTPFileInfo &info) {
+    // some versions provide the full path
+    const char *name = file.name();
+    const char *last = strrchr(name, '/');
+    info.name = last != nullptr ? last + 1 : name;
+    info.type = file.isDirectory() ? TypeDirectory : TypeFile;
+    info.size = file.isDirectory() ? 0 : file.size();
+    info.modify[0] = '\0';
+    time_t time = file.getLastWrite();
+    // 0 if the file system does not support the time
+    if (time > 0) {
+      struct tm tm;
+      gmtime_r(&time, &tm);
+      strftime(info.modify, sizeof(info.modify), "%Y%m%d%H%M%S", &tm);
+    }
+  }
+};
+
+#if defined(ESP32) || defined(ESP8266)
+using FTPArduinoFS = FTPLocalFSAdapter<fs::FS, fs::File>;
+#endif
+
+}  // namespace ftp_client
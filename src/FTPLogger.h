@@ -11,7 +11,10 @@ static Stream *ftp_logger_out_ptr = nullptr;
 /**
  * @brief FTPLogger
  * To activate logging define the output stream e.g. with
- * FTPLogger.setOutput(Serial); and (optionally) set the log level
+ * FTPLogger.setOutput(Serial); and (optionally) set the log level.
+ * Messages below FTP_MIN_LOG_LEVEL (e.g. -DFTP_MIN_LOG_LEVEL=LOG_ERROR) are
+ * removed at compile time and writeLogf() only formats the message if it
+ * is actually written.
  * @author Phil Schatzmann
  */
 class FTPLogger {
@@ -27,32 +30,52 @@ class FTPLogger {
   static void setOutput(Stream &out) {
     ftp_logger_out_ptr = &out;
   }
-  
+
+  /// Returns true if messages with the indicated level are written
+  static bool isLogging(LogLevel level) {
+    return level >= FTP_MIN_LOG_LEVEL && level >= ftp_min_log_level &&
+           ftp_logger_out_ptr != nullptr;
+  }
+
   static void writeLog(LogLevel level, const char *module, const char *msg = nullptr) {
-    if (ftp_logger_out_ptr != nullptr && level >= ftp_min_log_level) {
-      ftp_logger_out_ptr->print("FTP ");
-      switch (level) {
-        case LOG_DEBUG:
-          ftp_logger_out_ptr->print("DEBUG - ");
-          break;
-        case LOG_INFO:
-          ftp_logger_out_ptr->print("INFO - ");
-          break;
-        case LOG_WARN:
-          ftp_logger_out_ptr->print("WARN - ");
-          break;
-        case LOG_ERROR:
-          ftp_logger_out_ptr->print("ERROR - ");
-          break;
-      }
-      ftp_logger_out_ptr->print(module);
-      if (msg != nullptr) {
-        ftp_logger_out_ptr->print(": ");
-        ftp_logger_out_ptr->print(msg);
-      }
-      ftp_logger_out_ptr->println();
+    if (isLogging(level)) write(level, module, msg);
+  }
+
+  /// Writes a printf formatted message: the formatting is only done if the
+  /// message is written
+  template <typename... Args>
+  static void writeLogf(LogLevel level, const char *module, const char *fmt,
+                        Args... args) {
+    if (!isLogging(level)) return;
+    char msg[FTP_LOG_BUFFER_SIZE];
+    snprintf(msg, sizeof(msg), fmt, args...);
+    write(level, module, msg);
+  }
+
+ protected:
+  static void write(LogLevel level, const char *module, const char *msg) {
+    ftp_logger_out_ptr->print("FTP ");
+    switch (level) {
+      case LOG_DEBUG:
+        ftp_logger_out_ptr->print("DEBUG - ");
+        break;
+      case LOG_INFO:
+        ftp_logger_out_ptr->print("INFO - ");
+        break;
+      case LOG_WARN:
+        ftp_logger_out_ptr->print("WARN - ");
+        break;
+      default:
+        ftp_logger_out_ptr->print("ERROR - ");
+        break;
+    }
+    ftp_logger_out_ptr->print(module);
+    if (msg != nullptr) {
+      ftp_logger_out_ptr->print(": ");
+      ftp_logger_out_ptr->print(msg);
     }
+    ftp_logger_out_ptr->println();
   }
 };
 
-}
\ No newline at end of file
+}
@@ -0,0 +1,1017 @@
+#pragma once
+
+#include "Arduino.h"
+#include "Client.h"
+#include "FTPChecksum.h"
+#include "FTPCommon.h"
+#include "FTPDeflate.h"
+#include "FTPLogger.h"
+#include "IPAddress.h"
+
+namespace ftp_client {
+
+/**
+ * @brief FTPLoopbackPipe
+ * Byte queue for one direction of a loopback connection. Data which is
+ * written with a release time only becomes visible to the reader when this
+ * time has been reached: this is used to simulate the latency of the
+ * network.
+ */
+class FTPLoopbackPipe {
+ public:
+  ~FTPLoopbackPipe() { free(data); }
+
+  /// Adds the data: it becomes visible at the indicated time (0 = now)
+  size_t write(const uint8_t *src, size_t len, unsigned long releaseTime = 0) {
+    if (len == 0) return 0;
+    if (!reserve(len)) return 0;
+    if (releaseTime != 0 && mark_count < FTP_LOOPBACK_MAX_MARKS) {
+      marks[mark_count].pos = end;
+      marks[mark_count].time = releaseTime;
+      mark_count++;
+    }
+    memcpy(data + end, src, len);
+    end += len;
+    return len;
+  }
+
+  /// Number of bytes which can be read now
+  int available() {
+    unsigned long now = millis();
+    while (mark_count > 0 && (long)(now - marks[0].time) >= 0) popMark();
+    size_t visible = mark_count > 0 ? marks[0].pos : end;
+    return visible - start;
+  }
+
+  /// Number of bytes in the queue (including the invisible ones)
+  size_t size() { return end - start; }
+
+  int read(uint8_t *dst, size_t len) {
+    size_t n = available();
+    if (n > len) n = len;
+    if (n == 0) return 0;
+    memcpy(dst, data + start, n);
+    start += n;
+    if (start == end) clear();
+    return n;
+  }
+
+  int peek() { return available() > 0 ? data[start] : -1; }
+
+  void clear() {
+    start = 0;
+    end = 0;
+    mark_count = 0;
+  }
+
+ protected:
+  struct Mark {
+    size_t pos;
+    unsigned long time;
+  };
+  uint8_t *data = nullptr;
+  size_t capacity = 0;
+  size_t start = 0;
+  size_t end = 0;
+  Mark marks[FTP_LOOPBACK_MAX_MARKS];
+  int mark_count = 0;
+
+  void popMark() {
+    for (int j = 1; j < mark_count; j++) marks[j - 1] = marks[j];
+    mark_count--;
+  }
+
+  /// Makes room for len additional bytes
+  bool reserve(size_t len) {
+    if (end + len <= capacity) return true;
+    // move the unread data to the front
+    if (start > 0) {
+      memmove(data, data + start, end - start);
+      for (int j = 0; j < mark_count; j++) marks[j].pos -= start;
+      end -= start;
+      start = 0;
+      if (end + len <= capacity) return true;
+    }
+    size_t new_capacity = capacity == 0 ? 1024 : capacity * 2;
+    while (new_capacity < end + len) new_capacity *= 2;
+    uint8_t *new_data = (uint8_t *)realloc(data, new_capacity);
+    if (new_data == nullptr) return false;
+    data = new_data;
+    capacity = new_capacity;
+    return true;
+  }
+};
+
+/**
+ * @brief FTPLoopbackPrint
+ * Print which adds the data to a FTPLoopbackPipe
+ */
+class FTPLoopbackPrint : public Print {
+ public:
+  FTPLoopbackPipe *p_pipe = nullptr;
+
+  size_t write(uint8_t c) override { return write(&c, 1); }
+  size_t write(const uint8_t *data, size_t len) override {
+    return p_pipe != nullptr ? p_pipe->write(data, len) : 0;
+  }
+};
+
+/**
+ * @brief FTPLoopbackConnection
+ * The two pipes of a loopback connection: it is deleted when both ends have
+ * been closed.
+ */
+struct FTPLoopbackConnection {
+  FTPLoopbackPipe to_server;
+  FTPLoopbackPipe to_client;
+  bool is_client_open = true;
+  bool is_server_open = true;
+  int refs = 2;
+
+  void release() {
+    if (--refs == 0) delete this;
+  }
+};
+
+/**
+ * @brief FTPLoopbackEnd
+ * One end of a loopback connection
+ */
+struct FTPLoopbackEnd {
+  FTPLoopbackConnection *p_connection = nullptr;
+  bool is_client = false;
+
+  operator bool() { return p_connection != nullptr; }
+  FTPLoopbackPipe &in() {
+    return is_client ? p_connection->to_client : p_connection->to_server;
+  }
+  FTPLoopbackPipe &out() {
+    return is_client ? p_connection->to_server : p_connection->to_client;
+  }
+  bool isPeerOpen() {
+    return is_client ? p_connection->is_server_open
+                     : p_connection->is_client_open;
+  }
+  void close() {
+    if (p_connection == nullptr) return;
+    if (is_client) {
+      p_connection->is_client_open = false;
+    } else {
+      p_connection->is_server_open = false;
+    }
+    p_connection->release();
+    p_connection = nullptr;
+  }
+};
+
+class FTPLoopbackServer;
+
+/**
+ * @brief FTPLoopbackFile
+ * File or directory of the in memory file system of the FTPLoopbackServer:
+ * files which were added with a size only provide generated content.
+ */
+struct FTPLoopbackFile {
+  char *path = nullptr;
+  uint8_t *data = nullptr;
+  uint64_t size = 0;
+  size_t capacity = 0;
+  bool is_directory = false;
+  bool is_generated = false;
+  FTPLoopbackFile *next = nullptr;
+
+  /// Provides the content at the indicated position
+  size_t get(uint64_t pos, uint8_t *dst, size_t len) {
+    if (pos >= size) return 0;
+    if (len > size - pos) len = size - pos;
+    if (is_generated) {
+      for (size_t j = 0; j < len; j++) dst[j] = generated(pos + j);
+    } else {
+      memcpy(dst, data + pos, len);
+    }
+    return len;
+  }
+
+  /// The generated content
+  static uint8_t generated(uint64_t pos) { return (uint8_t)(pos % 251); }
+
+  /// Adds the data at the end of the file
+  bool append(const uint8_t *src, size_t len) {
+    if (is_generated) materialize();
+    if (len == 0) return true;
+    if (size + len > capacity) {
+      size_t new_capacity = capacity == 0 ? 1024 : capacity * 2;
+      while (new_capacity < size + len) new_capacity *= 2;
+      uint8_t *new_data = (uint8_t *)realloc(data, new_capacity);
+      if (new_data == nullptr) return false;
+      data = new_data;
+      capacity = new_capacity;
+    }
+    memcpy(data + size, src, len);
+    size += len;
+    return true;
+  }
+
+  void truncate(uint64_t newSize) {
+    if (is_generated) materialize();
+    if (newSize < size) size = newSize;
+  }
+
+  void materialize() {
+    is_generated = false;
+    uint64_t len = size;
+    size = 0;
+    for (uint64_t pos = 0; pos < len; pos++) {
+      uint8_t c = generated(pos);
+      append(&c, 1);
+    }
+  }
+};
+
+/**
+ * @brief FTPLoopbackServer
+ * In process FTP server with an in memory file system which can be used to
+ * test and benchmark the FTP client without any network: the
+ * FTPLoopbackClient connects to the server which has been registered with
+ * its IP address. The server is processed whenever a client accesses its
+ * connection. The latency of the replies and the bandwidth of the data
+ * connections can be defined to simulate different networks.
+ * Supported commands: USER, PASS, OPTS, SYST, PWD, TYPE, MODE (S and Z),
+ * NOOP, FEAT, PASV, EPSV, PORT, REST, RETR, STOR, APPE, DELE, MKD, RMD, SIZE,
+ * MDTM, NLST, MLSD, HASH, XCRC, XMD5, XSHA1, ABOR and QUIT. After PORT the
+ * server connects to the registered server with the indicated address, so
+ * that server to server transfers can be tested with two instances.
+ * @author Phil Schatzmann
+ */
+class FTPLoopbackServer {
+ public:
+  FTPLoopbackServer(IPAddress address = IPAddress(127, 0, 0, 1),
+                    int port = FTP_COMMAND_PORT) {
+    this->address = address;
+    this->port = port;
+  }
+
+  ~FTPLoopbackServer() { end(); }
+
+  /// Registers the server, so that clients can connect to its address
+  bool begin() {
+    for (int j = 0; j < FTP_LOOPBACK_MAX_SERVERS; j++) {
+      if (servers()[j] == nullptr || servers()[j] == this) {
+        servers()[j] = this;
+        if (find("/") == nullptr) addDirectory("/");
+        return true;
+      }
+    }
+    return false;
+  }
+
+  /// Closes all sessions and removes all files
+  void end() {
+    for (int j = 0; j < FTP_LOOPBACK_MAX_SERVERS; j++) {
+      if (servers()[j] == this) servers()[j] = nullptr;
+    }
+    for (int j = 0; j < FTP_LOOPBACK_MAX_SESSIONS; j++) closeSession(sessions[j]);
+    while (p_files != nullptr) removeFile(p_files);
+  }
+
+  /// Provides the registered server with the indicated address
+  static FTPLoopbackServer *find(IPAddress address) {
+    for (int j = 0; j < FTP_LOOPBACK_MAX_SERVERS; j++) {
+      FTPLoopbackServer *server = servers()[j];
+      if (server != nullptr && server->address == address) return server;
+    }
+    return nullptr;
+  }
+
+  /// Defines the delay in ms of the replies on the command connection
+  void setLatency(unsigned long ms) { latency_ms = ms; }
+
+  /// Defines the max bytes per second of each data connection (0 = no limit)
+  void setBandwidth(unsigned long bytesPerSecond) {
+    bandwidth = bytesPerSecond;
+  }
+
+  /// Defines the optional features (FTPFeature flags) which are supported
+  void setFeatures(int features) { this->features = features; }
+
+  /// Number of commands which have been processed
+  unsigned long commandCount() { return command_count; }
+
+  /// Number of write() calls of the clients on the command and data
+  /// connections: on a network each of them sends at least one segment
+  unsigned long writeCount() { return write_count; }
+
+  /// Called by the FTPLoopbackClient for each write()
+  void countWrite() { write_count++; }
+
+  /// Adds a file with the indicated content
+  FTPLoopbackFile *addFile(const char *path, const uint8_t *data, size_t len) {
+    FTPLoopbackFile *file = createFile(path, false);
+    if (file != nullptr) {
+      file->truncate(0);
+      file->append(data, len);
+    }
+    return file;
+  }
+
+  /// Adds a file with the indicated size and generated content
+  FTPLoopbackFile *addFile(const char *path, uint64_t size) {
+    FTPLoopbackFile *file = createFile(path, false);
+    if (file != nullptr) {
+      file->truncate(0);
+      file->is_generated = true;
+      file->size = size;
+    }
+    return file;
+  }
+
+  FTPLoopbackFile *addDirectory(const char *path) {
+    return createFile(path, true);
+  }
+
+  /// Provides the file or directory
+  FTPLoopbackFile *find(const char *path) {
+    char normalized[FTP_MAX_LINE_SIZE];
+    normalize(path, normalized);
+    for (FTPLoopbackFile *file = p_files; file != nullptr; file = file->next) {
+      if (strcmp(file->path, normalized) == 0) return file;
+    }
+    return nullptr;
+  }
+
+  /// Removes the file or directory
+  bool remove(const char *path) {
+    FTPLoopbackFile *file = find(path);
+    if (file == nullptr) return false;
+    removeFile(file);
+    return true;
+  }
+
+  /// Called by the FTPLoopbackClient to open a connection to the
+  /// indicated port
+  FTPLoopbackConnection *accept(int port) {
+    if (port == this->port) {
+      for (int j = 0; j < FTP_LOOPBACK_MAX_SESSIONS; j++) {
+        Session &session = sessions[j];
+        if (session.control) continue;
+        closeSession(session);
+        session = Session();
+        session.control.p_connection = new FTPLoopbackConnection();
+        reply(session, "220 FTPLoopbackServer ready");
+        return session.control.p_connection;
+      }
+      return nullptr;
+    }
+    // data connection after PASV or EPSV
+    for (int j = 0; j < FTP_LOOPBACK_MAX_SESSIONS; j++) {
+      Session &session = sessions[j];
+      if (session.control && session.data_port == port) {
+        session.data.close();
+        session.data.p_connection = new FTPLoopbackConnection();
+        session.data.is_client = false;
+        session.data_port = 0;
+        return session.data.p_connection;
+      }
+    }
+    return nullptr;
+  }
+
+  /// Processes the commands and the transfers of all sessions
+  void loop() {
+    // avoid recursion if a client is used by the server
+    if (is_busy) return;
+    is_busy = true;
+    for (int j = 0; j < FTP_LOOPBACK_MAX_SESSIONS; j++) {
+      Session &session = sessions[j];
+      if (!session.control) continue;
+      processTransfer(session);
+      processCommands(session);
+      if (session.control && !session.control.isPeerOpen() &&
+          session.control.in().available() == 0) {
+        closeSession(session);
+      }
+    }
+    is_busy = false;
+  }
+
+ protected:
+  enum TransferState { TRANSFER_NONE, TRANSFER_SEND, TRANSFER_RECEIVE };
+  struct Session {
+    FTPLoopbackEnd control;
+    FTPLoopbackEnd data;
+    int data_port = 0;
+    // address of PORT: we connect when the transfer starts
+    IPAddress active_address;
+    int active_port = 0;
+    uint64_t rest = 0;
+    TransferState state = TRANSFER_NONE;
+    FTPLoopbackFile *p_file = nullptr;
+    // listing which is sent instead of a file
+    FTPLoopbackFile listing;
+    uint64_t pos = 0;
+    // bytes on the data connection
+    uint64_t transferred = 0;
+    unsigned long start_time = 0;
+    // MODE Z
+    bool mode_z = false;
+    FTPDeflate *p_deflate = nullptr;
+    FTPInflate *p_inflate = nullptr;
+    FTPLoopbackPrint deflate_out;
+    // algorithm of the HASH command
+    FTPHashAlgorithm hash = HASH_SHA1;
+    char line[FTP_MAX_LINE_SIZE];
+    int line_len = 0;
+  };
+  IPAddress address;
+  int port;
+  Session sessions[FTP_LOOPBACK_MAX_SESSIONS];
+  FTPLoopbackFile *p_files = nullptr;
+  unsigned long latency_ms = 0;
+  unsigned long bandwidth = 0;
+  unsigned long command_count = 0;
+  unsigned long write_count = 0;
+  int features = FEAT_MLST | FEAT_SIZE | FEAT_MDTM | FEAT_REST | FEAT_EPSV |
+                 FEAT_MODEZ | FEAT_HASH;
+  int next_data_port = 50000;
+  bool is_busy = false;
+
+  static FTPLoopbackServer **servers() {
+    static FTPLoopbackServer *result[FTP_LOOPBACK_MAX_SERVERS] = {nullptr};
+    return result;
+  }
+
+  /// Absolute path without trailing '/'
+  static void normalize(const char *path, char *result) {
+    int len = 0;
+    if (path == nullptr || path[0] != '/') result[len++] = '/';
+    for (int j = 0; path != nullptr && path[j] != '\0'; j++) {
+      if (len >= FTP_MAX_LINE_SIZE - 1) break;
+      // avoid duplicate '/'
+      if (path[j] == '/' && len > 0 && result[len - 1] == '/') continue;
+      result[len++] = path[j];
+    }
+    if (len > 1 && result[len - 1] == '/') len--;
+    result[len] = '\0';
+  }
+
+  /// Returns true if the path is an entry of the directory
+  static bool isInDirectory(const char *path, const char *dir) {
+    size_t dir_len = strlen(dir);
+    if (strcmp(path, "/") == 0) return false;
+    if (dir_len == 1) return strchr(path + 1, '/') == nullptr;
+    return strncmp(path, dir, dir_len) == 0 && path[dir_len] == '/' &&
+           strchr(path + dir_len + 1, '/') == nullptr;
+  }
+
+  FTPLoopbackFile *createFile(const char *path, bool isDirectory) {
+    FTPLoopbackFile *file = find(path);
+    if (file != nullptr) {
+      return file->is_directory == isDirectory ? file : nullptr;
+    }
+    char normalized[FTP_MAX_LINE_SIZE];
+    normalize(path, normalized);
+    file = new FTPLoopbackFile();
+    file->path = strdup(normalized);
+    file->is_directory = isDirectory;
+    file->next = p_files;
+    p_files = file;
+    return file;
+  }
+
+  void removeFile(FTPLoopbackFile *file) {
+    FTPLoopbackFile **p_next = &p_files;
+    while (*p_next != file) p_next = &(*p_next)->next;
+    *p_next = file->next;
+    for (int j = 0; j < FTP_LOOPBACK_MAX_SESSIONS; j++) {
+      if (sessions[j].p_file == file) endTransfer(sessions[j], nullptr);
+    }
+    free(file->path);
+    free(file->data);
+    delete file;
+  }
+
+  void reply(Session &session, const char *text) {
+    if (!session.control) return;
+    unsigned long time = latency_ms > 0 ? millis() + latency_ms : 0;
+    // avoid the value 0 which is used for no delay
+    if (latency_ms > 0 && time == 0) time = 1;
+    session.control.out().write((const uint8_t *)text, strlen(text), time);
+    session.control.out().write((const uint8_t *)"\r\n", 2);
+  }
+
+  void closeSession(Session &session) {
+    session.control.close();
+    session.data.close();
+    free(session.listing.data);
+    session.listing = FTPLoopbackFile();
+    session.p_file = nullptr;
+    session.state = TRANSFER_NONE;
+    delete session.p_deflate;
+    delete session.p_inflate;
+    session.p_deflate = nullptr;
+    session.p_inflate = nullptr;
+  }
+
+  void processCommands(Session &session) {
+    while (session.control && session.control.in().available() > 0) {
+      uint8_t c = 0;
+      session.control.in().read(&c, 1);
+      if (c == '\n') {
+        session.line[session.line_len] = '\0';
+        if (session.line_len > 0 && session.line[session.line_len - 1] == '\r') {
+          session.line[session.line_len - 1] = '\0';
+        }
+        session.line_len = 0;
+        command_count++;
+        processCommand(session, session.line);
+      } else if (session.line_len < FTP_MAX_LINE_SIZE - 1) {
+        session.line[session.line_len++] = c;
+      }
+    }
+  }
+
+  void processCommand(Session &session, char *line) {
+    char *par = strchr(line, ' ');
+    if (par != nullptr) *par++ = '\0';
+    const char *cmd = line;
+    char msg[FTP_MAX_LINE_SIZE + 40];
+    if (strcasecmp(cmd, "USER") == 0) {
+      reply(session, "331 Password required");
+    } else if (strcasecmp(cmd, "PASS") == 0) {
+      reply(session, "230 Logged in");
+    } else if (strcasecmp(cmd, "OPTS") == 0 && par != nullptr &&
+               strncasecmp(par, "HASH ", 5) == 0 && (features & FEAT_HASH)) {
+      FTPHashAlgorithm alg = hashAlgorithm(par + 5);
+      if (alg != HASH_NONE) session.hash = alg;
+      reply(session, alg != HASH_NONE ? "200 OK" : "501 Unknown algorithm");
+    } else if (strcasecmp(cmd, "OPTS") == 0 || strcasecmp(cmd, "TYPE") == 0) {
+      reply(session, "200 OK");
+    } else if (strcasecmp(cmd, "MODE") == 0) {
+      bool is_stream = par != nullptr && strcasecmp(par, "S") == 0;
+      bool is_z = par != nullptr && strcasecmp(par, "Z") == 0 &&
+                  (features & FEAT_MODEZ);
+      if (is_stream || is_z) session.mode_z = is_z;
+      reply(session,
+            is_stream || is_z ? "200 OK" : "504 Mode not supported");
+    } else if (strcasecmp(cmd, "NOOP") == 0) {
+      reply(session, "200 OK");
+    } else if (strcasecmp(cmd, "SYST") == 0) {
+      reply(session, "215 UNIX Type: L8");
+    } else if (strcasecmp(cmd, "PWD") == 0) {
+      reply(session, "257 \"/\"");
+    } else if (strcasecmp(cmd, "FEAT") == 0) {
+      reply(session, "211-Features:");
+      if (features & FEAT_MLST) reply(session, " MLST type*;size*;modify*;");
+      if (features & FEAT_SIZE) reply(session, " SIZE");
+      if (features & FEAT_MDTM) reply(session, " MDTM");
+      if (features & FEAT_REST) reply(session, " REST STREAM");
+      if (features & FEAT_EPSV) reply(session, " EPSV");
+      if (features & FEAT_MODEZ) reply(session, " MODE Z");
+      if (features & FEAT_HASH) {
+        snprintf(msg, sizeof(msg), " HASH SHA-1%s;MD5%s;CRC32%s",
+                 session.hash == HASH_SHA1 ? "*" : "",
+                 session.hash == HASH_MD5 ? "*" : "",
+                 session.hash == HASH_CRC32 ? "*" : "");
+        reply(session, msg);
+      }
+      if (features & FEAT_XCRC) reply(session, " XCRC");
+      if (features & FEAT_XMD5) reply(session, " XMD5");
+      if (features & FEAT_XSHA1) reply(session, " XSHA1");
+      reply(session, "211 End");
+    } else if (strcasecmp(cmd, "PASV") == 0) {
+      session.data_port = nextDataPort();
+      session.active_port = 0;
+      snprintf(msg, sizeof(msg),
+               "227 Entering Passive Mode (%d,%d,%d,%d,%d,%d)", address[0],
+               address[1], address[2], address[3], session.data_port / 256,
+               session.data_port % 256);
+      reply(session, msg);
+    } else if (strcasecmp(cmd, "EPSV") == 0 && (features & FEAT_EPSV)) {
+      session.data_port = nextDataPort();
+      session.active_port = 0;
+      snprintf(msg, sizeof(msg),
+               "229 Entering Extended Passive Mode (|||%d|)",
+               session.data_port);
+      reply(session, msg);
+    } else if (strcasecmp(cmd, "PORT") == 0) {
+      // h1,h2,h3,h4,p1,p2
+      int v[6];
+      if (par == nullptr || sscanf(par, "%d,%d,%d,%d,%d,%d", &v[0], &v[1],
+                                   &v[2], &v[3], &v[4], &v[5]) != 6) {
+        reply(session, "501 Invalid PORT");
+      } else {
+        session.active_address = IPAddress(v[0], v[1], v[2], v[3]);
+        session.active_port = v[4] * 256 + v[5];
+        session.data_port = 0;
+        reply(session, "200 PORT command successful");
+      }
+    } else if (strcasecmp(cmd, "REST") == 0 && (features & FEAT_REST)) {
+      session.rest = par != nullptr ? CStringFunctions::toUInt64(par) : 0;
+      reply(session, "350 Restarting");
+    } else if (strcasecmp(cmd, "RETR") == 0) {
+      FTPLoopbackFile *file = find(par);
+      if (file == nullptr || file->is_directory) {
+        reply(session, "550 File not found");
+      } else {
+        startTransfer(session, file, TRANSFER_SEND, session.rest);
+      }
+      session.rest = 0;
+    } else if (strcasecmp(cmd, "STOR") == 0 || strcasecmp(cmd, "APPE") == 0) {
+      FTPLoopbackFile *file = createFile(par, false);
+      if (file == nullptr) {
+        reply(session, "550 Can not create file");
+      } else {
+        bool is_append = strcasecmp(cmd, "APPE") == 0;
+        if (!is_append) file->truncate(session.rest);
+        startTransfer(session, file, TRANSFER_RECEIVE, file->size);
+      }
+      session.rest = 0;
+    } else if (strcasecmp(cmd, "NLST") == 0 || strcasecmp(cmd, "MLSD") == 0) {
+      listDirectory(session, par, strcasecmp(cmd, "MLSD") == 0);
+    } else if (strcasecmp(cmd, "DELE") == 0) {
+      FTPLoopbackFile *file = find(par);
+      if (file == nullptr || file->is_directory) {
+        reply(session, "550 File not found");
+      } else {
+        removeFile(file);
+        reply(session, "250 Deleted");
+      }
+    } else if (strcasecmp(cmd, "MKD") == 0) {
+      if (find(par) != nullptr) {
+        reply(session, "550 Already exists");
+      } else {
+        createFile(par, true);
+        reply(session, "257 Created");
+      }
+    } else if (strcasecmp(cmd, "RMD") == 0) {
+      FTPLoopbackFile *file = find(par);
+      if (file == nullptr || !file->is_directory) {
+        reply(session, "550 Directory not found");
+      } else {
+        removeFile(file);
+        reply(session, "250 Removed");
+      }
+    } else if (strcasecmp(cmd, "SIZE") == 0 && (features & FEAT_SIZE)) {
+      FTPLoopbackFile *file = find(par);
+      if (file == nullptr || file->is_directory) {
+        reply(session, "550 File not found");
+      } else {
+        char size[21];
+        snprintf(msg, sizeof(msg), "213 %s",
+                 CStringFunctions::toStr(file->size, size));
+        reply(session, msg);
+      }
+    } else if (strcasecmp(cmd, "MDTM") == 0 && (features & FEAT_MDTM)) {
+      FTPLoopbackFile *file = find(par);
+      reply(session,
+            file == nullptr ? "550 File not found" : "213 20240101000000");
+    } else if (strcasecmp(cmd, "HASH") == 0 && (features & FEAT_HASH)) {
+      replyHash(session, par, session.hash, true);
+    } else if (strcasecmp(cmd, "XCRC") == 0 && (features & FEAT_XCRC)) {
+      replyHash(session, par, HASH_CRC32, false);
+    } else if (strcasecmp(cmd, "XMD5") == 0 && (features & FEAT_XMD5)) {
+      replyHash(session, par, HASH_MD5, false);
+    } else if (strcasecmp(cmd, "XSHA1") == 0 && (features & FEAT_XSHA1)) {
+      replyHash(session, par, HASH_SHA1, false);
+    } else if (strcasecmp(cmd, "ABOR") == 0) {
+      if (session.state != TRANSFER_NONE) {
+        endTransfer(session, "426 Transfer aborted");
+        reply(session, "226 Abort successful");
+      } else {
+        reply(session, "225 No transfer to abort");
+      }
+    } else if (strcasecmp(cmd, "QUIT") == 0) {
+      reply(session, "221 Goodbye");
+      session.control.close();
+      session.data.close();
+    } else {
+      reply(session, "502 Command not implemented");
+    }
+  }
+
+  static FTPHashAlgorithm hashAlgorithm(const char *name) {
+    for (int alg = HASH_CRC32; alg <= HASH_SHA1; alg++) {
+      if (strcasecmp(name, FTPChecksum::name((FTPHashAlgorithm)alg)) == 0) {
+        return (FTPHashAlgorithm)alg;
+      }
+    }
+    return HASH_NONE;
+  }
+
+  /// HASH: "213 SHA-1 0-size hash file", X commands: "250 hash"
+  void replyHash(Session &session, const char *path,
+                 FTPHashAlgorithm algorithm, bool isHash) {
+    FTPLoopbackFile *file = find(path);
+    if (file == nullptr || file->is_directory) {
+      reply(session, "550 File not found");
+      return;
+    }
+    FTPChecksum checksum(algorithm);
+    uint8_t buffer[FTP_TRANSFER_CHUNK_SIZE];
+    uint64_t pos = 0;
+    size_t len;
+    while ((len = file->get(pos, buffer, sizeof(buffer))) > 0) {
+      checksum.update(buffer, len);
+      pos += len;
+    }
+    char hex[2 * FTP_HASH_MAX_SIZE + 1];
+    char size[21];
+    char msg[FTP_MAX_LINE_SIZE + 80];
+    if (isHash) {
+      snprintf(msg, sizeof(msg), "213 %s 0-%s %s %s",
+               FTPChecksum::name(algorithm),
+               CStringFunctions::toStr(file->size, size), checksum.toHex(hex),
+               file->path);
+    } else {
+      snprintf(msg, sizeof(msg), "250 %s", checksum.toHex(hex));
+    }
+    reply(session, msg);
+  }
+
+  int nextDataPort() {
+    if (next_data_port > 65000) next_data_port = 50000;
+    return next_data_port++;
+  }
+
+  void listDirectory(Session &session, const char *path, bool isMLSD) {
+    char dir[FTP_MAX_LINE_SIZE];
+    normalize(path, dir);
+    FTPLoopbackFile *p_dir = find(dir);
+    if (p_dir == nullptr || !p_dir->is_directory) {
+      reply(session, "550 Directory not found");
+      return;
+    }
+    FTPLoopbackFile &listing = session.listing;
+    listing.truncate(0);
+    char line[FTP_MAX_LINE_SIZE + 80];
+    if (isMLSD) {
+      // like ProFTPD: the type is not the first fact and the name is the path
+      snprintf(line, sizeof(line), "modify=20240101000000;type=cdir; %s\r\n",
+               dir);
+      listing.append((const uint8_t *)line, strlen(line));
+    }
+    for (FTPLoopbackFile *file = p_files; file != nullptr; file = file->next) {
+      if (!isInDirectory(file->path, dir)) continue;
+      const char *name = strrchr(file->path, '/') + 1;
+      if (isMLSD) {
+        char size[21];
+        snprintf(line, sizeof(line),
+                 "type=%s;size=%s;modify=20240101000000; %s\r\n",
+                 file->is_directory ? "dir" : "file",
+                 CStringFunctions::toStr(file->size, size), name);
+      } else {
+        snprintf(line, sizeof(line), "%s\r\n", name);
+      }
+      listing.append((const uint8_t *)line, strlen(line));
+    }
+    startTransfer(session, &listing, TRANSFER_SEND, 0);
+  }
+
+  void startTransfer(Session &session, FTPLoopbackFile *file,
+                     TransferState state, uint64_t pos) {
+    if (!session.data && session.active_port > 0) connectActive(session);
+    if (!session.data) {
+      reply(session, "425 No data connection");
+      return;
+    }
+    reply(session, "150 Opening data connection");
+    session.p_file = file;
+    session.state = state;
+    session.pos = pos;
+    session.transferred = 0;
+    session.start_time = millis();
+    if (session.mode_z && state == TRANSFER_SEND) {
+      if (session.p_deflate == nullptr) session.p_deflate = new FTPDeflate();
+      session.deflate_out.p_pipe = &session.data.out();
+      session.p_deflate->begin(session.deflate_out);
+    } else if (session.mode_z) {
+      if (session.p_inflate == nullptr) session.p_inflate = new FTPInflate();
+      session.p_inflate->begin();
+    }
+  }
+
+  /// Opens the data connection to the address of PORT
+  void connectActive(Session &session) {
+    FTPLoopbackServer *other = find(session.active_address);
+    if (other != nullptr) {
+      session.data.p_connection = other->accept(session.active_port);
+      session.data.is_client = true;
+    }
+    session.active_port = 0;
+  }
+
+  void endTransfer(Session &session, const char *replyText) {
+    session.data.close();
+    session.p_file = nullptr;
+    session.state = TRANSFER_NONE;
+    if (replyText != nullptr) reply(session, replyText);
+  }
+
+  /// Number of bytes which can be transferred according to the bandwidth
+  size_t allowed(Session &session, size_t len) {
+    if (bandwidth == 0) return len;
+    uint64_t budget = (uint64_t)bandwidth * (millis() - session.start_time) /
+                          1000 +
+                      FTP_TRANSFER_CHUNK_SIZE;
+    if (session.transferred >= budget) return 0;
+    if (budget - session.transferred < len) {
+      len = budget - session.transferred;
+    }
+    return len;
+  }
+
+  void processTransfer(Session &session) {
+    if (session.mode_z && session.state == TRANSFER_SEND) {
+      sendCompressed(session);
+      return;
+    } else if (session.mode_z && session.state == TRANSFER_RECEIVE) {
+      receiveCompressed(session);
+      return;
+    }
+    uint8_t buffer[FTP_TRANSFER_CHUNK_SIZE];
+    if (session.state == TRANSFER_SEND) {
+      if (!session.data.isPeerOpen()) {
+        endTransfer(session, "426 Connection closed");
+        return;
+      }
+      // limit the data in flight like the TCP window
+      while (session.data.out().size() < FTP_LOOPBACK_WINDOW) {
+        size_t len = allowed(session, sizeof(buffer));
+        len = session.p_file->get(session.pos, buffer, len);
+        if (len == 0) break;
+        session.data.out().write(buffer, len);
+        session.pos += len;
+        session.transferred += len;
+      }
+      if (session.pos >= session.p_file->size) {
+        endTransfer(session, "226 Transfer complete");
+      }
+    } else if (session.state == TRANSFER_RECEIVE) {
+      while (true) {
+        size_t len = allowed(session, sizeof(buffer));
+        if (len == 0) break;
+        len = session.data.in().read(buffer, len);
+        if (len == 0) break;
+        session.p_file->append(buffer, len);
+        session.transferred += len;
+      }
+      if (!session.data.isPeerOpen() && session.data.in().size() == 0) {
+        endTransfer(session, "226 Transfer complete");
+      }
+    }
+  }
+
+  /// MODE Z download: the bandwidth limits the compressed data
+  void sendCompressed(Session &session) {
+    uint8_t buffer[FTP_TRANSFER_CHUNK_SIZE];
+    if (!session.data.isPeerOpen()) {
+      endTransfer(session, "426 Connection closed");
+      return;
+    }
+    FTPDeflate &deflate = *session.p_deflate;
+    while (session.data.out().size() < FTP_LOOPBACK_WINDOW &&
+           allowed(session, 1) > 0) {
+      size_t len = session.p_file->get(session.pos, buffer, sizeof(buffer));
+      if (len == 0) break;
+      uint64_t out = deflate.totalOut();
+      deflate.write(buffer, len);
+      deflate.flush();
+      session.pos += len;
+      session.transferred += deflate.totalOut() - out;
+    }
+    if (session.pos >= session.p_file->size) {
+      deflate.end();
+      endTransfer(session, "226 Transfer complete");
+    }
+  }
+
+  /// MODE Z upload: the bandwidth limits the compressed data
+  void receiveCompressed(Session &session) {
+    uint8_t buffer[FTP_TRANSFER_CHUNK_SIZE];
+    FTPInflate &inflate = *session.p_inflate;
+    while (true) {
+      size_t len = inflate.read(buffer, sizeof(buffer));
+      if (len > 0) {
+        session.p_file->append(buffer, len);
+        continue;
+      }
+      if (!inflate.needsInput()) break;
+      size_t space;
+      uint8_t *input = inflate.inputBuffer(space);
+      space = allowed(session, space);
+      if (space == 0) break;
+      len = session.data.in().read(input, space);
+      if (len == 0) break;
+      inflate.addInput(len);
+      session.transferred += len;
+    }
+    if (inflate.isError()) {
+      endTransfer(session, "451 Invalid compressed data");
+    } else if (!session.data.isPeerOpen() && session.data.in().size() == 0) {
+      endTransfer(session, inflate.isDone() ? "226 Transfer complete"
+                                            : "451 Incomplete compressed data");
+    }
+  }
+};
+
+/**
+ * @brief FTPLoopbackClient
+ * Client which connects to a FTPLoopbackServer in the same process: it can
+ * be used as ClientType of the FTPClient e.g.
+ * FTPClient<FTPLoopbackClient> client;
+ * @author Phil Schatzmann
+ */
+class FTPLoopbackClient : public Client {
+ public:
+  FTPLoopbackClient() = default;
+  FTPLoopbackClient(const FTPLoopbackClient &) = delete;
+  FTPLoopbackClient &operator=(const FTPLoopbackClient &) = delete;
+  ~FTPLoopbackClient() { stop(); }
+
+  int connect(IPAddress ip, uint16_t port) override {
+    stop();
+    p_server = FTPLoopbackServer::find(ip);
+    if (p_server == nullptr) return 0;
+    end.p_connection = p_server->accept(port);
+    end.is_client = true;
+    return end ? 1 : 0;
+  }
+
+  int connect(const char *host, uint16_t port) override {
+    int values[4] = {0};
+    int idx = 0;
+    for (const char *p = host; *p != '\0'; p++) {
+      if (*p == '.') {
+        if (++idx > 3) return 0;
+      } else if (*p >= '0' && *p <= '9') {
+        values[idx] = values[idx] * 10 + (*p - '0');
+      } else {
+        return 0;
+      }
+    }
+    if (idx != 3) return 0;
+    return connect(IPAddress(values[0], values[1], values[2], values[3]),
+                   port);
+  }
+
+  size_t write(uint8_t c) override { return write(&c, 1); }
+
+  size_t write(const uint8_t *data, size_t len) override {
+    if (p_server != nullptr && len > 0) p_server->countWrite();
+    size_t result = 0;
+    while (result < len && end && end.isPeerOpen()) {
+      // wait for the server if too much data is in flight
+      if (end.out().size() >= FTP_LOOPBACK_WINDOW) {
+        p_server->loop();
+        if (end && end.out().size() >= FTP_LOOPBACK_WINDOW) delay(1);
+        continue;
+      }
+      size_t n = FTP_LOOPBACK_WINDOW - end.out().size();
+      if (n > len - result) n = len - result;
+      result += end.out().write(data + result, n);
+    }
+    if (p_server != nullptr) p_server->loop();
+    return result;
+  }
+
+  int available() override {
+    if (!end) return 0;
+    p_server->loop();
+    return end ? end.in().available() : 0;
+  }
+
+  int read() override {
+    uint8_t c;
+    return read(&c, 1) == 1 ? c : -1;
+  }
+
+  int read(uint8_t *data, size_t len) override {
+    if (available() <= 0) return -1;
+    return end.in().read(data, len);
+  }
+
+  int peek() override { return available() > 0 ? end.in().peek() : -1; }
+
+  void flush() override {}
+
+  void stop() override {
+    if (end) {
+      end.close();
+      p_server->loop();
+    }
+  }
+
+  uint8_t connected() override {
+    if (!end) return 0;
+    p_server->loop();
+    return end && (end.isPeerOpen() || end.in().available() > 0);
+  }
+
+  operator bool() override { return connected(); }
+
+ protected:
+  FTPLoopbackServer *p_server = nullptr;
+  FTPLoopbackEnd end;
+};
+
+}  // namespace ftp_client
@@ -0,0 +1,204 @@
+#pragma once
+
+#include "Arduino.h"
+#include "FTPCommon.h"
+#include "FTPLogger.h"
+
+namespace ftp_client {
+
+/**
+ * @brief FTPMetadataCache
+ * Keeps the size, type and modification time of the recently used remote
+ * files, so that repeated SIZE and MDTM requests for the same file can be
+ * answered from memory. The number of entries is limited: when the cache is
+ * full the least recently used entry is replaced. Entries expire after the
+ * TTL. The paths are normalized (duplicate and trailing '/' are removed), so
+ * that the entries of a listing are found with the path of the file.
+ * @author Phil Schatzmann
+ */
+class FTPMetadataCache {
+ public:
+  ~FTPMetadataCache() { end(); }
+
+  /// Activates the cache with the indicated max number of entries (0 =
+  /// inactive) and time to live in ms
+  void begin(int maxEntries, unsigned long ttlMs) {
+    end();
+    ttl_ms = ttlMs;
+    if (maxEntries <= 0) return;
+    entries = new Entry[maxEntries];
+    max_entries = maxEntries;
+  }
+
+  /// Releases all memory
+  void end() {
+    clear();
+    delete[] entries;
+    entries = nullptr;
+    max_entries = 0;
+  }
+
+  /// Returns true if the cache is active
+  bool isActive() { return max_entries > 0; }
+
+  /// Provides the cached information of the file: returns false if the file
+  /// is not cached or the entry has expired
+  bool get(const char *path, FTPFileInfo &info) {
+    if (!isActive() || path == nullptr) return false;
+    char key[FTP_MAX_LINE_SIZE];
+    normalize(nullptr, path, key);
+    int idx = find(key, hash(key));
+    if (idx < 0) return false;
+    Entry &entry = entries[idx];
+    if (millis() - entry.time > ttl_ms) {
+      remove(idx);
+      return false;
+    }
+    // move to the front to keep the order of the last use
+    unlink(idx);
+    pushFront(idx);
+    info.name = entry.path;
+    info.size = entry.size;
+    info.type = entry.type;
+    strcpy(info.modify, entry.modify);
+    info.perm[0] = '\0';
+    return true;
+  }
+
+  /// Stores the information of the file
+  void put(const char *path, const FTPFileInfo &info) {
+    put(nullptr, path, info);
+  }
+
+  /// Stores the information of a file of a directory listing
+  void put(const char *dir, const char *name, const FTPFileInfo &info) {
+    if (!isActive() || name == nullptr) return;
+    char key[FTP_MAX_LINE_SIZE];
+    normalize(dir, name, key);
+    uint32_t key_hash = hash(key);
+    int idx = find(key, key_hash);
+    if (idx >= 0) {
+      unlink(idx);
+    } else {
+      idx = newEntry();
+      Entry &entry = entries[idx];
+      entry.path = new char[strlen(key) + 1];
+      strcpy(entry.path, key);
+      entry.hash = key_hash;
+      count++;
+    }
+    Entry &entry = entries[idx];
+    entry.size = info.size;
+    entry.type = info.type;
+    strcpy(entry.modify, info.modify);
+    entry.time = millis();
+    pushFront(idx);
+  }
+
+  /// Removes the information of the file
+  void invalidate(const char *path) {
+    if (!isActive() || path == nullptr) return;
+    char key[FTP_MAX_LINE_SIZE];
+    normalize(nullptr, path, key);
+    int idx = find(key, hash(key));
+    if (idx >= 0) remove(idx);
+  }
+
+  /// Removes all entries
+  void clear() {
+    while (head >= 0) remove(head);
+  }
+
+  /// Provides the number of cached files
+  int size() { return count; }
+
+ protected:
+  struct Entry {
+    ~Entry() { delete[] path; }
+    char *path = nullptr;
+    uint32_t hash = 0;
+    uint64_t size = 0;
+    ObjectType type = TypeUndefined;
+    char modify[15] = {0};
+    unsigned long time = 0;
+    int prev = -1;
+    int next = -1;
+  };
+  Entry *entries = nullptr;
+  int max_entries = 0;
+  int count = 0;
+  int head = -1;
+  int tail = -1;
+  unsigned long ttl_ms = FTP_METADATA_CACHE_TTL_MS;
+
+  /// FNV-1a hash of the normalized path
+  static uint32_t hash(const char *path) {
+    uint32_t result = 2166136261u;
+    for (const char *p = path; *p != '\0'; p++) {
+      result = (result ^ (uint8_t)*p) * 16777619u;
+    }
+    return result;
+  }
+
+  /// Joins the directory and the name into a path of max FTP_MAX_LINE_SIZE
+  /// characters without duplicate or trailing '/'
+  static void normalize(const char *dir, const char *name, char *result) {
+    int len = 0;
+    const char *parts[] = {dir, "/", name};
+    for (int j = dir == nullptr ? 2 : 0; j < 3; j++) {
+      for (const char *p = parts[j]; *p != '\0'; p++) {
+        if (len >= FTP_MAX_LINE_SIZE - 1) break;
+        if (*p == '/' && len > 0 && result[len - 1] == '/') continue;
+        result[len++] = *p;
+      }
+    }
+    if (len > 1 && result[len - 1] == '/') len--;
+    result[len] = '\0';
+  }
+
+  int find(const char *path, uint32_t key) {
+    for (int idx = head; idx >= 0; idx = entries[idx].next) {
+      if (entries[idx].hash == key && strcmp(entries[idx].path, path) == 0) {
+        return idx;
+      }
+    }
+    return -1;
+  }
+
+  /// Provides an unused entry or the least recently used one
+  int newEntry() {
+    if (count == max_entries) remove(tail);
+    for (int idx = 0; idx < max_entries; idx++) {
+      if (entries[idx].path == nullptr) return idx;
+    }
+    return -1;
+  }
+
+  void pushFront(int idx) {
+    Entry &entry = entries[idx];
+    entry.prev = -1;
+    entry.next = head;
+    if (head >= 0) entries[head].prev = idx;
+    head = idx;
+    if (tail < 0) tail = idx;
+  }
+
+  void unlink(int idx) {
+    Entry &entry = entries[idx];
+    if (entry.prev >= 0) entries[entry.prev].next = entry.next;
+    if (entry.next >= 0) entries[entry.next].prev = entry.prev;
+    if (head == idx) head = entry.next;
+    if (tail == idx) tail = entry.prev;
+    entry.prev = -1;
+    entry.next = -1;
+  }
+
+  void remove(int idx) {
+    unlink(idx);
+    delete[] entries[idx].path;
+    entries[idx].path = nullptr;
+    count--;
+  }
+};
+
+}  // namespace ftp_client
@@ -0,0 +1,503 @@
+#pragma once
+
+#include "Arduino.h"
+#include "FTPLocalFS.h"
+#include "FTPSessionMgr.h"
+#include "FTPTransferQueue.h"
+
+namespace ftp_client {
+
+/// Direction of a FTPMirror
+enum FTPMirrorDirection {
+  /// the remote directory is updated from the local one
+  MIRROR_UPLOAD,
+  /// the local directory is updated from the remote one
+  MIRROR_DOWNLOAD
+};
+
+/**
+ * @brief FTPMirrorResult
+ * Counters of a FTPMirror run
+ */
+struct FTPMirrorResult {
+  /// files which were compared
+  int files_checked = 0;
+  /// files which were new or changed and have been transferred
+  int files_transferred = 0;
+  int files_failed = 0;
+  int dirs_created = 0;
+  uint64_t bytes = 0;
+};
+
+/**
+ * @brief FTPMirror
+ * Recursive synchronization of a local directory and a remote directory in
+ * either direction: only new files and files with a different size or a
+ * newer modification time are transferred. The remote directories are
+ * listed with MLSD (or NLST followed by pipelined SIZE and MDTM), the
+ * missing remote directories are created with pipelined MKD commands and
+ * the files are transferred concurrently over up to setMaxSessions()
+ * sessions of the FTPSessionMgr. Files which only exist in the target are
+ * not deleted.
+ * @tparam ClientType The type of client to use for command and data
+ * connections.
+ * @tparam N The max number of sessions of the FTPSessionMgr
+ * @author Phil Schatzmann
+ */
+template <class ClientType, int N = FTP_MAX_SESSIONS>
+class FTPMirror {
+ public:
+  FTPMirror(FTPSessionMgr<ClientType, N> &mgr, FTPLocalFS &fs) {
+    p_mgr = &mgr;
+    p_fs = &fs;
+  }
+
+  ~FTPMirror() { clear(); }
+
+  /// Defines the max number of concurrent transfers
+  void setMaxSessions(int count) {
+    max_sessions = count < 1 ? 1 : count > N ? N : count;
+  }
+
+  /// Defines if the modification times are compared: otherwise only new
+  /// files and files with a different size are transferred
+  void setCompareTime(bool flag) { compare_time = flag; }
+
+  /// Defines a callback which is called when a file has been transferred
+  void setCallback(void (*cb)(FTPTransferJob &job, void *ref),
+                   void *ref = nullptr) {
+    p_callback = cb;
+    p_callback_ref = ref;
+  }
+
+  /// Synchronizes the directories: returns true if all changed files have
+  /// been transferred
+  bool mirror(const char *localDir, const char *remoteDir,
+              FTPMirrorDirection direction) {
+    FTPLogger::writeLog(LOG_INFO, "FTPMirror", remoteDir);
+    clear();
+    result = FTPMirrorResult();
+    bool ok = direction == MIRROR_UPLOAD
+                  ? walkUpload(localDir, remoteDir, true)
+                  : walkDownload(localDir, remoteDir);
+    ok = createRemoteDirs() && ok;
+    ok = transfer() && ok;
+    clear();
+    return ok && result.files_failed == 0;
+  }
+
+  /// Provides the counters of the last mirror()
+  const FTPMirrorResult &lastResult() { return result; }
+
+ protected:
+  /// Entry of a remote directory
+  struct RemoteEntry {
+    FTPFileInfo info;
+    RemoteEntry *next = nullptr;
+  };
+  /// File which needs to be transferred
+  struct Item {
+    FTPTransferJob job;
+    char *local_path = nullptr;
+    char *remote_path = nullptr;
+    char modify[15] = {0};
+    Stream *p_local = nullptr;
+    Item *next = nullptr;
+  };
+  /// Directory which needs to be created or processed
+  struct Dir {
+    char *path = nullptr;
+    char *remote_path = nullptr;
+    bool exists = true;
+    Dir *next = nullptr;
+  };
+  /// State of the comparison of a directory
+  struct Context {
+    FTPMirror *self;
+    const char *local_dir;
+    const char *remote_dir;
+    RemoteEntry *p_remote;
+    Dir *p_subdirs;
+  };
+  FTPSessionMgr<ClientType, N> *p_mgr = nullptr;
+  FTPLocalFS *p_fs = nullptr;
+  int max_sessions = 4;
+  bool compare_time = true;
+  FTPMirrorResult result;
+  Item *p_items = nullptr;
+  Item *p_items_tail = nullptr;
+  Dir *p_mkdirs = nullptr;
+  Dir *p_mkdirs_tail = nullptr;
+  int active = 0;
+  void (*p_callback)(FTPTransferJob &job, void *ref) = nullptr;
+  void *p_callback_ref = nullptr;
+
+  /// Compares the local directory with the remote directory (which does
+  /// not need to be listed if it does not exist yet): a missing remote
+  /// directory is created with the other missing directories
+  bool walkUpload(const char *localDir, const char *remoteDir,
+                  bool remoteExists) {
+    Context ctx{this, localDir, remoteDir, nullptr, nullptr};
+    bool missing = false;
+    bool ok = !remoteExists || listRemote(remoteDir, ctx.p_remote, &missing);
+    if (missing) addRemoteDir(remoteDir);
+    if (ok && !p_fs->list(localDir, uploadCallback, &ctx)) {
+      FTPLogger::writeLog(LOG_ERROR, "FTPMirror", localDir);
+      ok = false;
+    }
+    freeRemote(ctx.p_remote);
+    // process the subdirectories
+    while (ctx.p_subdirs != nullptr) {
+      Dir *dir = ctx.p_subdirs;
+      ctx.p_subdirs = dir->next;
+      if (ok) ok = walkUpload(dir->path, dir->remote_path, dir->exists);
+      freeDir(dir);
+    }
+    return ok;
+  }
+
+  static void uploadCallback(const FTPFileInfo &local, void *ref) {
+    Context &ctx = *(Context *)ref;
+    FTPMirror &self = *ctx.self;
+    RemoteEntry *remote = find(ctx.p_remote, local.name);
+    char *local_path = join(ctx.local_dir, local.name);
+    char *remote_path = join(ctx.remote_dir, local.name);
+    if (local.type == TypeDirectory) {
+      bool exists = remote != nullptr && remote->info.type == TypeDirectory;
+      if (!exists) self.addRemoteDir(remote_path);
+      self.addSubdir(ctx, local_path, remote_path, exists);
+      return;
+    }
+    self.result.files_checked++;
+    if (remote == nullptr || self.isChanged(local, remote->info)) {
+      self.addItem(local_path, remote_path, WRITE_MODE, local.modify);
+    } else {
+      free(local_path);
+      free(remote_path);
+    }
+  }
+
+  /// Compares the remote directory with the local directory
+  bool walkDownload(const char *localDir, const char *remoteDir) {
+    RemoteEntry *p_remote = nullptr;
+    if (!listRemote(remoteDir, p_remote)) return false;
+    Context ctx{this, localDir, remoteDir, p_remote, nullptr};
+    for (RemoteEntry *entry = p_remote; entry != nullptr; entry = entry->next) {
+      const FTPFileInfo &remote = entry->info;
+      char *local_path = join(localDir, remote.name);
+      char *remote_path = join(remoteDir, remote.name);
+      FTPFileInfo local;
+      bool exists = p_fs->info(local_path, local);
+      if (remote.type == TypeDirectory) {
+        if (!exists) {
+          if (p_fs->mkdir(local_path)) {
+            result.dirs_created++;
+          } else {
+            FTPLogger::writeLog(LOG_ERROR, "FTPMirror", local_path);
+          }
+        }
+        addSubdir(ctx, local_path, remote_path, true);
+        continue;
+      }
+      result.files_checked++;
+      if (!exists || isChanged(remote, local)) {
+        addItem(local_path, remote_path, READ_MODE, remote.modify);
+      } else {
+        free(local_path);
+        free(remote_path);
+      }
+    }
+    freeRemote(p_remote);
+    bool ok = true;
+    while (ctx.p_subdirs != nullptr) {
+      Dir *dir = ctx.p_subdirs;
+      ctx.p_subdirs = dir->next;
+      if (ok) ok = walkDownload(dir->path, dir->remote_path);
+      freeDir(dir);
+    }
+    return ok;
+  }
+
+  /// Returns true if the source needs to be copied to the target
+  bool isChanged(const FTPFileInfo &source, const FTPFileInfo &target) {
+    if (source.size != target.size) return true;
+    if (!compare_time || source.modify[0] == '\0' ||
+        target.modify[0] == '\0') {
+      return false;
+    }
+    return strcmp(source.modify, target.modify) > 0;
+  }
+
+  /// Lists the remote directory with the type, size and modification time:
+  /// if p_missing is defined, a directory which does not exist is reported
+  /// there and provides an empty listing
+  bool listRemote(const char *dir, RemoteEntry *&result,
+                  bool *p_missing = nullptr) {
+    FTPSessionLease<ClientType, N> lease = p_mgr->acquire();
+    if (!lease) return false;
+    FTPBasicAPI &api = lease.api();
+    bool is_mlsd = api.hasFeature(FEAT_MLST);
+    if (!api.passv()) return false;
+    api.ls(dir, is_mlsd ? LIST_MLSD : LIST_NLST);
+    int code = api.reply().code();
+    if (code != 150 && code != 125) {
+      api.closeData();
+      api.setCurrentOperation(NOP);
+      if (p_missing != nullptr && (code == 550 || code == 450)) {
+        FTPLogger::writeLog(LOG_INFO, "FTPMirror", "missing directory");
+        *p_missing = true;
+        return true;
+      }
+      FTPLogger::writeLog(LOG_ERROR, "FTPMirror", dir);
+      return false;
+    }
+    RemoteEntry *tail = nullptr;
+    char line[FTP_MAX_LINE_SIZE];
+    while (readLine(api, line, sizeof(line))) {
+      FTPFileInfo info;
+      if (is_mlsd) {
+        if (!FTPBasicAPI::parseMLSD(line, info)) continue;
+        // skip the cdir and pdir entries (which may repeat the full path)
+        if (info.type != TypeFile && info.type != TypeDirectory) continue;
+        if (api.metadataCache() != nullptr) {
+          api.metadataCache()->put(dir, info.name, info);
+        }
+      } else {
+        // some servers provide the path
+        const char *last = strrchr(line, '/');
+        info.name = last != nullptr ? last + 1 : line;
+      }
+      if (info.name[0] == '\0' || strcmp(info.name, ".") == 0 ||
+          strcmp(info.name, "..") == 0) {
+        continue;
+      }
+      RemoteEntry *entry = new RemoteEntry();
+      entry->info = info;
+      entry->info.name = strdup(info.name);
+      if (tail == nullptr) {
+        result = entry;
+      } else {
+        tail->next = entry;
+      }
+      tail = entry;
+    }
+    api.closeData();
+    api.setCurrentOperation(NOP);
+    const char *ok[] = {"226", "250", nullptr};
+    if (!api.checkResult(ok, "mirror-ls", true)) return false;
+    return is_mlsd || statRemote(api, dir, result);
+  }
+
+  /// Determines the type, size and modification time of the NLST entries
+  /// with pipelined SIZE and MDTM commands
+  bool statRemote(FTPBasicAPI &api, const char *dir, RemoteEntry *entries) {
+    const int batch = 16;
+    const char *paths[batch];
+    FTPFileInfo infos[batch];
+    RemoteEntry *first = entries;
+    while (first != nullptr) {
+      int count = 0;
+      RemoteEntry *entry = first;
+      for (; entry != nullptr && count < batch; entry = entry->next) {
+        paths[count++] = join(dir, entry->info.name);
+      }
+      bool ok = api.stat(paths, count, infos);
+      for (int j = 0; j < count; j++) {
+        free((void *)paths[j]);
+        if (!ok) continue;
+        first->info.type = infos[j].type;
+        first->info.size = infos[j].size;
+        strcpy(first->info.modify, infos[j].modify);
+        first = first->next;
+      }
+      if (!ok) return false;
+    }
+    return true;
+  }
+
+  /// Reads a line of the listing: returns false at the end
+  bool readLine(FTPBasicAPI &api, char *line, int size) {
+    Client *data = api.dataClient();
+    int len = 0;
+    unsigned long start = millis();
+    while (true) {
+      if (data->available() > 0) {
+        int c = data->read();
+        api.countReceived(1);
+        start = millis();
+        if (c == '\n') break;
+        if (len < size - 1) line[len++] = c;
+      } else if (!data->connected() || api.isReplyOverdue(start)) {
+        if (len == 0) return false;
+        break;
+      } else {
+        delay(FTP_POLL_DELAY_MS);
+      }
+    }
+    if (len > 0 && line[len - 1] == '\r') len--;
+    line[len] = '\0';
+    return true;
+  }
+
+  /// Creates the missing remote directories with pipelined MKD commands
+  bool createRemoteDirs() {
+    if (p_mkdirs == nullptr) return true;
+    FTPSessionLease<ClientType, N> lease = p_mgr->acquire();
+    if (!lease) return false;
+    const int batch = FTP_PIPELINE_DEPTH;
+    const char *paths[batch];
+    bool ok = true;
+    Dir *dir = p_mkdirs;
+    while (dir != nullptr) {
+      int count = 0;
+      for (; dir != nullptr && count < batch; dir = dir->next) {
+        paths[count++] = dir->remote_path;
+      }
+      int created = lease.api().mkdirs(paths, count);
+      result.dirs_created += created;
+      if (created != count) ok = false;
+    }
+    return ok;
+  }
+
+  /// Transfers the changed files concurrently: the local files are only
+  /// opened when the transfer starts
+  bool transfer() {
+    FTPTransferQueue<ClientType, N> queue(*p_mgr);
+    queue.setMaxSessions(max_sessions);
+    queue.setCallback(transferCallback, this);
+    Item *next = p_items;
+    active = 0;
+    while (true) {
+      while (next != nullptr && active < max_sessions) {
+        Item &item = *next;
+        next = next->next;
+        FileMode local_mode = item.job.mode == READ_MODE ? WRITE_MODE
+                                                         : READ_MODE;
+        item.p_local = p_fs->open(item.local_path, local_mode);
+        if (item.p_local == nullptr) {
+          FTPLogger::writeLog(LOG_ERROR, "FTPMirror", item.local_path);
+          result.files_failed++;
+          continue;
+        }
+        item.job.local = item.p_local;
+        queue.add(item.job);
+        active++;
+      }
+      if (!queue.loop() && next == nullptr) break;
+      delay(FTP_POLL_DELAY_MS);
+    }
+    return result.files_failed == 0;
+  }
+
+  static void transferCallback(FTPTransferJob &job, void *ref) {
+    FTPMirror &self = *(FTPMirror *)ref;
+    Item &item = *(Item *)job.ref;
+    self.p_fs->close(item.p_local);
+    item.p_local = nullptr;
+    self.active--;
+    if (job.status == TRANSFER_DONE) {
+      self.result.files_transferred++;
+      self.result.bytes += job.bytes;
+      if (job.mode == READ_MODE && item.modify[0] != '\0') {
+        self.p_fs->setModified(item.local_path, item.modify);
+      }
+    } else {
+      self.result.files_failed++;
+    }
+    if (self.p_callback != nullptr) self.p_callback(job, self.p_callback_ref);
+  }
+
+  void addItem(char *localPath, char *remotePath, FileMode mode,
+               const char *modify) {
+    Item *item = new Item();
+    item->local_path = localPath;
+    item->remote_path = remotePath;
+    strncpy(item->modify, modify, sizeof(item->modify) - 1);
+    item->job.remote_path = remotePath;
+    item->job.mode = mode;
+    item->job.ref = item;
+    if (p_items_tail == nullptr) {
+      p_items = item;
+    } else {
+      p_items_tail->next = item;
+    }
+    p_items_tail = item;
+  }
+
+  /// Adds a missing remote directory: the parents are added first
+  void addRemoteDir(const char *remotePath) {
+    Dir *dir = new Dir();
+    dir->remote_path = strdup(remotePath);
+    if (p_mkdirs_tail == nullptr) {
+      p_mkdirs = dir;
+    } else {
+      p_mkdirs_tail->next = dir;
+    }
+    p_mkdirs_tail = dir;
+  }
+
+  void addSubdir(Context &ctx, char *localPath, char *remotePath,
+                 bool exists) {
+    Dir *dir = new Dir();
+    dir->path = localPath;
+    dir->remote_path = remotePath;
+    dir->exists = exists;
+    dir->next = ctx.p_subdirs;
+    ctx.p_subdirs = dir;
+  }
+
+  static RemoteEntry *find(RemoteEntry *entries, const char *name) {
+    for (RemoteEntry *entry = entries; entry != nullptr; entry = entry->next) {
+      if (strcmp(entry->info.name, name) == 0) return entry;
+    }
+    return nullptr;
+  }
+
+  /// Provides the path of the entry of the directory: to be freed
+  static char *join(const char *dir, const char *name) {
+    size_t dir_len = strlen(dir);
+    if (dir_len > 0 && dir[dir_len - 1] == '/') dir_len--;
+    size_t len = dir_len + strlen(name) + 2;
+    char *result = (char *)malloc(len);
+    memcpy(result, dir, dir_len);
+    result[dir_len] = '/';
+    strcpy(result + dir_len + 1, name);
+    return result;
+  }
+
+  static void freeRemote(RemoteEntry *entry) {
+    while (entry != nullptr) {
+      RemoteEntry *next = entry->next;
+      free((void *)entry->info.name);
+      delete entry;
+      entry = next;
+    }
+  }
+
+  static void freeDir(Dir *dir) {
+    free(dir->path);
+    free(dir->remote_path);
+    delete dir;
+  }
+
+  void clear() {
+    while (p_items != nullptr) {
+      Item *next = p_items->next;
+      if (p_items->p_local != nullptr) p_fs->close(p_items->p_local);
+      free(p_items->local_path);
+      free(p_items->remote_path);
+      delete p_items;
+      p_items = next;
+    }
+    while (p_mkdirs != nullptr) {
+      Dir *next = p_mkdirs->next;
+      freeDir(p_mkdirs);
+      p_mkdirs = next;
+    }
+    p_items_tail = nullptr;
+    p_mkdirs_tail = nullptr;
+  }
+};
+
+}  // namespace ftp_client
@@ -0,0 +1,119 @@
+#pragma once
+
+#include "Arduino.h"
+#include "FTPCommon.h"
+#include "Stream.h"
+
+namespace ftp_client {
+
+/**
+ * @brief FTPReplyParser
+ * Incremental, non blocking parser for the replies on the FTP command
+ * connection. The characters are fed as they arrive and the reply is complete
+ * as soon as the final "xyz " line has been received. Multi-line replies
+ * (RFC 959: "xyz-" ... "xyz ") are supported: the intermediate lines can be
+ * processed with a line callback and the final line is available with line().
+ * @author Phil Schatzmann
+ */
+class FTPReplyParser {
+ public:
+  FTPReplyParser() { reset(); }
+
+  /// Prepares the parser for the next reply
+  void reset() {
+    line_len = 0;
+    line_buffer[0] = '\0';
+    reply_code = 0;
+    multi_line_code = 0;
+    is_complete = false;
+  }
+
+  /// Defines a callback which is called for each received line
+  void setLineCallback(void (*cb)(const char *line, void *ref),
+                       void *ref = nullptr) {
+    line_cb = cb;
+    line_cb_ref = ref;
+  }
+
+  /// Processes a single character: returns true if the reply is complete
+  bool write(char c) {
+    if (is_complete) return true;
+    if (c == '\n') {
+      endOfLine();
+    } else if (c != '\r' && c != 0) {
+      // truncate lines which are too long
+      if (line_len < FTP_RESULT_BUFFER_SIZE - 1) {
+        line_buffer[line_len++] = c;
+      }
+    }
+    return is_complete;
+  }
+
+  /// Processes the available characters of the stream without blocking: we
+  /// stop at the end of the reply so that any subsequent replies are kept in
+  /// the stream
+  bool readFrom(Stream &in) {
+    while (!is_complete && in.available() > 0) {
+      int c = in.read();
+      if (c < 0) break;
+      write((char)c);
+    }
+    return is_complete;
+  }
+
+  /// Returns true if the final line of the reply has been received
+  bool isComplete() { return is_complete; }
+
+  /// Returns the 3 digit reply code (or 0 if not available)
+  int code() { return reply_code; }
+
+  /// Returns the last received line
+  const char *line() { return line_buffer; }
+
+ protected:
+  char line_buffer[FTP_RESULT_BUFFER_SIZE];
+  int line_len = 0;
+  int reply_code = 0;
+  int multi_line_code = 0;
+  bool is_complete = false;
+  void (*line_cb)(const char *line, void *ref) = nullptr;
+  void *line_cb_ref = nullptr;
+
+  void endOfLine() {
+    line_buffer[line_len] = '\0';
+    // ignore empty lines
+    if (line_len == 0) return;
+    if (line_cb != nullptr) line_cb(line_buffer, line_cb_ref);
+
+    int code = lineCode();
+    char separator = line_len > 3 ? line_buffer[3] : ' ';
+    if (multi_line_code == 0) {
+      if (code > 0 && separator == '-') {
+        // first line of a multi-line reply
+        multi_line_code = code;
+      } else if (code > 0) {
+        reply_code = code;
+        is_complete = true;
+      }
+    } else if (code == multi_line_code && separator != '-') {
+      // final line of a multi-line reply
+      reply_code = code;
+      is_complete = true;
+    }
+    if (!is_complete) line_len = 0;
+  }
+
+  /// Determines the reply code at the start of the line
+  int lineCode() {
+    if (line_len < 3) return 0;
+    int result = 0;
+    for (int j = 0; j < 3; j++) {
+      char c = line_buffer[j];
+      if (c < '0' || c > '9') return 0;
+      result = result * 10 + (c - '0');
+    }
+    return result;
+  }
+};
+
+}  // namespace ftp_client
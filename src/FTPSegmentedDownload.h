@@ -0,0 +1,270 @@
+#pragma once
+
+#include "Arduino.h"
+#include "FTPSessionMgr.h"
+#include "Stream.h"
+
+namespace ftp_client {
+
+/// Callback which receives the data of a segmented download at the indicated
+/// position of the file: it returns the number of processed bytes
+typedef size_t (*FTPPositionalWriter)(uint64_t pos, const uint8_t *data,
+                                      size_t len, void *ref);
+
+/**
+ * @brief FTPSegmentedDownload
+ * Downloads a file by splitting it into byte ranges which are requested with
+ * REST + RETR over separate sessions of the FTPSessionMgr. The ranges are
+ * received in parallel and the data is provided either to a positional
+ * writer callback or in the correct order to a Stream: for the Stream the
+ * ranges which are ahead are buffered (FTP_SEGMENT_BUFFER_SIZE bytes per
+ * range).
+ * @tparam ClientType The type of client to use for command and data
+ * connections.
+ * @tparam N The max number of sessions of the FTPSessionMgr
+ * @author Phil Schatzmann
+ */
+template <class ClientType, int N = FTP_MAX_SESSIONS>
+class FTPSegmentedDownload {
+ public:
+  FTPSegmentedDownload(FTPSessionMgr<ClientType, N> &mgr) { p_mgr = &mgr; }
+
+  ~FTPSegmentedDownload() { cleanup(); }
+
+  /// Defines the number of parallel ranges (max FTP_MAX_SEGMENTS)
+  void setSegments(int count) {
+    segment_count = count < 1 ? 1
+                    : count > FTP_MAX_SEGMENTS ? FTP_MAX_SEGMENTS
+                                               : count;
+  }
+
+  /// Downloads the file and provides the data with the position
+  bool download(const char *file_name, FTPPositionalWriter writer,
+                void *ref = nullptr) {
+    p_writer = writer;
+    p_writer_ref = ref;
+    p_out = nullptr;
+    return process(file_name);
+  }
+
+  /// Downloads the file and writes the data in sequence to the Stream
+  bool download(const char *file_name, Stream &out) {
+    p_writer = nullptr;
+    p_out = &out;
+    return process(file_name);
+  }
+
+ protected:
+  struct Segment {
+    FTPSessionLease<ClientType, N> lease;
+    uint64_t start = 0;
+    uint64_t length = 0;
+    uint64_t received = 0;
+    uint64_t written = 0;
+    uint8_t *buffer = nullptr;
+    size_t buffer_len = 0;
+    bool is_active = false;
+  };
+  FTPSessionMgr<ClientType, N> *p_mgr = nullptr;
+  FTPPositionalWriter p_writer = nullptr;
+  void *p_writer_ref = nullptr;
+  Stream *p_out = nullptr;
+  Segment segments[FTP_MAX_SEGMENTS];
+  int segment_count = 4;
+  int active_count = 0;
+  int current = 0;
+
+  bool process(const char *file_name) {
+    FTPLogger::writeLog(LOG_INFO, "FTPSegmentedDownload", file_name);
+    FTPSessionLease<ClientType, N> first = p_mgr->acquire();
+    if (!first) return false;
+    first.api().type("I");
+    uint64_t file_size = first.api().size(file_name);
+    // size() also reports 0 if SIZE fails
+    bool is_file =
+        file_size > 0 || first.api().objectType(file_name) == TypeFile;
+    // the session is reused for the first range
+    first.release();
+    if (!is_file) {
+      FTPLogger::writeLog(LOG_ERROR, "FTPSegmentedDownload", "no size");
+      return false;
+    }
+    // an empty file is complete without any transfer
+    if (file_size == 0) return true;
+
+    // split the file into ranges of at least FTP_SEGMENT_MIN_SIZE
+    int count = segment_count;
+    if (file_size / FTP_SEGMENT_MIN_SIZE < (uint64_t)count) {
+      count = file_size / FTP_SEGMENT_MIN_SIZE;
+      if (count < 1) count = 1;
+    }
+    uint64_t range = file_size / count;
+    active_count = 0;
+    current = 0;
+    for (int j = 0; j < count; j++) {
+      Segment &segment = segments[j];
+      segment = Segment();
+      segment.start = range * j;
+      segment.length = j == count - 1 ? file_size - segment.start : range;
+      if (!start(segment, file_name)) {
+        if (j == 0) {
+          cleanup();
+          return false;
+        }
+        // the previous range just continues to the end of the file
+        segments[j - 1].length = file_size - segments[j - 1].start;
+        break;
+      }
+      active_count++;
+    }
+
+    bool ok = transfer();
+    cleanup();
+    return ok;
+  }
+
+  /// Starts the RETR of the range on a new session
+  bool start(Segment &segment, const char *file_name) {
+    segment.lease = p_mgr->acquire();
+    if (!segment.lease) return false;
+    FTPBasicAPI &api = segment.lease.api();
+    // the ranges are transferred uncompressed
+    if (!api.type("I") || !api.setModeZ(false) || !api.passv()) return false;
+    if (segment.start > 0 && !api.rest(segment.start)) return false;
+    api.read(file_name, 0, false);
+    int code = api.reply().code();
+    if (code != 150 && code != 125) {
+      api.closeData();
+      api.setCurrentOperation(NOP);
+      return false;
+    }
+    segment.buffer = new uint8_t[FTP_SEGMENT_BUFFER_SIZE];
+    segment.is_active = true;
+    return true;
+  }
+
+  /// Receives the data of all ranges until the file is complete
+  bool transfer() {
+    unsigned long last_progress = millis();
+    while (!isComplete()) {
+      bool progress = false;
+      for (int j = 0; j < active_count; j++) {
+        int rc = receive(segments[j]);
+        if (rc < 0) return false;
+        if (rc > 0) progress = true;
+      }
+      int rc = output();
+      if (rc < 0) return false;
+      if (rc > 0) progress = true;
+
+      if (progress) {
+        last_progress = millis();
+      } else if (millis() - last_progress >
+                 p_mgr->connectPolicy().reply_timeout_ms) {
+        FTPLogger::writeLog(LOG_ERROR, "FTPSegmentedDownload", "timeout");
+        return false;
+      } else {
+        delay(FTP_POLL_DELAY_MS);
+      }
+    }
+    return true;
+  }
+
+  /// Reads the available data of the range into its buffer
+  int receive(Segment &segment) {
+    if (!segment.is_active) return 0;
+    Client *client = segment.lease.api().dataClient();
+    uint64_t open = segment.length - segment.received;
+    size_t space = FTP_SEGMENT_BUFFER_SIZE - segment.buffer_len;
+    size_t len = client->available();
+    if (len > open) len = (size_t)open;
+    if (len > space) len = space;
+    if (len == 0) {
+      if (space > 0 && !client->connected()) {
+        FTPLogger::writeLog(LOG_ERROR, "FTPSegmentedDownload",
+                            "data connection closed");
+        return -1;
+      }
+      return 0;
+    }
+    int result = client->read(segment.buffer + segment.buffer_len, len);
+    if (result <= 0) return 0;
+    segment.lease.api().countReceived(result);
+    segment.received += result;
+    segment.buffer_len += result;
+    if (segment.received == segment.length) finish(segment);
+    return result;
+  }
+
+  /// Ends the RETR: ranges which do not end at the end of the file are
+  /// aborted
+  void finish(Segment &segment) {
+    FTPBasicAPI &api = segment.lease.api();
+    if (&segment == &segments[active_count - 1]) {
+      api.closeData();
+      const char *ok[] = {"226", "250", nullptr};
+      api.checkResult(ok, "segment-end", true);
+      api.setCurrentOperation(NOP);
+    } else {
+      api.abort();
+    }
+    segment.is_active = false;
+    segment.lease.release();
+  }
+
+  /// Provides the buffered data to the writer or the output stream
+  int output() {
+    int result = 0;
+    for (int j = 0; j < active_count; j++) {
+      Segment &segment = segments[j];
+      if (segment.buffer_len == 0) continue;
+      // streams are written in sequence
+      if (p_out != nullptr && j != current) continue;
+      size_t len;
+      if (p_out != nullptr) {
+        len = p_out->write(segment.buffer, segment.buffer_len);
+      } else {
+        len = p_writer(segment.start + segment.written, segment.buffer,
+                       segment.buffer_len, p_writer_ref);
+      }
+      if (len == 0) {
+        FTPLogger::writeLog(LOG_ERROR, "FTPSegmentedDownload", "write failed");
+        return -1;
+      }
+      memmove(segment.buffer, segment.buffer + len, segment.buffer_len - len);
+      segment.buffer_len -= len;
+      segment.written += len;
+      result += len;
+    }
+    // move on to the next range
+    while (current < active_count &&
+           segments[current].written == segments[current].length) {
+      current++;
+    }
+    return result;
+  }
+
+  bool isComplete() {
+    for (int j = 0; j < active_count; j++) {
+      if (segments[j].written < segments[j].length) return false;
+    }
+    return true;
+  }
+
+  void cleanup() {
+    for (int j = 0; j < FTP_MAX_SEGMENTS; j++) {
+      Segment &segment = segments[j];
+      if (segment.is_active) {
+        segment.lease.api().abort();
+        segment.is_active = false;
+      }
+      segment.lease.release();
+      if (segment.buffer != nullptr) {
+        delete[] segment.buffer;
+        segment.buffer = nullptr;
+      }
+    }
+  }
+};
+
+}  // namespace ftp_client
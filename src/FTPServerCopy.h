@@ -0,0 +1,97 @@
+#pragma once
+
+#include "Arduino.h"
+#include "FTPBasicAPI.h"
+
+namespace ftp_client {
+
+/**
+ * @brief FTPServerCopy
+ * Copies a file directly from one FTP server to another one (FXP): the
+ * source server opens a passive data port with PASV and the reported address
+ * is passed to the target server with PORT. After the STOR and RETR the data
+ * flows between the two servers and we only wait for the replies on the
+ * control connections. Many servers refuse a PORT with an address which is
+ * not the one of the client, so this needs to be enabled on the target server.
+ * @author Phil Schatzmann
+ */
+class FTPServerCopy {
+ public:
+  /// Defines the max duration of the transfer in ms (0 = unlimited)
+  void setTimeout(unsigned long timeoutMs) { timeout_ms = timeoutMs; }
+
+  /// Copies the file from the source to the target session
+  bool copy(FTPBasicAPI &source, const char *sourcePath, FTPBasicAPI &target,
+            const char *targetPath) {
+    FTPLogger::writeLogf(LOG_INFO, "FTPServerCopy", "%s -> %s", sourcePath,
+                         targetPath);
+    // the data is passed on unchanged
+    if (!source.type("I") || !target.type("I")) return false;
+    if (!source.setModeZ(false) || !target.setModeZ(false)) return false;
+    // a missing source would leave an empty target file
+    FTPFileInfo info;
+    if (!source.stat(&sourcePath, 1, &info)) return false;
+    if (info.type == TypeDirectory) {
+      FTPLogger::writeLog(LOG_ERROR, "FTPServerCopy", "no file");
+      return false;
+    }
+    // EPSV does not provide the address of the source
+    if (!source.cmd("PASV", nullptr, "227")) return false;
+    IPAddress host;
+    int port = FTPBasicAPI::parsePASV(source.reply().line(), host);
+    if (port <= 0 || !target.port(host, port)) return false;
+
+    // the target connects to the waiting source
+    const char *ok[] = {"150", "125", nullptr};
+    target.invalidateMetadata(targetPath);
+    if (!target.cmd("STOR", targetPath, ok)) return false;
+    target.setCurrentOperation(WRITE_OP);
+    if (!source.cmd("RETR", sourcePath, ok)) {
+      target.abort();
+      target.del(targetPath);
+      return false;
+    }
+    source.setCurrentOperation(READ_OP);
+    return waitComplete(source, target);
+  }
+
+ protected:
+  unsigned long timeout_ms = FTP_SERVER_COPY_TIMEOUT_MS;
+
+  /// Waits for the final replies of both servers without blocking one of
+  /// them: if one fails, the transfer of the other one is aborted
+  bool waitComplete(FTPBasicAPI &source, FTPBasicAPI &target) {
+    FTPBasicAPI *apis[2] = {&source, &target};
+    bool is_ok = true;
+    unsigned long start = millis();
+    source.reply().reset();
+    target.reply().reset();
+    while (source.currentOperation() != NOP ||
+           target.currentOperation() != NOP) {
+      bool is_reply = false;
+      for (int j = 0; j < 2; j++) {
+        FTPBasicAPI &api = *apis[j];
+        if (api.currentOperation() == NOP || !api.pollReply()) continue;
+        is_reply = true;
+        api.setCurrentOperation(NOP);
+        int code = api.reply().code();
+        if (code != 226 && code != 250) {
+          FTPLogger::writeLog(LOG_ERROR, "FTPServerCopy", api.reply().line());
+          is_ok = false;
+          apis[1 - j]->abort();
+        }
+      }
+      if (is_reply) continue;
+      if (timeout_ms > 0 && millis() - start > timeout_ms) {
+        FTPLogger::writeLog(LOG_ERROR, "FTPServerCopy", "timeout");
+        source.abort();
+        target.abort();
+        return false;
+      }
+      delay(FTP_POLL_DELAY_MS);
+    }
+    return is_ok;
+  }
+};
+
+}  // namespace ftp_client
@@ -3,20 +3,104 @@
 #include "IPAddress.h"
 
 namespace ftp_client {
+
+template <class ClientType, int N = FTP_MAX_SESSIONS>
+class FTPSessionMgr;
+
+/**
+ * @brief FTPSessionLease
+ * Exclusive access to a session of the FTPSessionMgr: the session is returned
+ * to the pool when the lease is destroyed or released. Leases can be moved
+ * but not copied. With detach() the session stays checked out until
+ * FTPBasicAPI::release() is called (e.g. by FTPFile::close()).
+ * @author Phil Schatzmann
+ */
+template <class ClientType, int N = FTP_MAX_SESSIONS>
+class FTPSessionLease {
+ public:
+  FTPSessionLease() = default;
+
+  FTPSessionLease(FTPSessionMgr<ClientType, N> *mgr, int index) {
+    p_mgr = mgr;
+    this->index = index;
+  }
+
+  FTPSessionLease(FTPSessionLease &&other) {
+    p_mgr = other.p_mgr;
+    index = other.index;
+    other.p_mgr = nullptr;
+  }
+
+  FTPSessionLease &operator=(FTPSessionLease &&other) {
+    if (this != &other) {
+      release();
+      p_mgr = other.p_mgr;
+      index = other.index;
+      other.p_mgr = nullptr;
+    }
+    return *this;
+  }
+
+  FTPSessionLease(const FTPSessionLease &) = delete;
+  FTPSessionLease &operator=(const FTPSessionLease &) = delete;
+
+  ~FTPSessionLease() { release(); }
+
+  /// Returns the session to the pool
+  void release() {
+    if (p_mgr != nullptr) {
+      FTPSessionMgr<ClientType, N> *mgr = p_mgr;
+      p_mgr = nullptr;
+      mgr->release(index);
+    }
+  }
+
+  /// The session stays checked out: it must be returned with
+  /// FTPBasicAPI::release()
+  FTPBasicAPI *detach() {
+    if (p_mgr == nullptr) return nullptr;
+    FTPBasicAPI *result = &api();
+    p_mgr = nullptr;
+    return result;
+  }
+
+  /// Returns true if we have a session
+  operator bool() { return p_mgr != nullptr; }
+
+  FTPSession<ClientType> &session() { return *p_mgr->sessionAt(index); }
+
+  FTPBasicAPI &api() { return session().api(); }
+
+ protected:
+  FTPSessionMgr<ClientType, N> *p_mgr = nullptr;
+  int index = -1;
+};
+
 /**
  * @brief FTPSessionMgr
- * This class manages multiple FTP sessions, allowing for concurrent operations
- * and session reuse. It provides methods to begin a session, end all sessions,
- * and retrieve an available session for FTP operations.
+ * This class manages a pool of up to N FTP sessions, allowing for concurrent
+ * operations and session reuse. Sessions are checked out exclusively with
+ * acquire() and returned to the pool when the FTPSessionLease is released:
+ * the idle and the unused slots are kept in stacks, so that acquisition and
+ * release do not need to scan the pool.
  * @tparam ClientType The type of client to use for command and data
  * connections. It should be a class that implements the Client interface.
+ * @tparam N The max number of sessions
  * @author Phil Schatzmann
  */
 
-template <class ClientType>
+template <class ClientType, int N>
 class FTPSessionMgr {
  public:
-  FTPSessionMgr() { FTPLogger::writeLog(LOG_DEBUG, "FTPSessionMgr"); }
+  FTPSessionMgr() {
+    FTPLogger::writeLog(LOG_DEBUG, "FTPSessionMgr");
+    for (int i = 0; i < N; i++) {
+      slots[i].p_mgr = this;
+      slots[i].index = i;
+      unused[i] = N - 1 - i;
+    }
+    unused_count = N;
+  }
 
   ~FTPSessionMgr() {
     FTPLogger::writeLog(LOG_DEBUG, "~FTPSessionMgr");
@@ -31,72 +115,229 @@ class FTPSessionMgr {
     this->port = port;
     this->username = username;
     this->password = password;
+    last_failure_time = 0;
+    is_throttled = false;
+    // open the warm sessions eagerly, so that the first operation does not
+    // need to login
+    if (warm_count > 0 && !warm_in_background) {
+      while (count() < warm_count) {
+        if (!addIdleSession()) return count() > 0;
+      }
+    }
     return true;
   }
 
+  /// Defines the number of sessions which are kept open: they are created
+  /// in begin() or - if inBackground is true - one by one in loop()
+  void setWarmSessions(int count, bool inBackground = false) {
+    warm_count = count > N ? N : count;
+    warm_in_background = inBackground;
+  }
+
+  /// Defines the interval in ms after which idle sessions are checked with a
+  /// NOOP in loop() (0 = no keepalive)
+  void setKeepAlive(unsigned long intervalMs) { keepalive_ms = intervalMs; }
+
+  /// Defines the time in ms after a failed login in which no new connections
+  /// are opened
+  void setReconnectDelay(unsigned long delayMs) { reconnect_delay_ms = delayMs; }
+
+  /// Provides the connect attempts, backoff, timeouts and deadline
+  const FTPConnectPolicy &connectPolicy() { return policy; }
+
+  /// Defines the connect attempts, backoff, timeouts and deadline of all
+  /// sessions
+  void setConnectPolicy(const FTPConnectPolicy &policy) {
+    this->policy = policy;
+    for (int i = 0; i < N; i++) {
+      if (slots[i].p_session != nullptr) {
+        slots[i].p_session->api().setConnectPolicy(policy);
+      }
+    }
+  }
+
+  /// Defines if the file transfers of all sessions use MODE Z if the server
+  /// supports it
+  void setUseModeZ(bool flag) {
+    use_mode_z = flag;
+    for (int i = 0; i < N; i++) {
+      if (slots[i].p_session != nullptr) {
+        slots[i].p_session->api().setUseModeZ(flag);
+      }
+    }
+  }
+
+  /// Defines if the sessions try EPSV before PASV
+  void setUseEPSV(bool flag) {
+    use_epsv = flag;
+    for (int i = 0; i < N; i++) {
+      if (slots[i].p_session != nullptr) {
+        slots[i].p_session->api().setUseEPSV(flag);
+      }
+    }
+  }
+
+  /// Defines if the sessions connect to the host from the PASV reply
+  /// instead of the address of the command connection
+  void setUsePasvHost(bool flag) {
+    use_pasv_host = flag;
+    for (int i = 0; i < N; i++) {
+      if (slots[i].p_session != nullptr) {
+        slots[i].p_session->api().setUsePasvHost(flag);
+      }
+    }
+  }
+
+  /// Defines the metadata cache which is used by all sessions
+  void setMetadataCache(FTPMetadataCache *cache) {
+    p_metadata = cache;
+    for (int i = 0; i < N; i++) {
+      if (slots[i].p_session != nullptr) {
+        slots[i].p_session->api().setMetadataCache(cache);
+      }
+    }
+  }
+
   void end() {
     FTPLogger::writeLog(LOG_DEBUG, "FTPSessionMgr", "end");
-    for (int i = 0; i < FTP_MAX_SESSIONS; i++) {
-      if (sessions[i] != nullptr) {
-        FTPSession<ClientType> &session = *sessions[i];
+    for (int i = 0; i < N; i++) {
+      Slot &slot = slots[i];
+      if (slot.p_session != nullptr) {
+        FTPSession<ClientType> &session = *slot.p_session;
         session.api().quit();  // Send QUIT command to the server
+        FTP_STAT(retired.add(session.api().statistics()));
         session.end();
-        delete sessions[i];
-        sessions[i] = nullptr;
+        delete slot.p_session;
+        slot.p_session = nullptr;
       }
+      slot.is_leased = false;
+      unused[i] = N - 1 - i;
     }
+    unused_count = N;
+    idle_count = 0;
   }
 
-  /// Provides a session for the FTP operations
-  FTPSession<ClientType> &session() {
-    for (int i = 0; i < FTP_MAX_SESSIONS; i++) {
-      if (sessions[i] == nullptr) {
-        sessions[i] = new FTPSession<ClientType>();
-        if (sessions[i]->begin(address, port, username, password)) {
-          return *sessions[i];
-        } else {
-          delete sessions[i];
-          sessions[i] = nullptr;
-        }
-      } else if (sessions[i]->api().currentOperation() == NOP) {
-        // Reuse existing session if it is not currently in use
-        return *sessions[i];
+  /// Call regularly to send keepalives, to replace broken idle sessions and
+  /// to open the missing warm sessions
+  void loop() {
+    for (int j = idle_count - 1; j >= 0; j--) {
+      int i = idle[j];
+      FTPBasicAPI &api = slots[i].p_session->api();
+      bool ok = api.isAlive();
+      if (ok && keepalive_ms > 0 && api.idleTime() >= keepalive_ms) {
+        ok = api.noop();
+      }
+      if (!ok) {
+        idle[j] = idle[--idle_count];
+        evict(i);
       }
     }
+    // we open only one session per call to keep the blocking time short
+    if (count() < warm_count) addIdleSession();
+  }
+
+  /// Checks out a session exclusively: an idle session is reused, otherwise
+  /// a new one is opened. The lease is invalid if no session is available.
+  FTPSessionLease<ClientType, N> acquire() {
+    // the deadline of the operation includes the login
+    unsigned long start = millis();
+    while (idle_count > 0) {
+      int i = idle[--idle_count];
+      if (slots[i].p_session->api().isAlive()) return lease(i, start);
+      evict(i);
+    }
+    int i = openSession(start);
+    if (i >= 0) return lease(i, start);
     FTPLogger::writeLog(LOG_ERROR, "FTPSessionMgr", "No available sessions");
-    static FTPSession<ClientType> empty_session;
-    empty_session.setValid(false);
-    return empty_session;  // No available session
+    return FTPSessionLease<ClientType, N>();
+  }
+
+  /// Checks out a session and waits up to timeoutMs for a session to be
+  /// released
+  FTPSessionLease<ClientType, N> acquire(unsigned long timeoutMs) {
+    unsigned long start = millis();
+    while (true) {
+      if (idle_count > 0 || (unused_count > 0 && mayConnect())) {
+        return acquire();
+      }
+      if (millis() - start >= timeoutMs) break;
+      delay(FTP_POLL_DELAY_MS);
+    }
+    FTPLogger::writeLog(LOG_ERROR, "FTPSessionMgr", "acquire timeout");
+    return FTPSessionLease<ClientType, N>();
+  }
+
+  /// Returns the checked out session to the pool
+  void release(int index) {
+    Slot &slot = slots[index];
+    if (!slot.is_leased) return;
+    slot.is_leased = false;
+    FTPBasicAPI &api = slot.p_session->api();
+    api.clearDeadline();
+    if (api.currentOperation() != NOP || !api.isAlive()) {
+      // we can not reuse a session with an open transfer
+      evict(index);
+      return;
+    }
+    idle[idle_count++] = index;
+  }
+
+  /// Provides the session at the indicated index
+  FTPSession<ClientType> *sessionAt(int index) {
+    return slots[index].p_session;
   }
 
   /// Aborts the current operation in all sessions
   bool abort(CurrentOperation op) {
     FTPLogger::writeLog(LOG_DEBUG, "FTPSessionMgr", "abort");
-    for (int i = 0; i < FTP_MAX_SESSIONS; i++) {
-      if (sessions[i] != nullptr &&
-          sessions[i]->api().currentOperation() == op) {
-        return sessions[i]->api().abort();
+    for (int i = 0; i < N; i++) {
+      FTPSession<ClientType> *p_session = slots[i].p_session;
+      if (p_session != nullptr && p_session->api().currentOperation() == op) {
+        return p_session->api().abort();
       }
     }
     return false;  // No session found with the specified operation
   }
 
-  /// Count the sessions
-  int count() {
-    int result = 0;
-    for (auto &session : sessions) {
-      if (session != nullptr) {
-        result++;
+  /// Provides the statistics of all sessions including the ones which have
+  /// been closed: all counters are 0 if FTP_STATISTICS is not enabled
+  FTPStatistics statistics() {
+    FTPStatistics result;
+#if FTP_STATISTICS
+    result = retired;
+    for (int i = 0; i < N; i++) {
+      if (slots[i].p_session != nullptr) {
+        result.add(slots[i].p_session->api().statistics());
       }
     }
+#endif
     return result;
   }
-  
+
+  /// Sets the statistics of all sessions to 0
+  void resetStatistics() {
+#if FTP_STATISTICS
+    retired.reset();
+    for (int i = 0; i < N; i++) {
+      if (slots[i].p_session != nullptr) {
+        slots[i].p_session->api().resetStatistics();
+      }
+    }
+#endif
+  }
+
+  /// Count the sessions
+  int count() { return N - unused_count; }
+
+  /// Count the sessions which are not checked out
+  int countIdle() { return idle_count; }
+
   /// Count the sessions with a specific current operation
   int count(CurrentOperation op) {
     int result = 0;
-    for (auto &session : sessions) {
-      if (session != nullptr && session->api().currentOperation() == op) {
+    for (auto &slot : slots) {
+      if (slot.p_session != nullptr &&
+          slot.p_session->api().currentOperation() == op) {
         result++;
       }
     }
@@ -104,11 +345,106 @@ class FTPSessionMgr {
   }
 
  protected:
-  FTPSession<ClientType> *sessions[FTP_MAX_SESSIONS] = {nullptr};
+  struct Slot {
+    FTPSession<ClientType> *p_session = nullptr;
+    FTPSessionMgr *p_mgr = nullptr;
+    int index = 0;
+    bool is_leased = false;
+  };
+  Slot slots[N];
+  // indexes of the open sessions which are not checked out
+  int idle[N];
+  int idle_count = 0;
+  // indexes of the slots without session
+  int unused[N];
+  int unused_count = 0;
   IPAddress address;
   int port;
   const char *username;
   const char *password;
+  int warm_count = FTP_WARM_SESSIONS;
+  bool warm_in_background = false;
+  unsigned long keepalive_ms = FTP_KEEPALIVE_MS;
+  unsigned long reconnect_delay_ms = FTP_RECONNECT_DELAY_MS;
+  unsigned long last_failure_time = 0;
+  bool is_throttled = false;
+  bool use_epsv = FTP_USE_EPSV;
+  bool use_mode_z = FTP_USE_MODE_Z;
+  bool use_pasv_host = false;
+  FTPMetadataCache *p_metadata = nullptr;
+  FTPConnectPolicy policy;
+#if FTP_STATISTICS
+  // statistics of the closed sessions
+  FTPStatistics retired;
+#endif
+
+  FTPSessionLease<ClientType, N> lease(int index, unsigned long start) {
+    slots[index].is_leased = true;
+    slots[index].p_session->api().startDeadline(start);
+    return FTPSessionLease<ClientType, N>(this, index);
+  }
+
+  /// Called by FTPBasicAPI::release()
+  static void releaseCallback(void *ref) {
+    Slot *p_slot = (Slot *)ref;
+    p_slot->p_mgr->release(p_slot->index);
+  }
+
+  /// After a failed login we wait for the reconnect delay
+  bool mayConnect() {
+    if (!is_throttled) return true;
+    if (millis() - last_failure_time < reconnect_delay_ms) return false;
+    is_throttled = false;
+    return true;
+  }
+
+  /// Opens a new session in an unused slot: returns the index or -1
+  int openSession(unsigned long start = millis()) {
+    if (unused_count == 0) return -1;
+    if (!mayConnect()) {
+      FTPLogger::writeLog(LOG_WARN, "FTPSessionMgr", "reconnect throttled");
+      return -1;
+    }
+    int i = unused[--unused_count];
+    Slot &slot = slots[i];
+    slot.p_session = new FTPSession<ClientType>();
+    slot.p_session->api().setUseEPSV(use_epsv);
+    slot.p_session->api().setUsePasvHost(use_pasv_host);
+    slot.p_session->api().setMetadataCache(p_metadata);
+    slot.p_session->api().setConnectPolicy(policy);
+    slot.p_session->api().setUseModeZ(use_mode_z);
+    slot.p_session->api().startDeadline(start);
+    if (slot.p_session->begin(address, port, username, password)) {
+      slot.p_session->api().setReleaseCallback(releaseCallback, &slot);
+      return i;
+    }
+    FTP_STAT(retired.add(slot.p_session->api().statistics()));
+    delete slot.p_session;
+    slot.p_session = nullptr;
+    unused[unused_count++] = i;
+    last_failure_time = millis();
+    is_throttled = true;
+    return -1;
+  }
+
+  bool addIdleSession() {
+    int i = openSession();
+    if (i < 0) return false;
+    idle[idle_count++] = i;
+    return true;
+  }
+
+  /// Closes and removes a broken session
+  void evict(int i) {
+    FTPLogger::writeLog(LOG_WARN, "FTPSessionMgr", "evict session");
+    Slot &slot = slots[i];
+    FTP_STAT(retired.add(slot.p_session->api().statistics()));
+    slot.p_session->end();
+    delete slot.p_session;
+    slot.p_session = nullptr;
+    slot.is_leased = false;
+    unused[unused_count++] = i;
+  }
 };
 
-}  // namespace ftp_client
\ No newline at end of file
+}  // namespace ftp_client
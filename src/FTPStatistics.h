@@ -0,0 +1,164 @@
+#pragma once
+
+#include "Arduino.h"
+#include "FTPCommon.h"
+
+// Executes the statement only if the statistics are enabled
+#if FTP_STATISTICS
+#define FTP_STAT(statement) statement
+#else
+#define FTP_STAT(statement)
+#endif
+
+namespace ftp_client {
+
+/// Commands which are counted individually: all others are counted as OTHER
+enum FTPStatCommand {
+  STAT_USER,
+  STAT_PASS,
+  STAT_OPTS,
+  STAT_TYPE,
+  STAT_PASV,
+  STAT_EPSV,
+  STAT_REST,
+  STAT_RETR,
+  STAT_STOR,
+  STAT_APPE,
+  STAT_NLST,
+  STAT_MLSD,
+  STAT_SIZE,
+  STAT_MDTM,
+  STAT_DELE,
+  STAT_MKD,
+  STAT_RMD,
+  STAT_FEAT,
+  STAT_NOOP,
+  STAT_ABOR,
+  STAT_QUIT,
+  STAT_OTHER,
+  STAT_COMMAND_COUNT
+};
+
+/// Number of buckets of the reply latency histogram
+#define FTP_STAT_LATENCY_BUCKETS 14
+
+/**
+ * @brief FTPStatistics
+ * Counters of a session or - aggregated - of all sessions of the
+ * FTPSessionMgr. The statistics are only collected if FTP_STATISTICS is
+ * defined as true: otherwise all counters stay 0. All times are in us.
+ * @author Phil Schatzmann
+ */
+struct FTPStatistics {
+  /// bytes received on the data connection
+  uint64_t bytes_received = 0;
+  /// bytes sent on the data connection
+  uint64_t bytes_sent = 0;
+  /// number of commands by FTPStatCommand
+  uint32_t commands[STAT_COMMAND_COUNT] = {0};
+  /// number of replies by latency: see latencyBucketLimit()
+  uint32_t reply_latency[FTP_STAT_LATENCY_BUCKETS] = {0};
+  uint32_t replies = 0;
+  uint64_t reply_time_us = 0;
+  uint32_t reply_time_max_us = 0;
+  /// successful connects of the command connection and their duration
+  /// including the greeting
+  uint32_t connects = 0;
+  uint64_t connect_time_us = 0;
+  /// logins (USER and PASS) and their duration
+  uint32_t logins = 0;
+  uint64_t login_time_us = 0;
+  /// successful setup of the data connections (PASV or EPSV and connect)
+  uint32_t passive = 0;
+  uint64_t passive_time_us = 0;
+  /// additional connect attempts of the command and data connections
+  uint32_t connect_retries = 0;
+  /// connections which could not be opened
+  uint32_t connect_failures = 0;
+
+  /// Provides the name of the command
+  static const char *commandName(int cmd) {
+    return cmd >= 0 && cmd < STAT_COMMAND_COUNT ? names()[cmd] : nullptr;
+  }
+
+  /// Determines the FTPStatCommand of the command line
+  static FTPStatCommand command(const char *commandLine) {
+    for (int j = 0; j < STAT_OTHER; j++) {
+      const char *name = names()[j];
+      int len = strlen(name);
+      if (strncasecmp(commandLine, name, len) == 0 &&
+          (commandLine[len] == '\0' || commandLine[len] == ' ')) {
+        return (FTPStatCommand)j;
+      }
+    }
+    return STAT_OTHER;
+  }
+
+  /// Provides the upper limit in us of the latency bucket: the last bucket
+  /// has no limit (0)
+  static uint32_t latencyBucketLimit(int bucket) {
+    static const uint32_t limits[FTP_STAT_LATENCY_BUCKETS] = {
+        100,   250,    500,    1000,   2500,   5000,    10000,
+        25000, 50000, 100000, 250000, 500000, 1000000, 0};
+    return limits[bucket];
+  }
+
+  /// Number of all commands
+  uint32_t commandCount() const {
+    uint32_t result = 0;
+    for (int j = 0; j < STAT_COMMAND_COUNT; j++) result += commands[j];
+    return result;
+  }
+
+  /// Adds the reply latency
+  void addReply(uint32_t us) {
+    int bucket = 0;
+    while (bucket < FTP_STAT_LATENCY_BUCKETS - 1 &&
+           us >= latencyBucketLimit(bucket)) {
+      bucket++;
+    }
+    reply_latency[bucket]++;
+    replies++;
+    reply_time_us += us;
+    if (us > reply_time_max_us) reply_time_max_us = us;
+  }
+
+  /// Adds the counters of another session
+  void add(const FTPStatistics &other) {
+    bytes_received += other.bytes_received;
+    bytes_sent += other.bytes_sent;
+    for (int j = 0; j < STAT_COMMAND_COUNT; j++) {
+      commands[j] += other.commands[j];
+    }
+    for (int j = 0; j < FTP_STAT_LATENCY_BUCKETS; j++) {
+      reply_latency[j] += other.reply_latency[j];
+    }
+    replies += other.replies;
+    reply_time_us += other.reply_time_us;
+    if (other.reply_time_max_us > reply_time_max_us) {
+      reply_time_max_us = other.reply_time_max_us;
+    }
+    connects += other.connects;
+    connect_time_us += other.connect_time_us;
+    logins += other.logins;
+    login_time_us += other.login_time_us;
+    passive += other.passive;
+    passive_time_us += other.passive_time_us;
+    connect_retries += other.connect_retries;
+    connect_failures += other.connect_failures;
+  }
+
+  /// Sets all counters to 0
+  void reset() { *this = FTPStatistics(); }
+
+ protected:
+  static const char *const *names() {
+    static const char *const result[STAT_COMMAND_COUNT] = {
+        "USER", "PASS", "OPTS", "TYPE", "PASV", "EPSV", "REST", "RETR",
+        "STOR", "APPE", "NLST", "MLSD", "SIZE", "MDTM", "DELE", "MKD",
+        "RMD",  "FEAT", "NOOP", "ABOR", "QUIT", "OTHER"};
+    return result;
+  }
+};
+
+}  // namespace ftp_client
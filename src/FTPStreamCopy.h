@@ -0,0 +1,149 @@
+#pragma once
+
+#include "Arduino.h"
+#include "FTPFile.h"
+#include "Stream.h"
+
+namespace ftp_client {
+
+/// Reports the progress of a copy: total is 0 if the size is not known
+typedef void (*FTPProgressCallback)(uint64_t bytes, uint64_t total,
+                                    void *ref);
+
+/**
+ * @brief FTPStreamCopy
+ * Copies the data of a download or upload in big chunks with two buffers:
+ * while one buffer is written to the sink, the other one is filled from the
+ * source. Only the data which is available is read and the sink is only
+ * provided with what it reports in availableForWrite() (if it supports it),
+ * so that the network and the local storage are kept busy at the same time.
+ * @author Phil Schatzmann
+ */
+class FTPStreamCopy {
+ public:
+  FTPStreamCopy(size_t chunkSize = FTP_COPY_BUFFER_SIZE) {
+    setChunkSize(chunkSize);
+  }
+
+  ~FTPStreamCopy() { delete[] p_data; }
+
+  /// Defines the size of each of the two buffers
+  void setChunkSize(size_t size) {
+    if (size == chunk_size || size == 0) return;
+    delete[] p_data;
+    p_data = nullptr;
+    chunk_size = size;
+  }
+
+  /// Defines the callback which is called after each chunk
+  void setProgress(FTPProgressCallback cb, void *ref = nullptr) {
+    p_progress = cb;
+    p_progress_ref = ref;
+  }
+
+  /// Defines the expected number of bytes which is reported to the progress
+  /// callback
+  void setTotal(uint64_t total) { total_bytes = total; }
+
+  /// Copies the remote file to the sink until the server closes the data
+  /// connection
+  bool download(FTPFile &source, Stream &sink) {
+    p_remote = &source;
+    is_download = true;
+    return copy(source, sink);
+  }
+
+  /// Copies the source until no more data is available to the remote file:
+  /// the readBytes() of the actual type is used because it is not virtual
+  template <class StreamType>
+  bool upload(StreamType &source, FTPFile &sink) {
+    p_remote = &sink;
+    is_download = false;
+    return copy(source, sink);
+  }
+
+  /// Number of copied bytes
+  uint64_t bytes() { return copied_bytes; }
+
+ protected:
+  struct Buffer {
+    uint8_t *data = nullptr;
+    size_t len = 0;
+    size_t pos = 0;
+  };
+  uint8_t *p_data = nullptr;
+  size_t chunk_size = 0;
+  Buffer buffers[2];
+  FTPFile *p_remote = nullptr;
+  bool is_download = false;
+  FTPProgressCallback p_progress = nullptr;
+  void *p_progress_ref = nullptr;
+  uint64_t total_bytes = 0;
+  uint64_t copied_bytes = 0;
+
+  template <class StreamType>
+  bool copy(StreamType &source, Print &sink) {
+    if (p_data == nullptr) p_data = new uint8_t[2 * chunk_size];
+    for (int j = 0; j < 2; j++) {
+      buffers[j].data = p_data + j * chunk_size;
+      buffers[j].len = 0;
+      buffers[j].pos = 0;
+    }
+    copied_bytes = 0;
+    int fill = 0;
+    bool is_end = false;
+    unsigned long last_progress = millis();
+    while (true) {
+      bool is_progress = false;
+      Buffer &in = buffers[fill];
+      Buffer &out = buffers[1 - fill];
+      if (!is_end && in.len < chunk_size) {
+        // only the available data is read, so that we do not block
+        int len = source.available();
+        if (len > 0) {
+          if ((size_t)len > chunk_size - in.len) len = chunk_size - in.len;
+          len = source.readBytes(in.data + in.len, len);
+          in.len += len;
+          is_progress = len > 0;
+        } else {
+          is_end = isEnd();
+        }
+      }
+      // the filled buffer is written while the other one is filled
+      if (out.pos == out.len && in.len > 0) {
+        out.len = 0;
+        out.pos = 0;
+        fill = 1 - fill;
+        continue;
+      }
+      if (out.pos < out.len) {
+        size_t len = out.len - out.pos;
+        int space = sink.availableForWrite();
+        if (space > 0 && (size_t)space < len) len = space;
+        len = sink.write(out.data + out.pos, len);
+        out.pos += len;
+        copied_bytes += len;
+        if (len > 0) is_progress = true;
+        if (out.pos == out.len && p_progress != nullptr) {
+          p_progress(copied_bytes, total_bytes, p_progress_ref);
+        }
+      } else if (is_end && in.len == 0) {
+        return true;
+      }
+      if (is_progress) {
+        last_progress = millis();
+      } else if (p_remote->isTimeout(last_progress)) {
+        FTPLogger::writeLog(LOG_ERROR, "FTPStreamCopy", "timeout");
+        return false;
+      } else {
+        delay(FTP_POLL_DELAY_MS);
+      }
+    }
+  }
+
+  /// Uploads end when no more data is available and downloads when the
+  /// data connection has been closed by the server
+  bool isEnd() { return !is_download || p_remote->isEOF(); }
+};
+
+}  // namespace ftp_client
@@ -0,0 +1,322 @@
+#pragma once
+
+#include "Arduino.h"
+#include "FTPSessionMgr.h"
+#include "Stream.h"
+
+namespace ftp_client {
+
+/// @brief Status of a FTPTransferJob
+enum FTPTransferStatus {
+  TRANSFER_PENDING,
+  TRANSFER_ACTIVE,
+  TRANSFER_DONE,
+  TRANSFER_ERROR
+};
+
+/**
+ * @brief FTPTransferJob
+ * A single upload (WRITE_MODE, WRITE_APPEND_MODE) or download (READ_MODE)
+ * which is processed by the FTPTransferQueue. The job is provided by the
+ * caller and must stay valid until it has been completed. With
+ * WRITE_RESUME_MODE the local stream must be positioned at the end of the
+ * remote file and the data is appended.
+ */
+struct FTPTransferJob {
+  FTPTransferJob() = default;
+  FTPTransferJob(const char *remotePath, Stream &localStream,
+                 FileMode fileMode = READ_MODE) {
+    remote_path = remotePath;
+    local = &localStream;
+    mode = fileMode;
+  }
+  /// path of the remote file
+  const char *remote_path = nullptr;
+  /// data source for uploads or sink for downloads
+  Stream *local = nullptr;
+  FileMode mode = READ_MODE;
+  FTPTransferStatus status = TRANSFER_PENDING;
+  /// number of transferred bytes
+  uint64_t bytes = 0;
+  /// reply code of the failing command
+  int reply_code = 0;
+  /// optional reference for the caller
+  void *ref = nullptr;
+  /// next job in the queue
+  FTPTransferJob *next = nullptr;
+};
+
+/**
+ * @brief FTPTransferQueue
+ * Processes multiple transfer jobs concurrently over up to
+ * setMaxSessions() sessions of the FTPSessionMgr. The commands are sent
+ * without blocking, so that the round trips of the different sessions
+ * overlap. Idle sessions are reused for the next job. Call loop() regularly
+ * or run() to process all jobs.
+ * @tparam ClientType The type of client to use for command and data
+ * connections.
+ * @tparam N The max number of sessions of the FTPSessionMgr
+ * @author Phil Schatzmann
+ */
+template <class ClientType, int N = FTP_MAX_SESSIONS>
+class FTPTransferQueue {
+ public:
+  FTPTransferQueue(FTPSessionMgr<ClientType, N> &mgr) { p_mgr = &mgr; }
+
+  ~FTPTransferQueue() { end(); }
+
+  /// Defines the max number of sessions which are used concurrently
+  void setMaxSessions(int count) {
+    max_sessions = count < 1 ? 1 : count > N ? N : count;
+  }
+
+  /// Defines a callback which is called when a job has been completed
+  void setCallback(void (*cb)(FTPTransferJob &job, void *ref),
+                   void *ref = nullptr) {
+    p_callback = cb;
+    p_callback_ref = ref;
+  }
+
+  /// Adds a job to the end of the queue
+  void add(FTPTransferJob &job) {
+    job.status = TRANSFER_PENDING;
+    job.bytes = 0;
+    job.reply_code = 0;
+    job.next = nullptr;
+    if (p_tail == nullptr) {
+      p_head = &job;
+    } else {
+      p_tail->next = &job;
+    }
+    p_tail = &job;
+  }
+
+  /// Processes the jobs: returns false when there is nothing left to do
+  bool loop() {
+    bool is_busy = false;
+    for (int j = 0; j < max_sessions; j++) {
+      Slot &slot = slots[j];
+      if (slot.p_job == nullptr) startNext(slot);
+      if (slot.p_job != nullptr) {
+        process(slot);
+        is_busy = true;
+      }
+    }
+    // no session could be opened: the pending jobs would wait forever
+    if (!is_busy && p_head != nullptr) failPending();
+    return is_busy || p_head != nullptr;
+  }
+
+  /// Processes all jobs: returns true if all were successful
+  bool run() {
+    error_count = 0;
+    while (loop()) {
+      delay(FTP_POLL_DELAY_MS);
+    }
+    return error_count == 0;
+  }
+
+  /// Cancels all active jobs
+  void end() {
+    for (int j = 0; j < N; j++) {
+      Slot &slot = slots[j];
+      if (slot.p_job != nullptr) {
+        slot.lease.api().abort();
+        complete(slot, TRANSFER_ERROR);
+      }
+    }
+    p_head = nullptr;
+    p_tail = nullptr;
+  }
+
+  /// Number of failed jobs since the last run()
+  int errors() { return error_count; }
+
+ protected:
+  enum SlotState { STATE_PASV, STATE_OPEN, STATE_TRANSFER, STATE_CLOSE };
+  struct Slot {
+    FTPSessionLease<ClientType, N> lease;
+    FTPTransferJob *p_job = nullptr;
+    SlotState state = STATE_PASV;
+    unsigned long start_time = 0;
+  };
+  FTPSessionMgr<ClientType, N> *p_mgr = nullptr;
+  Slot slots[N];
+  int max_sessions = 4;
+  int error_count = 0;
+  FTPTransferJob *p_head = nullptr;
+  FTPTransferJob *p_tail = nullptr;
+  void (*p_callback)(FTPTransferJob &job, void *ref) = nullptr;
+  void *p_callback_ref = nullptr;
+  uint8_t buffer[FTP_TRANSFER_CHUNK_SIZE];
+
+  /// Assigns the next pending job to the slot
+  void startNext(Slot &slot) {
+    if (p_head == nullptr) return;
+    // we get an idle session which is reused or a new one
+    slot.lease = p_mgr->acquire();
+    if (!slot.lease) return;
+    FTPTransferJob *p_job = p_head;
+    p_head = p_job->next;
+    if (p_head == nullptr) p_tail = nullptr;
+
+    FTPLogger::writeLog(LOG_INFO, "FTPTransferQueue", p_job->remote_path);
+    slot.p_job = p_job;
+    p_job->status = TRANSFER_ACTIVE;
+    // the queued transfers are not compressed
+    slot.lease.api().setModeZ(false);
+    slot.lease.api().setCurrentOperation(p_job->mode == READ_MODE ? READ_OP
+                                                                   : WRITE_OP);
+    sendCmd(slot, STATE_PASV, slot.lease.api().passiveCommand(), nullptr);
+  }
+
+  void sendCmd(Slot &slot, SlotState state, const char *command,
+               const char *par) {
+    FTPBasicAPI &api = slot.lease.api();
+    api.reply().reset();
+    api.sendCmd(command, par);
+    slot.state = state;
+    slot.start_time = millis();
+  }
+
+  /// Advances the state of the slot without blocking
+  void process(Slot &slot) {
+    FTPBasicAPI &api = slot.lease.api();
+    FTPTransferJob &job = *slot.p_job;
+    if (slot.state == STATE_TRANSFER) {
+      transfer(slot);
+      return;
+    }
+
+    if (!api.pollReply()) {
+      if (api.isReplyOverdue(slot.start_time)) {
+        FTPLogger::writeLog(LOG_ERROR, "FTPTransferQueue", "timeout");
+        // the late reply would be taken for the next command
+        api.setBroken();
+        fail(slot);
+      }
+      return;
+    }
+
+    int code = api.reply().code();
+    switch (slot.state) {
+      case STATE_PASV:
+        if (api.isEPSVRefused(code)) {
+          // EPSV is not supported: we retry with PASV
+          api.setUseEPSV(false);
+          sendCmd(slot, STATE_PASV, api.passiveCommand(), nullptr);
+          break;
+        }
+        if ((code != 227 && code != 229) || !api.connectData()) {
+          fail(slot);
+          return;
+        }
+        sendCmd(slot, STATE_OPEN,
+                job.mode == READ_MODE    ? "RETR"
+                : job.mode == WRITE_MODE ? "STOR"
+                                         : "APPE",
+                job.remote_path);
+        break;
+      case STATE_OPEN:
+        if (code != 150 && code != 125) {
+          fail(slot);
+          return;
+        }
+        api.reply().reset();
+        slot.state = STATE_TRANSFER;
+        break;
+      case STATE_CLOSE:
+        if (code != 226 && code != 250) {
+          fail(slot);
+          return;
+        }
+        api.setCurrentOperation(NOP);
+        complete(slot, TRANSFER_DONE);
+        break;
+      default:
+        break;
+    }
+  }
+
+  /// Copies the available data between the local stream and the data
+  /// connection
+  void transfer(Slot &slot) {
+    FTPBasicAPI &api = slot.lease.api();
+    FTPTransferJob &job = *slot.p_job;
+    Client *data = api.dataClient();
+    if (job.mode == READ_MODE) {
+      int len = data->available();
+      if (len > 0) {
+        if (len > FTP_TRANSFER_CHUNK_SIZE) len = FTP_TRANSFER_CHUNK_SIZE;
+        len = data->read(buffer, len);
+        if (len > 0) {
+          size_t written = job.local->write(buffer, len);
+          job.bytes += written;
+          api.countReceived(len);
+          if (written != (size_t)len) {
+            FTPLogger::writeLog(LOG_ERROR, "FTPTransferQueue", "write failed");
+            fail(slot);
+          }
+        }
+        return;
+      }
+      // the server closes the data connection at the end of the file
+      if (data->connected()) return;
+    } else {
+      int len = job.local->available();
+      if (len > 0) {
+        if (len > FTP_TRANSFER_CHUNK_SIZE) len = FTP_TRANSFER_CHUNK_SIZE;
+        len = job.local->readBytes(buffer, len);
+        if (len > 0 && data->write(buffer, len) != (size_t)len) {
+          fail(slot);
+          return;
+        }
+        job.bytes += len;
+        api.countSent(len);
+        return;
+      }
+    }
+    // end of the data: the reply might already be available
+    api.closeData();
+    slot.state = STATE_CLOSE;
+    slot.start_time = millis();
+  }
+
+  void fail(Slot &slot) {
+    FTPBasicAPI &api = slot.lease.api();
+    slot.p_job->reply_code = api.reply().code();
+    FTPLogger::writeLog(LOG_ERROR, "FTPTransferQueue", slot.p_job->remote_path);
+    if (slot.state == STATE_TRANSFER) {
+      api.abort();
+    } else {
+      api.closeData();
+    }
+    api.setCurrentOperation(NOP);
+    error_count++;
+    complete(slot, TRANSFER_ERROR);
+  }
+
+  /// Fails all jobs which have not been started
+  void failPending() {
+    FTPLogger::writeLog(LOG_ERROR, "FTPTransferQueue", "no session");
+    while (p_head != nullptr) {
+      FTPTransferJob &job = *p_head;
+      p_head = job.next;
+      job.status = TRANSFER_ERROR;
+      error_count++;
+      if (p_callback != nullptr) p_callback(job, p_callback_ref);
+    }
+    p_tail = nullptr;
+  }
+
+  /// Reports the result: the session is released so that it can be reused
+  void complete(Slot &slot, FTPTransferStatus status) {
+    FTPTransferJob &job = *slot.p_job;
+    job.status = status;
+    slot.p_job = nullptr;
+    slot.lease.release();
+    if (p_callback != nullptr) p_callback(job, p_callback_ref);
+  }
+};
+
+}  // namespace ftp_client
@@ -0,0 +1,560 @@
+#pragma once
+
+#include "Arduino.h"
+#include "FTPSessionMgr.h"
+
+namespace ftp_client {
+
+/**
+ * @brief FTPTreeWalker
+ * Breadth first walk of a remote directory tree: the directories are listed
+ * concurrently over up to setMaxSessions() sessions of the FTPSessionMgr
+ * without blocking and the entries are provided to the visitor as they
+ * arrive. MLSD listings provide the type of the entries, so that no
+ * additional round trip is needed to decide if an entry is a directory:
+ * servers without MLST are supported with NLST followed by pipelined SIZE
+ * and MDTM commands.
+ * The pending directories are kept in a queue of FTP_WALK_QUEUE_SIZE bytes
+ * which is processed breadth first: when it gets more than half full the
+ * deepest directories are listed first to drain it. If it is full, the
+ * remaining subdirectories of a listing are not queued: instead the
+ * directory is listed again later to queue them. The filter must therefore
+ * always give the same answer for the same directory. Directories which can
+ * not be completed because the queue stays full are reported as errors.
+ * The queue and the state of the setMaxSessions() concurrent listings are
+ * allocated on the heap by begin(), so that the walker can be kept on the
+ * stack.
+ * @tparam ClientType The type of client to use for command and data
+ * connections.
+ * @tparam N The max number of sessions of the FTPSessionMgr
+ * @author Phil Schatzmann
+ */
+template <class ClientType, int N = FTP_MAX_SESSIONS>
+class FTPTreeWalker {
+ public:
+  FTPTreeWalker(FTPSessionMgr<ClientType, N> &mgr) { p_mgr = &mgr; }
+
+  ~FTPTreeWalker() { end(); }
+
+  /// Defines the max number of directories which are listed concurrently:
+  /// this is used by the next begin()
+  void setMaxSessions(int count) {
+    max_sessions = count < 1 ? 1 : count > N ? N : count;
+  }
+
+  /// Defines the max depth of the walk (0 = only the root directory, -1 =
+  /// unlimited)
+  void setMaxDepth(int depth) { max_depth = depth; }
+
+  /// Defines the callback which is called for each file and directory with
+  /// the path of the parent directory
+  void setVisitor(void (*cb)(const char *dir, const FTPFileInfo &info,
+                             void *ref),
+                  void *ref = nullptr) {
+    p_visitor = cb;
+    p_visitor_ref = ref;
+  }
+
+  /// Defines a callback which decides if a subdirectory is walked: by
+  /// default all subdirectories are walked
+  void setFilter(bool (*cb)(const char *path, void *ref),
+                 void *ref = nullptr) {
+    p_filter = cb;
+    p_filter_ref = ref;
+  }
+
+  /// Starts the walk at the indicated directory
+  bool begin(const char *root) {
+    end();
+    queue = (uint8_t *)malloc(FTP_WALK_QUEUE_SIZE);
+    slots = new Slot[max_sessions];
+    if (queue == nullptr || slots == nullptr) {
+      end();
+      return false;
+    }
+    slot_count = max_sessions;
+    error_count = 0;
+    directory_count = 0;
+    entry_count = 0;
+    relist_count = 0;
+    is_stopped = false;
+    return push(root, 0);
+  }
+
+  /// Processes the listings without blocking: returns false when the walk
+  /// has been completed
+  bool loop() {
+    if (queue == nullptr) return false;
+    bool is_busy = false;
+    for (int j = 0; j < slot_count; j++) {
+      Slot &slot = slots[j];
+      if (slot.state == SLOT_IDLE && !is_stopped) startNext(slot);
+      if (slot.state != SLOT_IDLE) {
+        process(slot);
+        is_busy = true;
+      }
+    }
+    if (is_busy) return true;
+    if (is_stopped) {
+      end();
+      return false;
+    }
+    // no space can be freed any more for the stalled directories
+    failStalled();
+    // no session could be opened for the pending directories
+    failPending();
+    return false;
+  }
+
+  /// Walks the tree: returns true if all directories could be listed
+  bool walk(const char *root) {
+    if (!begin(root)) return false;
+    while (loop()) {
+      delay(FTP_POLL_DELAY_MS);
+    }
+    end();
+    return error_count == 0;
+  }
+
+  /// Stops the walk: the active listings are aborted
+  void stop() { is_stopped = true; }
+
+  /// Releases all resources
+  void end() {
+    for (int j = 0; j < slot_count; j++) {
+      if (slots[j].state != SLOT_IDLE) {
+        slots[j].lease.api().abort();
+        release(slots[j]);
+      }
+    }
+    delete[] slots;
+    slots = nullptr;
+    slot_count = 0;
+    free(queue);
+    queue = nullptr;
+    queue_end = 0;
+  }
+
+  /// Number of directories which could not be listed completely
+  int errors() { return error_count; }
+
+  /// Number of listed directories
+  int directories() { return directory_count; }
+
+  /// Number of entries which were provided to the visitor
+  uint32_t entries() { return entry_count; }
+
+  /// Number of directories which needed to be listed again because the
+  /// queue was full
+  int relists() { return relist_count; }
+
+ protected:
+  enum SlotState { SLOT_IDLE, SLOT_PASV, SLOT_OPEN, SLOT_READ, SLOT_CLOSE };
+  /// State of a queued directory: it stays in the queue while it is listed,
+  /// so that it can be listed again without additional memory
+  enum EntryState { ENTRY_PENDING, ENTRY_ACTIVE, ENTRY_STALLED, ENTRY_DONE };
+  /// Header of a queued directory which is followed by the path
+  struct Header {
+    uint16_t size;
+    uint16_t depth;
+    // number of subdirectories which have already been queued
+    uint16_t skip;
+    // the entries have already been provided to the visitor
+    uint8_t dirs_only;
+    uint8_t state;
+  };
+  struct Slot {
+    FTPSessionLease<ClientType, N> lease;
+    SlotState state = SLOT_IDLE;
+    unsigned long start_time = 0;
+    // position of the directory in the queue
+    size_t entry = 0;
+    Header header;
+    char dir[FTP_MAX_LINE_SIZE];
+    char line[FTP_MAX_LINE_SIZE];
+    int line_len = 0;
+    bool is_mlsd = true;
+    // number of subdirectories in the listing
+    int subdirs = 0;
+    // index of the first subdirectory which did not fit into the queue
+    int overflow = -1;
+    // names of a NLST listing
+    char *names = nullptr;
+    size_t names_len = 0;
+    size_t names_size = 0;
+  };
+  FTPSessionMgr<ClientType, N> *p_mgr = nullptr;
+  Slot *slots = nullptr;
+  int slot_count = 0;
+  int max_sessions = 4;
+  int max_depth = -1;
+  void (*p_visitor)(const char *dir, const FTPFileInfo &info,
+                    void *ref) = nullptr;
+  void *p_visitor_ref = nullptr;
+  bool (*p_filter)(const char *path, void *ref) = nullptr;
+  void *p_filter_ref = nullptr;
+  uint8_t *queue = nullptr;
+  size_t queue_end = 0;
+  int error_count = 0;
+  int directory_count = 0;
+  uint32_t entry_count = 0;
+  int relist_count = 0;
+  bool is_stopped = false;
+
+  Header header(size_t pos) {
+    Header result;
+    memcpy(&result, queue + pos, sizeof(Header));
+    return result;
+  }
+
+  /// Adds a directory to the queue: returns false if it is full
+  bool push(const char *path, int depth) {
+    size_t size = sizeof(Header) + strlen(path) + 1;
+    if (queue_end + size > FTP_WALK_QUEUE_SIZE) compact();
+    if (queue_end + size > FTP_WALK_QUEUE_SIZE) return false;
+    Header entry;
+    entry.size = size;
+    entry.depth = depth;
+    entry.skip = 0;
+    entry.dirs_only = false;
+    entry.state = ENTRY_PENDING;
+    memcpy(queue + queue_end, &entry, sizeof(Header));
+    strcpy((char *)queue + queue_end + sizeof(Header), path);
+    queue_end += size;
+    return true;
+  }
+
+  /// Removes the completed directories from the queue
+  void compact() {
+    size_t target = 0;
+    size_t pos = 0;
+    while (pos < queue_end) {
+      Header entry = header(pos);
+      if (entry.state != ENTRY_DONE) {
+        if (target != pos) {
+          memmove(queue + target, queue + pos, entry.size);
+          for (int j = 0; j < slot_count; j++) {
+            if (slots[j].state != SLOT_IDLE && slots[j].entry == pos) {
+              slots[j].entry = target;
+            }
+          }
+        }
+        target += entry.size;
+      }
+      pos += entry.size;
+    }
+    queue_end = target;
+  }
+
+  /// Provides the position of the oldest or newest pending directory: -1 if
+  /// there is none
+  long findPending(bool newest) {
+    long result = -1;
+    for (size_t pos = 0; pos < queue_end; pos += header(pos).size) {
+      if (header(pos).state == ENTRY_PENDING) {
+        result = pos;
+        if (!newest) break;
+      }
+    }
+    return result;
+  }
+
+  /// Changes the state of all directories with the indicated state: the
+  /// reason is logged for the directories which fail
+  void changeState(EntryState from, EntryState to,
+                   const char *reason = nullptr) {
+    for (size_t pos = 0; pos < queue_end; pos += header(pos).size) {
+      Header entry = header(pos);
+      if (entry.state != from) continue;
+      if (to == ENTRY_DONE) {
+        FTPLogger::writeLogf(LOG_ERROR, "FTPTreeWalker", "%s: %s", reason,
+                             (char *)queue + pos + sizeof(Header));
+        error_count++;
+      }
+      entry.state = to;
+      memcpy(queue + pos, &entry, sizeof(Header));
+    }
+  }
+
+  /// Space was freed: the stalled directories can be tried again
+  void resumeStalled() { changeState(ENTRY_STALLED, ENTRY_PENDING); }
+
+  void failStalled() { changeState(ENTRY_STALLED, ENTRY_DONE, "queue full"); }
+
+  void failPending() { changeState(ENTRY_PENDING, ENTRY_DONE, "no session"); }
+
+  /// Starts the listing of the next queued directory
+  void startNext(Slot &slot) {
+    // a full queue is drained by listing the deepest directories first
+    bool is_full = queue_end > FTP_WALK_QUEUE_SIZE / 2;
+    if (is_full) compact();
+    long pos = findPending(is_full);
+    if (pos < 0) return;
+    slot.lease = p_mgr->acquire();
+    if (!slot.lease) return;
+    slot.entry = pos;
+    slot.header = header(pos);
+    slot.header.state = ENTRY_ACTIVE;
+    memcpy(queue + pos, &slot.header, sizeof(Header));
+    strcpy(slot.dir, (char *)queue + pos + sizeof(Header));
+    slot.line_len = 0;
+    slot.subdirs = 0;
+    slot.overflow = -1;
+    slot.names_len = 0;
+
+    FTPLogger::writeLog(LOG_DEBUG, "FTPTreeWalker", slot.dir);
+    FTPBasicAPI &api = slot.lease.api();
+    slot.is_mlsd = api.hasFeature(FEAT_MLST);
+    // the listing is read from the data connection
+    api.setModeZ(false);
+    api.setCurrentOperation(LS_OP);
+    sendCmd(slot, SLOT_PASV, api.passiveCommand(), nullptr);
+  }
+
+  void sendCmd(Slot &slot, SlotState state, const char *command,
+               const char *par) {
+    FTPBasicAPI &api = slot.lease.api();
+    api.reply().reset();
+    api.sendCmd(command, par);
+    slot.state = state;
+    slot.start_time = millis();
+  }
+
+  /// Advances the state of the slot without blocking
+  void process(Slot &slot) {
+    FTPBasicAPI &api = slot.lease.api();
+    if (is_stopped) {
+      api.abort();
+      release(slot);
+      return;
+    }
+    if (slot.state == SLOT_READ) {
+      readListing(slot);
+      return;
+    }
+    if (!api.pollReply()) {
+      if (api.isReplyOverdue(slot.start_time)) {
+        FTPLogger::writeLog(LOG_ERROR, "FTPTreeWalker", "timeout");
+        // the late reply would be taken for the next command
+        api.setBroken();
+        fail(slot);
+      }
+      return;
+    }
+    int code = api.reply().code();
+    switch (slot.state) {
+      case SLOT_PASV:
+        if (api.isEPSVRefused(code)) {
+          // EPSV is not supported: we retry with PASV
+          api.setUseEPSV(false);
+          sendCmd(slot, SLOT_PASV, api.passiveCommand(), nullptr);
+          break;
+        }
+        if ((code != 227 && code != 229) || !api.connectData()) {
+          fail(slot);
+          return;
+        }
+        sendCmd(slot, SLOT_OPEN, slot.is_mlsd ? "MLSD" : "NLST", slot.dir);
+        break;
+      case SLOT_OPEN:
+        if (code != 150 && code != 125) {
+          fail(slot);
+          return;
+        }
+        api.reply().reset();
+        slot.state = SLOT_READ;
+        slot.start_time = millis();
+        break;
+      case SLOT_CLOSE:
+        api.setCurrentOperation(NOP);
+        if (code != 226 && code != 250) {
+          fail(slot);
+          return;
+        }
+        complete(slot);
+        break;
+      default:
+        break;
+    }
+  }
+
+  /// Processes the available lines of the listing
+  void readListing(Slot &slot) {
+    FTPBasicAPI &api = slot.lease.api();
+    Client *data = api.dataClient();
+    uint8_t buffer[128];
+    int len;
+    while ((len = data->available()) > 0) {
+      if (len > (int)sizeof(buffer)) len = sizeof(buffer);
+      len = data->read(buffer, len);
+      if (len <= 0) break;
+      api.countReceived(len);
+      slot.start_time = millis();
+      for (int j = 0; j < len; j++) {
+        if (buffer[j] == '\n') {
+          endOfLine(slot);
+        } else if (slot.line_len < FTP_MAX_LINE_SIZE - 1) {
+          slot.line[slot.line_len++] = buffer[j];
+        }
+      }
+    }
+    if (data->connected() && !api.isReplyOverdue(slot.start_time)) {
+      return;
+    }
+    // end of the listing: the reply might already be available
+    if (slot.line_len > 0) endOfLine(slot);
+    api.closeData();
+    slot.state = SLOT_CLOSE;
+    slot.start_time = millis();
+  }
+
+  void endOfLine(Slot &slot) {
+    int len = slot.line_len;
+    if (len > 0 && slot.line[len - 1] == '\r') len--;
+    slot.line[len] = '\0';
+    slot.line_len = 0;
+    if (len == 0) return;
+    if (!slot.is_mlsd) {
+      addName(slot, slot.line);
+      return;
+    }
+    FTPFileInfo info;
+    if (!FTPBasicAPI::parseMLSD(slot.line, info)) return;
+    // skip the cdir and pdir entries (which may repeat the full path)
+    if (info.type != TypeFile && info.type != TypeDirectory) return;
+    visit(slot, info);
+  }
+
+  /// Processes an entry of the listing
+  void visit(Slot &slot, const FTPFileInfo &info) {
+    if (info.name[0] == '\0' || strcmp(info.name, ".") == 0 ||
+        strcmp(info.name, "..") == 0) {
+      return;
+    }
+    if (!slot.header.dirs_only && p_visitor != nullptr) {
+      entry_count++;
+      p_visitor(slot.dir, info, p_visitor_ref);
+    }
+    if (info.type != TypeDirectory) return;
+    int index = slot.subdirs++;
+    if (index < slot.header.skip || slot.overflow >= 0) return;
+    if (max_depth >= 0 && slot.header.depth >= max_depth) return;
+    char path[FTP_MAX_LINE_SIZE];
+    size_t dir_len = strlen(slot.dir);
+    if (dir_len > 0 && slot.dir[dir_len - 1] == '/') dir_len--;
+    if (dir_len + strlen(info.name) + 2 > sizeof(path)) {
+      FTPLogger::writeLog(LOG_ERROR, "FTPTreeWalker", "path too long");
+      return;
+    }
+    memcpy(path, slot.dir, dir_len);
+    path[dir_len] = '/';
+    strcpy(path + dir_len + 1, info.name);
+    if (p_filter != nullptr && !p_filter(path, p_filter_ref)) return;
+    if (!push(path, slot.header.depth + 1)) {
+      // the rest is queued by listing the directory again
+      slot.overflow = index;
+    }
+  }
+
+  /// Collects the names of a NLST listing
+  void addName(Slot &slot, const char *line) {
+    // some servers provide the path
+    const char *last = strrchr(line, '/');
+    const char *name = last != nullptr ? last + 1 : line;
+    size_t len = strlen(name) + 1;
+    if (slot.names_len + len > slot.names_size) {
+      size_t size = slot.names_size == 0 ? 256 : slot.names_size * 2;
+      while (size < slot.names_len + len) size *= 2;
+      char *names = (char *)realloc(slot.names, size);
+      if (names == nullptr) return;
+      slot.names = names;
+      slot.names_size = size;
+    }
+    memcpy(slot.names + slot.names_len, name, len);
+    slot.names_len += len;
+  }
+
+  /// Determines the types of the NLST entries with pipelined SIZE and MDTM
+  /// commands
+  bool statNames(Slot &slot) {
+    const int batch = 16;
+    char *paths[batch];
+    const char *names[batch];
+    FTPFileInfo infos[batch];
+    size_t pos = 0;
+    while (pos < slot.names_len) {
+      int count = 0;
+      for (; pos < slot.names_len && count < batch; count++) {
+        names[count] = slot.names + pos;
+        pos += strlen(names[count]) + 1;
+        size_t len = strlen(slot.dir) + strlen(names[count]) + 2;
+        paths[count] = (char *)malloc(len);
+        snprintf(paths[count], len, "%s/%s", slot.dir, names[count]);
+      }
+      bool ok = slot.lease.api().stat((const char **)paths, count, infos);
+      for (int j = 0; j < count; j++) {
+        free(paths[j]);
+        if (!ok) continue;
+        infos[j].name = names[j];
+        visit(slot, infos[j]);
+      }
+      if (!ok) return false;
+    }
+    return true;
+  }
+
+  /// The listing has been completed successfully
+  void complete(Slot &slot) {
+    if (!slot.is_mlsd && !statNames(slot)) {
+      fail(slot);
+      return;
+    }
+    if (!slot.header.dirs_only) directory_count++;
+    if (slot.overflow >= 0) {
+      // the directory is listed again to queue the remaining subdirectories
+      relist_count++;
+      bool is_stalled = slot.overflow == slot.header.skip;
+      slot.header.state = is_stalled ? ENTRY_STALLED : ENTRY_PENDING;
+      slot.header.skip = slot.overflow;
+      slot.header.dirs_only = true;
+      memcpy(queue + slot.entry, &slot.header, sizeof(Header));
+      release(slot);
+      if (!is_stalled) resumeStalled();
+      return;
+    }
+    finish(slot);
+  }
+
+  void fail(Slot &slot) {
+    FTPBasicAPI &api = slot.lease.api();
+    FTPLogger::writeLog(LOG_ERROR, "FTPTreeWalker", slot.dir);
+    if (slot.state == SLOT_READ) {
+      api.abort();
+    } else {
+      api.closeData();
+    }
+    api.setCurrentOperation(NOP);
+    error_count++;
+    finish(slot);
+  }
+
+  /// The directory is removed from the queue
+  void finish(Slot &slot) {
+    slot.header.state = ENTRY_DONE;
+    memcpy(queue + slot.entry, &slot.header, sizeof(Header));
+    release(slot);
+    resumeStalled();
+  }
+
+  /// The session is released so that it can be reused
+  void release(Slot &slot) {
+    slot.state = SLOT_IDLE;
+    slot.lease.release();
+    free(slot.names);
+    slot.names = nullptr;
+    slot.names_len = 0;
+    slot.names_size = 0;
+  }
+};
+
+}  // namespace ftp_client